@@ -1,6 +1,25 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_ENABLED
+#endif
 
 /* This program emulates the register state of the CPU.
 It calls each function and creates the necessary registers, flags, 
@@ -18,16 +37,24 @@ There are 3 options for Src2. If 25=I=1, then src2 is an immediate value. imm (1
 If 25=I=0 then the src is a register. There are 2 register options.
 Src2 = (shamt5 = shift by constant (11:7), sh=type of shift (6:5) = 00=LSL, 01=LSR, 10=ASR, 11=ROR, 0 (4), reg Rm (3:0)).
 Src2 = (Rs another reg (11:8), 0 (7), sh (type of shift 6:5), 1 (4), Rm = reg (3:0)). Ex. Add R5, R6, R7 -> Rn = 6, Rd = 5, Rm = 7.
+Multiplies have op=00, 25:24=00 and 7:4=1001: 23=long (UMULL, SMULL, UMLAL, SMLAL), 22=signed, 21=A (accumulate), 20=S,
+Rd or RdHi (19:16), Ra or RdLo (15:12), Rs (11:8), Rm (3:0). SDIV and UDIV are 27:20=0111 0001 / 0111 0011 with
+7:4=0001, Rd (19:16), Rm (11:8) and Rn (3:0).
 
 2. Memory Instructions (STR (store into memory), LDR (load from memory into register), STRB (store byte into memory), 
 LDRB (load byte from memory into register)). 
 Memory instruction has: cond, op=01, funct (25:20 - I=25 (25=1 for immediate or 25=0 for reg).
 24=P (P=pre-index). 23=U. 22=B. 21=W (write back). 20=L (load and byte). See examples below)
 I = imm (0=imm, U=subtr from base), (1=reg , U = add to base), P (pre-index) and W (write-back) specify index mode for mem instr. 
-P=0,W=0 (post-ind). P=0, W = 1 (ind not support), P = 1, Off = 0 (Offset), P = 1, W = 1 (pre-ind), L=0 & B = 0 =STR, L= 0 & B = 1 =STRB, 
+P=0,W=0 (post-ind). P=0, W = 1 (user mode access, runs as post-ind), P = 1, W = 0 (Offset), P = 1, W = 1 (pre-ind), L=0 & B = 0 =STR, L= 0 & B = 1 =STRB, 
 L=1 & B=0 =LDR, L=1 & B=1=LDRB. 
-Memory also has: Rn (base reg/1st reg 19:16), Rd (15:12), Src2 (11:0) = 2 opt = imm12, OR, (11:7=shat5, 6:5=sh, 4=1, Rm=3:0). 
+Memory also has: Rn (base reg/1st reg 19:16), Rd (15:12), Src2 (11:0) = 2 opt = imm12, OR, (11:7=shat5, 6:5=sh, 4=0, Rm=3:0). 
 Offset = dist from begin to a point.
+Halfword and signed loads and stores (STRH, LDRH, LDRSB, LDRSH) have op=00, 7=1 and 4=1, with 6:5 = 01 (H), 10 (SB) or 11 (SH).
+P, U, W and L are the same. 22=1 for imm8 (11:8 and 3:0), 22=0 for Rm (3:0) with no shift.
+Load and store multiple (LDM, STM) are op=10 with 25=0: 24=P, 23=U, 22=S, 21=W, 20=L, Rn (19:16) and a register
+list (15:0, bit i = register i). P and U give the mode (DA, IA, DB, IB). PUSH is STMDB sp! and POP is LDMIA sp!.
+The lowest register always goes to the lowest address. S=1 (user registers, exception return) is not supported.
 
 3. Branch Instuctions: cond (31:28), op (27:26 = 10), funct (25:24. 25=1, 24=0 if Branch, 24=1 if Branch and link), and 
 imm24 (23:0 - immediate value used for instruction address of where to branch to).
@@ -52,811 +79,11823 @@ Rd (15:12. Is the destination register. Where the value will be put into).
 Src2 (11:0 - see Data Instructions for 3 options of Src2).
 
 
-to run this program you must have a Raspberry Pi. In terminal call: 
+To run this program call:
 1. make
-2. ./armemu */
-
-
-/* Call ARM functions */
-int sum_array_a(int *x, int y);
-int find_max_a(int *x, int y);
-int fib_iter_a(int n);
-int fib_rec_a(int n);
+2. ./armemu
+
+The guest code is not linked into armemu, it is loaded from a 32-bit ARM ELF
+file (or a flat binary, which is loaded at ARM_RAW_BASE). ./armemu runs the
+tests on the functions in guest.elf, which is built from the .s files and
+checked in so no ARM toolchain is needed (make guest rebuilds it, see the
+Makefile). ./armemu prog.elf fib_rec_a 25 calls one function of any image
+and prints what it returns, the function can also be given as an address.
+
+make first builds mkdecode, which turns the encodings in arm_insns.def into the
+decode table arm_decode_table.h. To support a new instruction add its encoding
+there, an OP_ value and a handler in arm_handlers.
+
+There are five execution engines. "interp" runs one instruction at a time through
+arm_state_execute_one. "threaded" jumps straight from one handler to the next with
+computed gotos. "block" translates each basic block once, fusing common pairs
+(push, pop, cmp and branch) into one op, and links blocks to the
+blocks that follow them. "jit" is the block engine, but a block that has run
+jit_threshold times is compiled to x86-64 code (on other hosts it is the block engine).
+"lockstep" only applies to batch mode (below), it runs 4 calls at a time (8
+with AVX2) with their registers in vectors.
+The default is picked at build time (make CFLAGS=-DDEFAULT_ENGINE=ENGINE_THREADED)
+and can be changed at run time with ./armemu -e threaded (and -t 100 for the threshold).
+The block and jit engines also spot loops that sum up or take the maximum of an
+array and run them on the host a vector at a time (see arm_idiom_find), -l off
+turns that off.
+
+make armemu_prof builds armemu with a profiler. armemu_prof -p prof ... runs
+everything on the interp engine and writes the hottest instructions, blocks
+and branches and the call graph to prof.txt, and the call stacks to
+prof.folded for flamegraph.pl.
+
+./armemu -m arm1176 ... runs on the interp engine through a timing model of
+the ARM1176 (pipeline, branch prediction and L1 caches, which can be resized,
+ex. -m i=8k/2/32,d=16k/4/32,mem=80) and prints estimated cycles, stalls, miss
+rates and mispredictions next to the instruction counts.
+
+./armemu -r run.trace ... writes a compact trace of every instruction and
+memory access to run.trace. make armtrace builds the tool that reads it:
+armtrace run.trace prints its size, armtrace run.trace 123456 replays it and
+prints the registers just before instruction 123456.
+
+./armemu -M on ... runs on the interp engine and remembers what calls to
+pure functions (ones that only use r0-r3 and their own stack, like
+fib_rec_a) return, so a later call with the same arguments is not run
+again (see arm_memo_execute). Hits, misses and invalidations are printed
+next to the instruction counts.
+
+make armemu_aot translates the guest functions listed in AOT_FUNCS (in the
+Makefile) to C with armemu-aot ahead of time and links them into
+armemu_aot, which runs them natively whenever the guest calls them and
+everything else on interp (see arm_aot_execute). -a off turns that off.
+
+./armemu -b fib_rec_a [-j threads] is batch mode. Each line of stdin is one
+call (its arguments), the calls are spread over all cores (or -j threads) by
+arm_batch_run, and the results come out in the same order. With -q quantum
+or -L limit the calls all run on one thread instead, taking turns of quantum
+instructions (arm_batch_sched), and a call that runs more than limit
+instructions is stopped.
+
+./armemu -f find_max_a -A buf,len4 fuzzes a guest function (see arm_fuzz):
+it runs it on mutated inputs (-n runs, from -S seed), keeps the ones that
+reach new branch edges and prints every new fault, stack overflow,
+undecoded instruction and hang (more than -L limit instructions).
+
+./armemu -s fib.snap -L 100000 guest.elf fib_rec_a 25 writes a snapshot of
+the call after 100000 instructions (see arm_state_snapshot) and then runs it
+to the end, ./armemu -R fib.snap guest.elf fib_rec_a 25 maps that file back
+in and carries on from there. The image and call must be the same.
+
+make bench (./armemu -B trials) times every engine on the guest functions with
+big inputs and prints MIPS, ns per instruction, host IPC and peak RSS as JSON.
+armemu_aot only takes -B with -a off, as the translated functions would
+otherwise stand in for every engine.
+
+Guests only see their own address space (struct arm_mem). The loader maps
+the segments of the image into it and the tests map the arrays they pass
+with arm_mem_map_host, and a load, store or fetch outside of what is mapped
+stops the guest with a fault rather than touching host memory, even in the
+part of a page that a mapping does not cover. Stacks are whole pages with
+a free page under them, so a guest that overflows its stack faults */
 
 #define NREGS 16
 #define SP 13
 #define LR 14
 #define PC 15
 
-/* Used to create emulated CPU */
-struct arm_state {
+/* Condition codes (bits 31:28 of every instruction) */
+#define COND_AL 0b1110
+#define COND_NV 0b1111
+
+/* NZCV are kept in bits 31:28 of cpsr */
+#define CPSR_N (1 << 31)
+#define CPSR_Z (1 << 30)
+#define CPSR_C (1 << 29)
+#define CPSR_V (1 << 28)
+
+/* What the last flag setting instruction did, see arm_flags_nzcv */
+enum arm_flags_op {
+    FLAGS_NONE,
+    FLAGS_SUB,
+    FLAGS_ADD,
+    FLAGS_LOGIC
+};
 
-    unsigned int regs[NREGS];
-    unsigned int cpsr;
-    unsigned int stack_size;
-    unsigned char *stack;
+/* Number of entries in the decode cache. Must be a power of two. */
+#define DCACHE_SIZE 1024
+#define DCACHE_INDEX(pc) (((pc) >> 2) & (DCACHE_SIZE - 1))
+
+struct arm_state;
+struct arm_decoded;
+
+/* Instructions the emulator knows how to execute. Used as the index into the
+dispatch table of the threaded engine and the handler table. The data
+processing ops are in cmd (24:21) order. arm_insns.def says which encodings
+belong to which op. */
+enum arm_op {
+    OP_UNKNOWN,
+    OP_AND,
+    OP_EOR,
+    OP_SUB,
+    OP_RSB,
+    OP_ADD,
+    OP_ADC,
+    OP_SBC,
+    OP_RSC,
+    OP_TST,
+    OP_TEQ,
+    OP_CMP,
+    OP_CMN,
+    OP_ORR,
+    OP_MOV,
+    OP_BIC,
+    OP_MVN,
+    OP_MUL,
+    OP_MLA,
+    OP_UMULL,
+    OP_UMLAL,
+    OP_SMULL,
+    OP_SMLAL,
+    OP_SDIV,
+    OP_UDIV,
+    OP_LDR,
+    OP_STR,
+    OP_LDRB,
+    OP_STRB,
+    OP_LDRH,
+    OP_STRH,
+    OP_LDRSB,
+    OP_LDRSH,
+    OP_LDM,
+    OP_STM,
+    OP_B,
+    OP_BL,
+    OP_BX,
+    OP_COUNT
+};
 
-    unsigned int eq;
-    unsigned int ne;
-    unsigned int gt;
-    unsigned int lt;
-    unsigned int z;
-    unsigned int n;
-    unsigned int v;
+/* Pairs of instructions the block engine runs as one op, see arm_fuse */
+enum arm_fusion {
+    FUSE_NONE,
+    FUSE_PUSH,
+    FUSE_POP,
+    FUSE_CMP_B,
+    FUSE_COUNT
+};
 
-    int num_instr;
-    int data_instr;
-    int b_instr;
-    int mem_instr;
+/* The forms Src2 of a data instruction can take */
+enum arm_operand_form {
+    OPND_IMM,
+    OPND_REG,
+    OPND_SHIFT_IMM,
+    OPND_SHIFT_REG
+};
 
+/* How a load or store uses its offset (P and W). The user mode forms
+(P = 0, W = 1) run as post-indexed, the emulator is always in user mode */
+enum arm_index {
+    INDEX_OFFSET,
+    INDEX_PRE,
+    INDEX_POST
 };
 
-/* Create emulated CPU */
-struct arm_state *arm_state_new(unsigned int stack_size, unsigned int *func,
-                                unsigned int arg0, unsigned int arg1,
-                                unsigned int arg2, unsigned int arg3) {
+/* Shift types (bits 6:5), RRX is ROR #0 in the immediate form */
+enum arm_shift_type {
+    SHIFT_LSL,
+    SHIFT_LSR,
+    SHIFT_ASR,
+    SHIFT_ROR,
+    SHIFT_RRX
+};
 
-    struct arm_state *as;
-    int i;
+/* Execution engines, see arm_state_execute */
+enum arm_engine {
+    ENGINE_INTERP,
+    ENGINE_THREADED,
+    ENGINE_BLOCK,
+    ENGINE_JIT,
+    ENGINE_LOCKSTEP,
+    ENGINE_COUNT
+};
 
-    as = (struct arm_state *) malloc(sizeof(struct arm_state));
-    if (as == NULL) {
-        printf("malloc() failed, exiting.\n");
-        exit(-1);
-    }
+/* Why arm_state_run stopped. RUN_DONE is a return to PC = 0 (r0 is the
+result), RUN_BUDGET is running out of instructions and RUN_FAULT is a
+fault (see arm_fault) */
+enum arm_run_status {
+    RUN_DONE,
+    RUN_BUDGET,
+    RUN_FAULT
+};
 
-    as->stack = (unsigned char *) malloc(stack_size);
-    if (as->stack == NULL) {
-        printf("malloc() failed, exiting.\n");
-        exit(-1);
-    }
+/* Priority levels of arm_sched and the default quantum (instructions) of batch mode with -L */
+#define SCHED_LEVELS 4
+#define SCHED_QUANTUM 10000
 
-    as->stack_size = stack_size;
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE ENGINE_INTERP
+#endif
 
-    /* Initialize all registers to zero. */
-    for (i = 0; i < NREGS; i++) {
-        as->regs[i] = 0;
-    }
+/* Image that is loaded when none is given on the command line */
+#ifndef DEFAULT_IMAGE
+#define DEFAULT_IMAGE "guest.elf"
+#endif
 
-    as->regs[PC] = (unsigned int) func;
-    as->regs[SP] = (unsigned int) as->stack + as->stack_size;
+/* Number of times a block runs before the jit engine compiles it */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 50
+#endif
 
-    as->regs[0] = arg0;
-    as->regs[1] = arg1;
-    as->regs[2] = arg2;
-    as->regs[3] = arg3;
+/* Whether the block and jit engines look for reduction loops to run on the
+host (see arm_idiom_find), 0 or 1 */
+#ifndef LOOP_IDIOMS
+#define LOOP_IDIOMS 1
+#endif
 
-    as->eq = 0;
-    as->ne = 0;
-    as->gt = 0;
-    as->lt = 0;
+/* Size of the executable buffer the jit engine compiles blocks into */
+#define JIT_BUF_SIZE (1024 * 1024)
 
-    as->z = 0;
-    as->n = 0;
-    as->v = 0;
+const char * const arm_engine_names[ENGINE_COUNT] = {"interp", "threaded", "block", "jit", "lockstep"};
 
-    as->num_instr = 0;
-    as->data_instr = 0;
-    as->b_instr = 0;
-    as->mem_instr = 0;
+struct arm_prof;
+struct arm_timing;
+struct arm_trace;
+struct arm_memo;
 
-    return as;
-}
+/* Settings chosen on the command line that are copied into every arm_state */
+struct arm_config {
 
-/* Used to free memory from stack */
-void arm_state_free(struct arm_state *as) {
+    enum arm_engine engine;
+    unsigned int jit_threshold;
+    bool idioms;
+    struct arm_timing *timing;
+    struct arm_trace *trace;
+    struct arm_memo *memo;
 
-    free(as->stack);
-    free(as);
+#ifdef ARM_AOT
+    bool aot;
+#endif
 
-}
+#ifdef ARM_PROFILE
+    struct arm_prof *prof;
+#endif
 
-/* print register values */
-void arm_state_print(struct arm_state *as) {
+};
 
-    int i;
-    printf("stack size = %d\n", as->stack_size);
+typedef void (*arm_handler)(struct arm_state *as, struct arm_decoded *di);
 
-    for (i = 0; i < NREGS; i++) {
-        printf("regs[%d] = (%X) %d\n", i, as->regs[i], (int) as->regs[i]);
-    }
+/* A pre-decoded instruction word. The first time a PC is executed the word is
+decoded once into this record (handler, register numbers, immediate, shift and cond),
+and every later visit to the same PC runs the handler on the record directly.
+pc is the tag of the cache entry, 0 means the entry is empty. */
+struct arm_decoded {
 
-}
+    unsigned int pc;
+    unsigned int iw;
+    arm_handler handler;
 
-/* Determines if an add instruction (see info above for more details) */
-bool iw_is_add_instruction(unsigned int iw) {
+    unsigned char op;
+    unsigned char cond;
+    unsigned char setflags;
+    unsigned char rd;
+    unsigned char rn;
+    unsigned char rm;
+    unsigned char rs;
+    unsigned char form;
+    unsigned char shift_type;
+    unsigned char shift_amount;
 
-    unsigned int op, opcode;
+    /* FUSE_NONE, or the pair this op and the next one in its block make */
+    unsigned char fused;
 
-    op = (iw >> 26) & 0b11;
-    opcode = (iw >> 21) & 0xF;
+    /* W, Rn is updated with the address after the transfer */
+    unsigned char writeback;
 
-    return (op == 0) && (opcode == 4);
+    /* INDEX_*, for the single register loads and stores */
+    unsigned char index;
 
-}
+    unsigned int imm;
+
+};
 
-/* Determines if an sub instruction (see info above for more details) */
-bool iw_is_sub_instruction(unsigned int iw) {
+/* Sizes of the block cache used by the block engine */
+#define BLOCK_MAX_OPS 32
+#define BLOCK_POOL_SIZE 512
+#define BLOCK_OPS_SIZE 4096
+#define BCACHE_SIZE 256
+#define BCACHE_INDEX(pc) (((pc) >> 2) & (BCACHE_SIZE - 1))
+
+/* Stores into a page that holds translated code flush the block cache */
+#define CODE_PAGE_SHIFT 12
+#define CODE_PAGE_COUNT (1 << (32 - CODE_PAGE_SHIFT))
+
+/* Reduction loops arm_idiom_find recognises, see arm_idiom_run */
+enum arm_idiom_kind {
+    IDIOM_NONE,
+    IDIOM_SUM,
+    IDIOM_MAX
+};
 
-    unsigned int op, opcode;
+/* A loop found by arm_idiom_find. The block holding it is the loop header
+cmp index, count; beq out, and the body (from the end of the header to
+end_pc) loads value from ptr with a post-increment of 4, folds it into acc,
+adds 1 to index and branches back to the header. IDIOM_MAX keeps the
+largest of acc and the values compared as signed numbers after an xor with
+flip, which also covers min (flip has the low 31 bits set) and unsigned
+compares (flip has the top bit set). The counts are those of one trip
+around the loop */
+struct arm_idiom {
+
+    unsigned char kind;
+    unsigned char index;
+    unsigned char count;
+    unsigned char ptr;
+    unsigned char value;
+    unsigned char acc;
+
+    /* IDIOM_MAX, the body compare is cmp value, acc (else cmp acc, value) */
+    unsigned char value_first;
+
+    unsigned int flip;
+    unsigned int end_pc;
 
-    op = (iw >>  26) & 0b11;
-    opcode = (iw >> 21) & 0xF;
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
 
-    return (op == 0) && (opcode == 2);
+};
 
-}
+/* A straight-line run of instructions that ends with a branch or a write to PC.
+succ_pc/succ remember the blocks that ran after this one (for a branch, slot 0 is
+the target and slot 1 is the next instruction), so a hot loop goes from block to
+block without looking anything up. */
+struct arm_block {
 
-/* Determines if branch instruction (see info above for more details) */
-bool iw_is_b_instruction(unsigned int iw) {
+    unsigned int pc;
+    unsigned int end_pc;
+    int nops;
+    struct arm_decoded *ops;
 
-    unsigned int op, funct;
+    unsigned int succ_pc[2];
+    struct arm_block *succ[2];
 
-    op = (iw >> 25) & 0b111;
-    funct = (iw >> 24) & 0b1;
+    /* Only used by the jit engine. code is NULL until the block is compiled.
+    exit_jmp[i] is the jump that leaves the compiled block for succ_pc[i],
+    it is patched to go straight into the compiled successor. */
+    unsigned int count;
+    struct arm_block *(*code)(struct arm_state *as);
+    unsigned char *body;
+    unsigned char *exit_jmp[2];
+    unsigned char *epilogue;
 
-    return (op == 5) && (funct == 0);
+    /* kind is IDIOM_NONE unless the block is the header of a reduction loop */
+    struct arm_idiom idiom;
 
-}
+};
 
-/* Determines if branch and link instruction (see info above for more details) */
-bool iw_is_bl_instruction(unsigned int iw) {
+struct arm_bcache {
 
-    unsigned int op, funct;
+    struct arm_block *table[BCACHE_SIZE];
 
-    op = (iw >> 25) & 0b111;
-    funct = (iw >> 24) & 0b1;
+    struct arm_block blocks[BLOCK_POOL_SIZE];
+    int nblocks;
 
-    return (op == 5) && (funct == 1);
+    struct arm_decoded ops[BLOCK_OPS_SIZE];
+    int nops;
 
-}
+    unsigned int flushes;
 
-/* Determines if mov instruction (see info above for more details) */
-bool iw_is_mov_instruction(unsigned int iw) {
+    unsigned char *jit_buf;
+    unsigned int jit_used;
 
-    unsigned int op, opcode;
+    unsigned char code_pages[CODE_PAGE_COUNT / 8];
 
-    op = (iw >>  26) & 0b11;
-    opcode = (iw >> 21) & 0xF;
+};
 
-    return ((op == 0b00) && (opcode == 0b1101));
+/* Guest address space. Guest addresses are 32 bits and are mapped a page at
+a time onto host memory through a two level page table (bits 31:22 pick the
+second level table, bits 21:12 the page). Each arm_state also has a small
+direct mapped TLB for loads and one for stores, so a load or store that hits
+costs one compare and one add. */
+#define ARM_PAGE_SHIFT 12
+#define ARM_PAGE_SIZE (1 << ARM_PAGE_SHIFT)
+#define ARM_PAGE_MASK (ARM_PAGE_SIZE - 1)
+#define ARM_PAGE_ROUND(size) (((size) + ARM_PAGE_MASK) & ~ARM_PAGE_MASK)
+#define ARM_L1_SIZE 1024
+#define ARM_L2_SIZE 1024
+
+/* Page permissions. ARM_PAGE_CODE is set by the emulator on pages that
+instructions have been fetched from, stores to them never go through the
+TLB so the decoded copies can be thrown away. ARM_PAGE_STACK marks the
+stack of a state and ARM_PAGE_CLEAN a page that has not been written since
+the snapshot its address space tracks (see arm_state_snapshot), which is
+kept out of the TLB the same way */
+#define ARM_PROT_READ 1
+#define ARM_PROT_WRITE 2
+#define ARM_PROT_EXEC 4
+#define ARM_PAGE_CODE 8
+#define ARM_PAGE_STACK 16
+#define ARM_PAGE_CLEAN 32
+
+/* arm_mem_map_host puts mappings from here up, with a free page between them
+so running off the end of one faults */
+#define ARM_MAP_BASE 0x00010000
+
+#define ARM_TLB_SIZE 256
+#define ARM_TLB_INDEX(addr) (((addr) >> ARM_PAGE_SHIFT) & (ARM_TLB_SIZE - 1))
+
+/* Never equal to an address masked with ARM_TLB_MASK, which has bits 11:2 clear */
+#define ARM_TLB_EMPTY 0xFFFFFFFF
+
+/* Keeps the page and the low bits an access of size bytes must have clear,
+so an unaligned access misses */
+#define ARM_TLB_MASK_SIZE(size) (~ARM_PAGE_MASK | ((size) - 1))
+#define ARM_TLB_MASK ARM_TLB_MASK_SIZE(4)
+
+/* Why a guest stopped early, see arm_fault */
+enum arm_fault_kind {
+    FAULT_NONE,
+    FAULT_READ,
+    FAULT_WRITE,
+    FAULT_FETCH,
+    FAULT_UNDEFINED
+};
 
-}
+const char * const arm_fault_names[] = {"none", "read", "write", "fetch", "undefined"};
 
-/* Determines if mvn instruction (see info above for more details) */
-bool iw_is_mvn_instruction(unsigned int iw) {
+/* Bytes lo to hi - 1 of the page are what was mapped */
+struct arm_page {
 
-    unsigned int op, opcode;
+    unsigned char *host;
+    unsigned int prot;
+    unsigned short lo;
+    unsigned short hi;
 
-    op = (iw >> 26) & 0b11;
-    opcode = (iw >> 21) & 0xF;
+};
 
-    return (op == 0b00) && (opcode == 0xF);
+struct arm_snapshot;
 
-}
+struct arm_mem {
 
-/* Determines if cmp instruction (see info above for more details) */
-bool iw_is_cmp_instruction(unsigned int iw) {
+    struct arm_page *l2[ARM_L1_SIZE];
+    unsigned int next_map;
 
-    unsigned int op, opcode;
+    /* The snapshot whose pages are being tracked, or NULL */
+    struct arm_snapshot *snap;
 
-    op = (iw >> 26) & 0b11;
-    opcode = (iw >> 21) & 0xF;
+    /* Goes up each time a state writes to code or starts running a page,
+    so the other states know their decoded code may be stale (see
+    arm_code_sync) */
+    unsigned int code_gen;
 
-    return (op == 0) && (opcode == 10);
+};
 
-}
+/* tag is the guest page (ARM_TLB_EMPTY if none), host address = guest
+address + addend */
+struct arm_tlb_entry {
 
-/* Determines if ldr instruction (see info above for more details) */
-bool iw_is_ldr_instruction(unsigned int iw) {
+    unsigned int tag;
+    uintptr_t addend;
 
-    unsigned int opcode, l_flag, b_flag;
+};
 
-    opcode = (iw >> 26) & 0b11;
-    l_flag = (iw >> 20) & 0b1;
-    b_flag = (iw >> 22) & 0b1;
+/* Used to create emulated CPU */
+struct arm_state {
 
-    return (opcode == 1) && (l_flag == 1) && (b_flag == 0);
+    unsigned int regs[NREGS];
+    unsigned int cpsr;
+    unsigned int stack_size;
+    unsigned char *stack;
 
-}
+    /* The address space the state runs in (it can be shared by several
+    states), where the stack is mapped in it and this state's TLBs */
+    struct arm_mem *mem;
+    unsigned int stack_addr;
+    struct arm_tlb_entry tlb_read[ARM_TLB_SIZE];
+    struct arm_tlb_entry tlb_write[ARM_TLB_SIZE];
+
+    /* mem->code_gen when the caches of this state were last brought up to date */
+    unsigned int code_gen;
+
+    /* Set by arm_fault when the guest is stopped for a bad access */
+    unsigned int fault;
+    unsigned int fault_addr;
+    unsigned int fault_pc;
+
+    /* Flags are worked out lazily. A flag setting instruction only stores
+    what it did (flag_op) and its operands (flag_a, flag_b), and NZCV in cpsr
+    is brought up to date when a condition or a read of cpsr needs it */
+    unsigned int flag_op;
+    unsigned int flag_a;
+    unsigned int flag_b;
+
+    /* Instructions run, whether or not their condition passed */
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
 
-/* Determines if str instruction (see info above for more details) */
-bool iw_is_str_instruction(unsigned int iw) {
+    struct arm_decoded *dcache;
+    struct arm_bcache *bcache;
+    enum arm_engine engine;
+    unsigned int jit_threshold;
+    bool idioms;
 
-    unsigned int opcode, l_flag, b_flag;
+    /* If not NULL every instruction is timed here (see arm_timing_execute) */
+    struct arm_timing *timing;
 
-    opcode = (iw >> 26) & 0b11;
-    l_flag = (iw >> 20) & 0b1;
-    b_flag = (iw >> 22) & 0b1;
-    return (opcode == 1) && (l_flag == 0) && (b_flag == 0);
+    /* If not NULL every instruction is written to this trace (see arm_trace_execute) */
+    struct arm_trace *trace;
 
-}
+    /* If not NULL pure calls are kept here and reused (see arm_memo_execute) */
+    struct arm_memo *memo;
 
-/* Determines if the instruction is valid and should be executed. 
-Ex if instruction is addeq, it checks if z flag = 1 and cond = 0000
-If these are both met, then the instruction should be executed. If not,
-then in the program will skip to the next instruction. See info above for more details) */
-bool is_valid(struct arm_state *as, unsigned int cond) {
+    /* If not NULL the branch handlers count every edge here (see arm_cov_edge) */
+    unsigned char *cov;
 
-    bool cond_valid = false;
+#ifdef ARM_AOT
+    /* Calls to translated functions run their native code (see arm_aot_execute) */
+    bool aot;
+#endif
 
-    if(cond == 0b0000) {
-        if(as->z == 1 && as->eq == 1) {
-            cond_valid = true;
-        }
+#ifdef ARM_PROFILE
+    /* If not NULL every instruction is recorded here (see arm_prof_execute) */
+    struct arm_prof *prof;
+#endif
 
-    } else if(cond == 0b0001) {
-        if(as->ne == 1) {
-            cond_valid = true;
-        }
+};
 
-    } else if(cond == 0b1011) {
-        if(as->lt == 1) {
-            cond_valid = true;
-        }
+/* Makes an empty guest address space. Returns NULL if there is not enough memory */
+struct arm_mem *arm_mem_new(void) {
 
-    } else if(cond == 0b1100) {
-        if(as->z !=1 && as->n == as->v && as->gt == 1) {
-            cond_valid = true;
-        }
+    struct arm_mem *mem;
 
-    } else if(cond == 0b1110) {
-        cond_valid = true;
+    mem = (struct arm_mem *) calloc(1, sizeof(struct arm_mem));
+    if (mem == NULL) {
+        return NULL;
     }
 
-    return cond_valid;
-
-}
+    mem->next_map = ARM_MAP_BASE;
 
-/* Gets all information for Data Instruction (see above for details)
-Determines if it should be executed (ex. if addeq, but the values do not equal, 
-then do not execute and skip to next instruction (PC += 4)). If it is valid,
-determine if it uses an immediate value or value from a register. Adds values
-and puts value in destination register. Then PC += 4 to get next instruction */
-void execute_add_instruction(struct arm_state *as, unsigned int iw) {
+    return mem;
 
-    unsigned int rd, rn, value, immediate, cond;
+}
 
-    as->num_instr++;
-    as->data_instr++;
+/* Frees the page tables. The host memory that was mapped is not touched */
+void arm_mem_free(struct arm_mem *mem) {
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xFF;
-    immediate = (iw >> 25) &0b1;
-    cond = (iw >> 28) & 0xF;
+    int i;
 
-    if(is_valid(as, cond)) {
+    for(i = 0; i < ARM_L1_SIZE; i++) {
+        free(mem->l2[i]);
+    }
 
-    	if(immediate > 0) {
+    free(mem);
 
-	       value = iw & 0xFF;
-	       as->regs[rd] = as->regs[rn] + value;
+}
 
-    	} else {
-	       value = iw & 0xF;
-    	   as->regs[rd] = as->regs[rn] + as->regs[value];
-    	}
+/* The page table entry for addr, or NULL if there is no second level table */
+static inline struct arm_page *arm_mem_page(struct arm_mem *mem, unsigned int addr) {
 
-	   as->regs[PC] += 4;
+    struct arm_page *l2 = mem->l2[addr >> 22];
 
-    } else {
-    	as->regs[PC] += 4;
+    if(l2 == NULL) {
+        return NULL;
     }
 
+    return &l2[(addr >> ARM_PAGE_SHIFT) & (ARM_L2_SIZE - 1)];
+
 }
 
-/* Gets all information for Data Instruction (see above for details)
-Determines if it should be executed (ex. if subeq, but the values do not equal, 
-then do not execute and skip to next instruction (PC += 4)). If it is valid,
-determine if it uses an immediate value or value from a register. Subtracts values
-and puts value in destination register. Then PC += 4 to get next instruction */
-void execute_sub_instruction(struct arm_state *as, unsigned int iw) {
+/* Maps size bytes of host memory at host to guest address guest with the
+ARM_PROT_* bits in prot. Whole pages are mapped, so guest and host must have
+the same offset in their page. Returns 0, or -1 if the offsets differ, a page
+is already mapped somewhere else or there is not enough memory */
+int arm_mem_map(struct arm_mem *mem, unsigned int guest, void *host, unsigned int size,
+                unsigned int prot) {
 
-    unsigned int rd, rn, rm, value, immediate, cond;
+    unsigned long long addr, end, lo, hi;
+    unsigned char *page_host;
+    struct arm_page *page;
 
-    as->num_instr++;
-    as->data_instr++;
+    if(((guest ^ (uintptr_t) host) & ARM_PAGE_MASK) != 0 || size == 0
+       || (unsigned long long) guest + size > 0x100000000ULL) {
+        return -1;
+    }
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
-    immediate = (iw >> 25) & 0b1;
-    cond = (iw >> 28) & 0xF;
+    page_host = (unsigned char *) host - (guest & ARM_PAGE_MASK);
+    end = (unsigned long long) guest + size;
 
-    if(is_valid(as, cond)) {
+    for(addr = guest & ~ARM_PAGE_MASK; addr < end; addr += ARM_PAGE_SIZE) {
 
-        if(immediate > 0) {
-    	   value = iw & 0xFF;
-	       as->regs[rd] = as->regs[rn] - value;
+        if(mem->l2[addr >> 22] == NULL) {
+            mem->l2[addr >> 22] = (struct arm_page *) calloc(ARM_L2_SIZE, sizeof(struct arm_page));
+            if(mem->l2[addr >> 22] == NULL) {
+                return -1;
+            }
+        }
 
-        } else {
-	       value = iw & 0xF;
-	       as->regs[rd] = as->regs[rn] - as->regs[value];
-    	}
+        page = arm_mem_page(mem, addr);
+        if(page->host != NULL && page->host != page_host) {
+            return -1;
+        }
+
+        lo = addr < guest ? guest - addr : 0;
+        hi = end < addr + ARM_PAGE_SIZE ? end - addr : ARM_PAGE_SIZE;
+        if(page->host != NULL) {
+            lo = lo < page->lo ? lo : page->lo;
+            hi = hi > page->hi ? hi : page->hi;
+        }
 
- 	    as->regs[PC] += 4;
+        page->host = page_host;
+        page->prot = prot;
+        page->lo = lo;
+        page->hi = hi;
+        page_host += ARM_PAGE_SIZE;
 
-    } else {
-    	as->regs[PC] += 4;
     }
 
-}
+    return 0;
 
-/* Gets all information for Data Instruction (see above for details)
-Determines if it should be executed (ex. if addeq, but the values do not equal, 
-then do not execute and skip to next instruction (PC += 4)). If it is valid,
-determine if it uses an immediate value or value from a register. 
-If value is immediate then it is negative, then mask the bits and put masked bits
-into destination register. Else, put value from register into destination register.
-Then PC += 4 to get next instruction */
-void execute_mvn_instruction(struct arm_state *as, unsigned int iw) {
+}
 
-    unsigned int rd, rn, value, immediate, cond, opcode, thirty_two;
+/* Removes the pages holding guest to guest + size - 1. States that may still
+have them in their TLB need arm_tlb_flush */
+void arm_mem_unmap(struct arm_mem *mem, unsigned int guest, unsigned int size) {
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
-    immediate = (iw >> 25) & 0b1;
-    cond = (iw >> 28) & 0xF;
-    opcode = (iw >> 21) & 0xF;
+    unsigned long long addr, end;
+    struct arm_page *page;
 
-    if(is_valid(as, cond)) {
+    end = (unsigned long long) guest + size;
 
-	    as->num_instr++;
-	    as->data_instr++;
+    for(addr = guest & ~ARM_PAGE_MASK; addr < end; addr += ARM_PAGE_SIZE) {
 
-        if(immediate > 0) {
+        page = arm_mem_page(mem, addr);
+        if(page != NULL) {
+            page->host = NULL;
+            page->prot = 0;
+        }
 
-            value = iw & 0xFF;
-	        value = ~value;
-            as->regs[rd] = value;
+    }
 
-        } else {
+}
 
-            value = iw & 0xF;
-            as->regs[rd] = as->regs[value];
+/* Maps host memory (see arm_mem_map) at the next free guest address and
+returns that address, or 0 if it could not be mapped. Ex. an array made by
+the host is passed to a guest function as arm_mem_map_host(mem, arr, ...) */
+unsigned int arm_mem_map_host(struct arm_mem *mem, void *host, unsigned int size,
+                              unsigned int prot) {
 
-        }
+    unsigned long long guest, next;
 
-        if(rd != PC) {
-            as->regs[PC] += 4;
-        }
+    guest = mem->next_map + ((uintptr_t) host & ARM_PAGE_MASK);
+    next = ((guest + size + ARM_PAGE_MASK) & ~(unsigned long long) ARM_PAGE_MASK) + ARM_PAGE_SIZE;
 
-    } else if(rd != PC) {
-        as->regs[PC] += 4;
+    if(next >= 0x100000000ULL || arm_mem_map(mem, guest, host, size, prot) != 0) {
+        return 0;
     }
 
-}
+    mem->next_map = next;
 
-/* Gets all information for Data Instruction (see above for details)
-Determines if it should be executed (ex. if addeq, but the values do not equal, 
-then do not execute and skip to next instruction (PC += 4)). If it is valid,
-determine if it uses an immediate value or value from a register. 
-If value is immediate then put value into destination register. 
-Else, put value from register into destination register.
-Then PC += 4 to get next instruction */
-void execute_mov_instruction(struct arm_state *as, unsigned int iw) {
+    return guest;
+
+}
 
-    unsigned int rd, rn, value, immediate, cond, opcode, thirty_two;
+/* Guest address flat binaries are loaded at */
+#define ARM_RAW_BASE 0x00010000
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
+#define ARM_IMAGE_SEGS 16
 
-    immediate = (iw >> 25) & 0b1;
-    cond = (iw >> 28) & 0xF;
-    opcode = (iw >> 21) & 0xF;
+/* One piece of host memory mapped into the guest by the loader */
+struct arm_image_seg {
 
-    if(is_valid(as, cond)) {
+    void *host;
+    size_t host_size;
+    unsigned int guest;
+    unsigned int size;
 
-	    as->num_instr++;
-	    as->data_instr++;
+};
 
-    	if(immediate > 0) {
+/* A program loaded by arm_image_load. The file stays mapped (read only) for
+its symbol table */
+struct arm_image {
 
-            value = iw & 0xFF;
-            as->regs[rd] = value;
+    unsigned char *file;
+    size_t file_size;
 
-    	} else {
+    const Elf32_Sym *syms;
+    int nsyms;
+    const char *strs;
+    size_t strs_size;
 
-	        value = iw & 0xF;
-	        as->regs[rd] = as->regs[value];
+    struct arm_image_seg segs[ARM_IMAGE_SEGS];
+    int nsegs;
 
-    	}
+    unsigned int entry;
 
-    	if(rd != PC) {
-    		as->regs[PC] += 4;
-    	}
+};
 
-    } else if(rd != PC) {
-    	as->regs[PC] += 4;
-    }
+/* Maps host memory from mmap (see arm_image_map_file) into the guest and
+remembers it so arm_image_free can undo both. Returns -1 if it could not be
+mapped, in which case the host memory has been unmapped already */
+int arm_image_add_seg(struct arm_image *img, struct arm_mem *mem, void *map, size_t map_size,
+                      unsigned int guest, unsigned char *host, unsigned int size, unsigned int prot) {
 
-}
+    struct arm_image_seg *seg;
+    unsigned long long end;
 
-void execute_cmp_instruction(struct arm_state *as, unsigned int iw) {
+    if(img->nsegs == ARM_IMAGE_SEGS || arm_mem_map(mem, guest, host, size, prot) != 0) {
+        munmap(map, map_size);
+        return -1;
+    }
 
-    unsigned int rd, rn, op2, immediate, cmp_result, reg_val1, reg_val2;
+    seg = &img->segs[img->nsegs++];
+    seg->host = map;
+    seg->host_size = map_size;
+    seg->guest = guest;
+    seg->size = size;
 
-    as->num_instr++;
-    as->data_instr++;
+    /* arm_mem_map_host carries on above the image */
+    end = ((unsigned long long) guest + size + ARM_PAGE_MASK) & ~(unsigned long long) ARM_PAGE_MASK;
+    if(end >= mem->next_map && end + ARM_PAGE_SIZE < 0x100000000ULL) {
+        mem->next_map = end + ARM_PAGE_SIZE;
+    }
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
-    immediate = (iw >> 25) & 0b1;
+    return 0;
 
-    as->eq = 0;
-    as->ne = 0;
-    as->lt = 0;
-    as->gt = 0;
-    as->z = 0;
-    as->n = 0;
-    as->v = 0;
+}
 
-    if(immediate > 0) {
+/* Maps size bytes of the file fd from offset into the guest at guest, or
+anonymous (zeroed) memory if fd is -1. The mapping is private, so the file
+is not copied and pages are only read in when the guest touches them, and
+guest stores never reach the file. Returns a pointer to the host copy of
+guest, or NULL */
+unsigned char *arm_image_map_file(struct arm_image *img, struct arm_mem *mem, int fd,
+                                  unsigned int offset, unsigned int guest, unsigned int size,
+                                  unsigned int prot) {
+
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    size_t skip, map_size;
+    unsigned char *map;
+
+    skip = fd < 0 ? (guest & ARM_PAGE_MASK) : offset & (host_page - 1);
+    map_size = (skip + size + host_page - 1) & ~(host_page - 1);
+
+    map = (unsigned char *) mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                                 fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE,
+                                 fd, fd < 0 ? 0 : offset - skip);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
 
-        op2 = iw & 0b11111111;
+    if(arm_image_add_seg(img, mem, map, map_size, guest, map + skip, size, prot) != 0) {
+        return NULL;
+    }
 
-	cmp_result = as->regs[rn] - op2;
-	reg_val1 = as->regs[rn];
-	reg_val2 = op2;
+    return map + skip;
 
-    } else {
+}
 
-        op2 = iw & 0b1111;
+/* Finds the symbol table of the ELF file in img->file */
+void arm_image_find_symbols(struct arm_image *img) {
 
-	cmp_result = as->regs[rn] - as->regs[op2];
-	reg_val1 = as->regs[rn];
-	reg_val2 = as->regs[op2];
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *) img->file;
+    const Elf32_Shdr *sh, *strsh;
+    int i;
 
+    if(eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf32_Shdr)
+       || eh->e_shoff + (size_t) eh->e_shnum * sizeof(Elf32_Shdr) > img->file_size) {
+        return;
     }
 
-    if(cmp_result == 0) {
-
-	as->eq = 1;
-	as->z = 1;
+    sh = (const Elf32_Shdr *) (img->file + eh->e_shoff);
 
-    } else if(reg_val1 < reg_val2) {
+    for(i = 0; i < eh->e_shnum; i++) {
 
-	as->lt = 1;
-	as->ne = 1;
+        if(sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum) {
+            continue;
+        }
 
-    } else if(reg_val1 > reg_val2) {
+        strsh = &sh[sh[i].sh_link];
+        if(sh[i].sh_offset + (size_t) sh[i].sh_size > img->file_size
+           || strsh->sh_offset + (size_t) strsh->sh_size > img->file_size) {
+            continue;
+        }
 
-	as->gt = 1;
-	as->ne = 1;
+        img->syms = (const Elf32_Sym *) (img->file + sh[i].sh_offset);
+        img->nsyms = sh[i].sh_size / sizeof(Elf32_Sym);
+        img->strs = (const char *) img->file + strsh->sh_offset;
+        img->strs_size = strsh->sh_size;
+        return;
 
     }
 
-    if(cmp_result > 10000) {
+}
+
+/* Maps the PT_LOAD segments of the ELF file in img->file. Returns an error
+message, or NULL */
+const char *arm_image_load_elf(struct arm_image *img, struct arm_mem *mem, int fd) {
 
-	as->v = 1;
- 	as->n = 1;
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *) img->file;
+    const Elf32_Phdr *ph;
+    unsigned char *host;
+    unsigned int prot, file_end, bss;
+    int i;
 
+    if(img->file_size < sizeof(Elf32_Ehdr) || eh->e_ident[EI_CLASS] != ELFCLASS32
+       || eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_ARM) {
+        return "not a 32-bit little endian ARM ELF file";
     }
 
-    as->regs[PC] += 4;
+    if(eh->e_phentsize != sizeof(Elf32_Phdr)
+       || eh->e_phoff + (size_t) eh->e_phnum * sizeof(Elf32_Phdr) > img->file_size) {
+        return "bad program headers";
+    }
 
-}
+    ph = (const Elf32_Phdr *) (img->file + eh->e_phoff);
 
-void execute_b_instruction(struct arm_state *as, unsigned int iw) {
+    for(i = 0; i < eh->e_phnum; i++) {
 
-    unsigned int thirty_two, offset, cond;
+        if(ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) {
+            continue;
+        }
 
-    offset = (iw & 0xFFFFFF);
-    cond = (iw >> 28) & 0xF;
+        if(ph[i].p_filesz > ph[i].p_memsz
+           || ph[i].p_offset + (size_t) ph[i].p_filesz > img->file_size
+           || (unsigned long long) ph[i].p_vaddr + ph[i].p_memsz > 0x100000000ULL) {
+            return "segment outside of the file or the address space";
+        }
 
-    if(is_valid(as, cond)) {
+        /* Mapped in place, so the file and the guest page offsets must agree */
+        if(((ph[i].p_offset ^ ph[i].p_vaddr) & ARM_PAGE_MASK) != 0) {
+            return "segment not aligned to a page";
+        }
 
-	as->num_instr++;
-	as->b_instr++;
+        prot = 0;
+        if(ph[i].p_flags & PF_R) {
+            prot |= ARM_PROT_READ;
+        }
+        if(ph[i].p_flags & PF_W) {
+            prot |= ARM_PROT_WRITE;
+        }
+        if(ph[i].p_flags & PF_X) {
+            prot |= ARM_PROT_EXEC;
+        }
 
-	if(offset & 0x800000) {
+        file_end = ph[i].p_vaddr + ph[i].p_filesz;
 
-	    thirty_two = 0xFF000000 + offset;
+        if(ph[i].p_filesz > 0) {
 
-	} else {
+            host = arm_image_map_file(img, mem, fd, ph[i].p_offset, ph[i].p_vaddr,
+                                      ph[i].p_filesz, prot);
+            if(host == NULL) {
+                return "segments overlap or there is not enough memory";
+            }
 
-	    thirty_two = offset;
+            /* The rest of the last page belongs to the bss (or to nothing) */
+            bss = ((file_end + ARM_PAGE_MASK) & ~ARM_PAGE_MASK) - file_end;
+            if(bss > ph[i].p_memsz - ph[i].p_filesz) {
+                bss = ph[i].p_memsz - ph[i].p_filesz;
+            }
+            if(bss > 0) {
+                memset(host + ph[i].p_filesz, 0, bss);
+            }
 
-	}
+            file_end += bss;
 
-	thirty_two = thirty_two << 2;
-	as->regs[PC] += 8;
-	as->regs[PC] += thirty_two;
+        }
+
+        if(file_end < ph[i].p_vaddr + ph[i].p_memsz
+           && arm_image_map_file(img, mem, -1, 0, file_end,
+                                 ph[i].p_vaddr + ph[i].p_memsz - file_end, prot) == NULL) {
+            return "segments overlap or there is not enough memory";
+        }
 
-    } else {
-	as->regs[PC] += 4;
     }
 
-}
+    img->entry = eh->e_entry;
+    arm_image_find_symbols(img);
+
+    return NULL;
 
-void execute_bl_instruction(struct arm_state *as, unsigned int iw) {
+}
 
-    unsigned int thirty_two, offset, cond;
+/* Frees an image from arm_image_load, taking its segments out of mem */
+void arm_image_free(struct arm_mem *mem, struct arm_image *img) {
 
-    offset = (iw & 0xFFFFFF);
-    cond = (iw >> 28) & 0xF;
+    int i;
 
-    if(is_valid(as, cond)) {
+    for(i = 0; i < img->nsegs; i++) {
+        arm_mem_unmap(mem, img->segs[i].guest, img->segs[i].size);
+        munmap(img->segs[i].host, img->segs[i].host_size);
+    }
 
-	as->num_instr++;
-	as->b_instr++;
+    munmap(img->file, img->file_size);
+    free(img);
 
-        if(offset & 0x800000) {
+}
 
-            thirty_two = 0xFF000000 + offset;
+/* Loads the ELF file or flat binary at path into mem. The segments are
+mapped from the file rather than read, so loading a large image costs about
+as much as the pages the guest goes on to touch. Returns NULL and sets
+*error if the file cannot be loaded */
+struct arm_image *arm_image_load(struct arm_mem *mem, const char *path, const char **error) {
 
-        } else {
+    struct arm_image *img;
+    struct stat st;
+    int fd;
 
-            thirty_two = offset;
+    img = (struct arm_image *) calloc(1, sizeof(struct arm_image));
+    if(img == NULL) {
+        *error = "not enough memory";
+        return NULL;
+    }
 
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 0xFFFFFFFF) {
+        *error = "cannot open the file or it is empty";
+        if(fd >= 0) {
+            close(fd);
         }
+        free(img);
+        return NULL;
+    }
 
-        thirty_two = thirty_two << 2;
-	    as->regs[PC] += 8;
-        as->regs[LR] = as->regs[PC] - 4;
-        as->regs[PC] += thirty_two;
+    img->file_size = st.st_size;
+    img->file = (unsigned char *) mmap(NULL, img->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(img->file == MAP_FAILED) {
+        *error = "cannot map the file";
+        close(fd);
+        free(img);
+        return NULL;
+    }
 
+    if(img->file_size >= SELFMAG && memcmp(img->file, ELFMAG, SELFMAG) == 0) {
+        *error = arm_image_load_elf(img, mem, fd);
+    } else if(arm_image_map_file(img, mem, fd, 0, ARM_RAW_BASE, img->file_size,
+                                 ARM_PROT_READ | ARM_PROT_WRITE | ARM_PROT_EXEC) == NULL) {
+        *error = "cannot map the file at ARM_RAW_BASE";
     } else {
-        as->regs[PC] += 4;
+        img->entry = ARM_RAW_BASE;
+        *error = NULL;
     }
 
-}
+    /* The mappings keep the file open */
+    close(fd);
 
-void execute_ldr_instruction(struct arm_state *as, unsigned int iw) {
+    if(*error != NULL) {
+        arm_image_free(mem, img);
+        return NULL;
+    }
 
-    unsigned int rm, rd, rn;
+    return img;
 
-    as->num_instr++;
-    as->mem_instr++;
+}
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
-    rm = iw & 0xF;
+/* The address of the function or object name in img, or 0 if there is no
+such symbol */
+unsigned int arm_image_symbol(struct arm_image *img, const char *name) {
 
-    unsigned int *num = (unsigned int *)as->regs[rn];
-    as->regs[rd] = *num;
+    size_t len = strlen(name);
+    int i;
 
-    if(rd != PC) {
-    	as->regs[PC] += 4;
+    for(i = 0; i < img->nsyms; i++) {
+        if(img->syms[i].st_shndx != SHN_UNDEF && img->syms[i].st_name + len < img->strs_size
+           && memcmp(img->strs + img->syms[i].st_name, name, len + 1) == 0) {
+            return img->syms[i].st_value;
+        }
     }
 
-}
-
-void execute_str_instruction(struct arm_state *as, unsigned int iw) {
+    return 0;
 
-    unsigned int src2, rd, rn;
+}
 
-    as->num_instr++;
-    as->mem_instr++;
+/* The name of the global symbol at or just below addr in img (the function
+addr is in), with *offset set to how far below. Returns NULL if there is
+none */
+const char *arm_image_symbol_name(struct arm_image *img, unsigned int addr, unsigned int *offset) {
 
-    rn = (iw >> 16) & 0b1111;
-    rd = (iw >> 12) & 0b1111;
+    const Elf32_Sym *best = NULL;
+    int i;
 
-    unsigned int *num = (unsigned int *)as->regs[rn];
-    *num = as->regs[rd];
+    for(i = 0; i < img->nsyms; i++) {
+        if(img->syms[i].st_shndx != SHN_UNDEF && ELF32_ST_BIND(img->syms[i].st_info) != STB_LOCAL
+           && img->syms[i].st_name < img->strs_size && img->syms[i].st_value <= addr
+           && (best == NULL || img->syms[i].st_value > best->st_value)) {
+            best = &img->syms[i];
+        }
+    }
 
-    if(rd != PC) {
-	as->regs[PC] += 4;
+    if(best == NULL) {
+        return NULL;
     }
 
+    *offset = addr - best->st_value;
+    return img->strs + best->st_name;
+
 }
 
-bool iw_is_bx_instruction(unsigned int iw) {
+/* Empties the TLBs of as */
+void arm_tlb_flush(struct arm_state *as) {
+
+    int i;
 
-    return ((iw >> 4) & 0xFFFFFF) == 0b000100101111111111110001;
+    for(i = 0; i < ARM_TLB_SIZE; i++) {
+        as->tlb_read[i].tag = ARM_TLB_EMPTY;
+        as->tlb_write[i].tag = ARM_TLB_EMPTY;
+    }
 
 }
 
-void execute_bx_instruction(struct arm_state *as, unsigned int iw) {
+/* Sets up as to call func with up to four arguments. Registers, flags and
+counters start from zero again, while the stack and the decode and block
+caches are kept, so a state can run one call after another (and stays warm
+when it runs the same code) */
+void arm_state_reset(struct arm_state *as, unsigned int func,
+                     unsigned int arg0, unsigned int arg1,
+                     unsigned int arg2, unsigned int arg3) {
 
-    unsigned int rn;
+    int i;
 
-    as->num_instr++;
-    as->b_instr++;
+    /* Initialize all registers to zero. */
+    for (i = 0; i < NREGS; i++) {
+        as->regs[i] = 0;
+    }
 
-    rn = iw & 0b1111;
-    as->regs[PC] = as->regs[rn];
+    as->regs[PC] = func;
+    as->regs[SP] = as->stack_addr + as->stack_size;
 
-}
+    as->regs[0] = arg0;
+    as->regs[1] = arg1;
+    as->regs[2] = arg2;
+    as->regs[3] = arg3;
 
-void arm_state_execute_one(struct arm_state *as) {
+    as->cpsr = 0;
+    as->flag_op = FLAGS_NONE;
+    as->flag_a = 0;
+    as->flag_b = 0;
 
-    unsigned int iw;
-    unsigned int *pc;
+    as->num_instr = 0;
+    as->data_instr = 0;
+    as->b_instr = 0;
+    as->mem_instr = 0;
 
-    pc = (unsigned int *) as->regs[PC];
-    iw = *pc;
+    as->fault = FAULT_NONE;
+    as->fault_addr = 0;
+    as->fault_pc = 0;
 
+}
 
-    if(iw_is_bx_instruction(iw)) {
-        execute_bx_instruction(as, iw);
+/* Gives as its stack (mapped into mem), its (empty) decode cache and the
+default settings. The stack must be page aligned and ARM_PAGE_ROUND(stack_size)
+bytes long, all of which is mapped, so the stack shares no page with other
+host memory and the page under it is free. Returns -1 if the stack could
+not be mapped */
+int arm_state_init(struct arm_state *as, struct arm_mem *mem, unsigned char *stack,
+                   unsigned int stack_size, struct arm_decoded *dcache) {
 
-    } else if(iw_is_add_instruction(iw)) {
-	   execute_add_instruction(as, iw);
+    as->mem = mem;
+    as->stack = stack;
+    as->stack_size = stack_size;
+    as->stack_addr = arm_mem_map_host(mem, stack, ARM_PAGE_ROUND(stack_size),
+                                      ARM_PROT_READ | ARM_PROT_WRITE | ARM_PAGE_STACK);
+    as->dcache = dcache;
+
+    as->bcache = NULL;
+    as->engine = DEFAULT_ENGINE;
+    as->jit_threshold = JIT_THRESHOLD;
+    as->idioms = LOOP_IDIOMS;
+    as->timing = NULL;
+    as->trace = NULL;
+    as->memo = NULL;
+    as->cov = NULL;
+#ifdef ARM_AOT
+    as->aot = true;
+#endif
+
+    arm_tlb_flush(as);
+    as->code_gen = __atomic_load_n(&mem->code_gen, __ATOMIC_ACQUIRE);
+
+    return as->stack_addr == 0 ? -1 : 0;
 
-    } else if(iw_is_sub_instruction(iw)) {
-	   execute_sub_instruction(as, iw);
+}
 
-    } else if(iw_is_mov_instruction(iw)) {
-	   execute_mov_instruction(as, iw);
+/* Create emulated CPU, running in mem and about to call func (a guest
+address). Returns NULL if there is not enough memory */
+struct arm_state *arm_state_new(struct arm_mem *mem, unsigned int stack_size, unsigned int func,
+                                unsigned int arg0, unsigned int arg1,
+                                unsigned int arg2, unsigned int arg3) {
 
-    } else if(iw_is_mvn_instruction(iw)) {
-	   execute_mvn_instruction(as, iw);
+    struct arm_state *as;
+    void *stack;
+    struct arm_decoded *dcache;
 
-    } else if(iw_is_cmp_instruction(iw)) {
-	   execute_cmp_instruction(as, iw);
+    as = (struct arm_state *) malloc(sizeof(struct arm_state));
+    if(posix_memalign(&stack, ARM_PAGE_SIZE, ARM_PAGE_ROUND(stack_size)) != 0) {
+        stack = NULL;
+    }
+    dcache = (struct arm_decoded *) calloc(DCACHE_SIZE, sizeof(struct arm_decoded));
+
+    if (as == NULL || stack == NULL || dcache == NULL
+        || arm_state_init(as, mem, (unsigned char *) stack, stack_size, dcache) != 0) {
+        free(as);
+        free(stack);
+        free(dcache);
+        return NULL;
+    }
 
-    } else if(iw_is_ldr_instruction(iw)) {
-	   execute_ldr_instruction(as, iw);
+    arm_state_reset(as, func, arg0, arg1, arg2, arg3);
 
-    } else if(iw_is_str_instruction(iw)) {
-	   execute_str_instruction(as, iw);
+    return as;
+}
 
-    } else if(iw_is_b_instruction(iw)) {
-	   execute_b_instruction(as, iw);
+unsigned int arm_flags_nzcv(struct arm_state *as);
 
-    } else if(iw_is_bl_instruction(iw)) {
-	   execute_bl_instruction(as, iw);
+/* Frees the block cache and compiled code, which are made the first time
+the block or jit engine runs */
+void arm_state_free_bcache(struct arm_state *as) {
 
+#ifdef JIT_ENABLED
+    if(as->bcache != NULL && as->bcache->jit_buf != NULL) {
+        munmap(as->bcache->jit_buf, JIT_BUF_SIZE);
     }
+#endif
+
+    free(as->bcache);
+    as->bcache = NULL;
 
 }
 
-unsigned int arm_state_execute(struct arm_state *as) {
+/* Used to free memory from stack */
+void arm_state_free(struct arm_state *as) {
 
-    while (as->regs[PC] != 0) {
-        arm_state_execute_one(as);
-    }
+    arm_mem_unmap(as->mem, as->stack_addr, as->stack_size);
+    arm_state_free_bcache(as);
+    free(as->dcache);
+    free(as->stack);
+    free(as);
 
-    return as->regs[0];
 }
 
-void test_sum() {
+/* print register values */
+void arm_state_print(struct arm_state *as) {
 
-    struct arm_state *as;
-    unsigned int rv;
+    int i;
+    printf("stack size = %d\n", as->stack_size);
 
-    int arr[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
-    int arr2[] = {-1,-2,-3,-4,-5,-6,-7,-8,-9, -10};
+    for (i = 0; i < NREGS; i++) {
+        printf("regs[%d] = (%X) %d\n", i, as->regs[i], (int) as->regs[i]);
+    }
+
+    arm_flags_nzcv(as);
+    printf("cpsr = (%X) N=%d Z=%d C=%d V=%d\n", as->cpsr, (as->cpsr & CPSR_N) != 0,
+           (as->cpsr & CPSR_Z) != 0, (as->cpsr & CPSR_C) != 0, (as->cpsr & CPSR_V) != 0);
+
+}
+
+/* For each condition code, bit NZCV is set if the condition passes when
+the flags are NZCV (N is bit 3 of the index, V is bit 0). Ex. EQ passes for
+every NZCV with Z set, GT when Z is clear and N == V */
+const unsigned short arm_cond_table[16] = {
+    0xF0F0, /* EQ */
+    0x0F0F, /* NE */
+    0xCCCC, /* CS */
+    0x3333, /* CC */
+    0xFF00, /* MI */
+    0x00FF, /* PL */
+    0xAAAA, /* VS */
+    0x5555, /* VC */
+    0x0C0C, /* HI */
+    0xF3F3, /* LS */
+    0xAA55, /* GE */
+    0x55AA, /* LT */
+    0x0A05, /* GT */
+    0xF5FA, /* LE */
+    0xFFFF, /* AL */
+    0x0000  /* NV */
+};
+
+/* Brings NZCV in cpsr up to date from the last flag setting instruction
+and returns them as a 4 bit number (N = bit 3, Z, C, V = bit 0) */
+unsigned int arm_flags_nzcv(struct arm_state *as) {
+
+    unsigned int a, b, result, nzcv;
+
+    a = as->flag_a;
+    b = as->flag_b;
+
+    switch(as->flag_op) {
+
+    case FLAGS_SUB:
+        result = a - b;
+        nzcv = (a >= b) << 1;
+        nzcv |= ((a ^ b) & (a ^ result)) >> 31;
+        break;
+
+    case FLAGS_ADD:
+        result = a + b;
+        nzcv = (result < a) << 1;
+        nzcv |= (~(a ^ b) & (a ^ result)) >> 31;
+        break;
+
+    case FLAGS_LOGIC:
+        result = a;
+        nzcv = (as->cpsr >> 28) & 0b0011;
+        break;
+
+    default:
+        return as->cpsr >> 28;
+
+    }
+
+    nzcv |= (result >> 31) << 3;
+    nzcv |= (result == 0) << 2;
+
+    as->cpsr = (as->cpsr & 0x0FFFFFFF) | (nzcv << 28);
+    as->flag_op = FLAGS_NONE;
+
+    return nzcv;
+
+}
+
+/* Sets NZCV (N = bit 3, V = bit 0) right away */
+void arm_flags_set(struct arm_state *as, unsigned int nzcv) {
+
+    as->cpsr = (as->cpsr & 0x0FFFFFFF) | (nzcv << 28);
+    as->flag_op = FLAGS_NONE;
+
+}
+
+/* Records the result of a flag setting logical instruction. N and Z come
+from the result, C is the shifter carry and V keeps its old value, so the
+old flags are worked out first */
+void arm_flags_logic(struct arm_state *as, unsigned int result, unsigned int carry) {
+
+    if(as->flag_op != FLAGS_NONE) {
+        arm_flags_nzcv(as);
+    }
+
+    as->cpsr = (as->cpsr & ~CPSR_C) | (carry << 29);
+    as->flag_op = FLAGS_LOGIC;
+    as->flag_a = result;
+
+}
+
+/* Determines if the instruction is valid and should be executed. 
+Ex if instruction is addeq, it checks if the Z flag = 1 (cond = 0000).
+If it is met, then the instruction should be executed. If not,
+then in the program will skip to the next instruction. Every condition is
+one lookup in arm_cond_table. See info above for more details) */
+bool is_valid(struct arm_state *as, unsigned int cond) {
+
+    if(cond == COND_AL) {
+        return true;
+    }
+
+    return (arm_cond_table[cond] >> arm_flags_nzcv(as)) & 1;
+
+}
+
+/* Value of register r as an operand. Reading PC gives the address of the
+instruction plus 8, like the real pipeline */
+static inline unsigned int arm_reg(struct arm_state *as, struct arm_decoded *di, unsigned int r) {
+
+    if(r == PC) {
+        return di->pc + 8;
+    }
+
+    return as->regs[r];
+
+}
+
+/* Barrel shifter. Shifts value by amount (0 - 255) the way a register
+specified shift does. *carry holds the C flag on entry and the shifter
+carry out on return. arm_decode turns LSR #0 and ASR #0 in the immediate
+form into shifts by 32 and ROR #0 into RRX */
+static inline unsigned int arm_shift(unsigned int value, unsigned int type,
+                                     unsigned int amount, unsigned int *carry) {
+
+    if(type == SHIFT_RRX) {
+        amount = *carry;
+        *carry = value & 1;
+        return (amount << 31) | (value >> 1);
+    }
+
+    if(amount == 0) {
+        return value;
+    }
+
+    switch(type) {
+
+    case SHIFT_LSL:
+        if(amount < 32) {
+            *carry = (value >> (32 - amount)) & 1;
+            return value << amount;
+        }
+        *carry = amount == 32 ? value & 1 : 0;
+        return 0;
+
+    case SHIFT_LSR:
+        if(amount < 32) {
+            *carry = (value >> (amount - 1)) & 1;
+            return value >> amount;
+        }
+        *carry = amount == 32 ? value >> 31 : 0;
+        return 0;
+
+    case SHIFT_ASR:
+        if(amount < 32) {
+            *carry = (value >> (amount - 1)) & 1;
+            return (unsigned int) ((int) value >> amount);
+        }
+        *carry = value >> 31;
+        return (unsigned int) ((int) value >> 31);
+
+    default:
+        amount &= 31;
+        if(amount == 0) {
+            *carry = value >> 31;
+            return value;
+        }
+        *carry = (value >> (amount - 1)) & 1;
+        return (value >> amount) | (value << (32 - amount));
+
+    }
+
+}
+
+/* C flag as 0 or 1 */
+static inline unsigned int arm_flags_carry(struct arm_state *as) {
+
+    return (arm_flags_nzcv(as) >> 1) & 1;
+
+}
+
+/* Src2 of a data instruction (see info above). The immediate was already
+rotated by arm_decode. *carry is only touched when the shifter has a carry
+out, so callers that set flags start it at the C flag */
+static inline unsigned int arm_operand2(struct arm_state *as, struct arm_decoded *di,
+                                        unsigned int *carry) {
+
+    switch(di->form) {
+
+    case OPND_IMM:
+        if(di->shift_amount != 0) {
+            *carry = di->imm >> 31;
+        }
+        return di->imm;
+
+    case OPND_REG:
+        return arm_reg(as, di, di->rm);
+
+    case OPND_SHIFT_IMM:
+        if(di->shift_type == SHIFT_RRX) {
+            *carry = arm_flags_carry(as);
+        }
+        return arm_shift(arm_reg(as, di, di->rm), di->shift_type, di->shift_amount, carry);
+
+    default:
+        return arm_shift(arm_reg(as, di, di->rm), di->shift_type, as->regs[di->rs] & 0xFF, carry);
+
+    }
+
+}
+
+/* Puts the result of a data instruction in rd. Unless rd is PC (a jump),
+PC += 4 to get the next instruction */
+static inline void arm_write_rd(struct arm_state *as, struct arm_decoded *di, unsigned int result) {
+
+    as->regs[di->rd] = result;
+
+    if(di->rd != PC) {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Adds a, b and carry_in, setting all of NZCV at once when s is set. Used by
+ADC, SBC and RSC, which are too rare to be worth making lazy */
+unsigned int arm_add_with_carry(struct arm_state *as, unsigned int a, unsigned int b,
+                                unsigned int carry_in, bool s) {
+
+    unsigned long long wide;
+    unsigned int result;
+
+    wide = (unsigned long long) a + b + carry_in;
+    result = (unsigned int) wide;
+
+    if(s) {
+        arm_flags_set(as, ((result >> 31) << 3) | ((result == 0) << 2) | ((wide >> 32) << 1)
+                      | ((~(a ^ b) & (a ^ result)) >> 31));
+    }
+
+    return result;
+
+}
+
+/* Gets all information for Data Instruction (see above for details)
+Determines if it should be executed (ex. if andeq, but the values do not equal,
+then do not execute and skip to next instruction (PC += 4)). If it is valid,
+bitwise ands Rn and Src2 and puts value in destination register.
+With S set, N and Z come from the result and C from the shifter */
+void execute_and_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = arm_reg(as, di, di->rn) & arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as and, but exclusive or */
+void execute_eor_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = arm_reg(as, di, di->rn) ^ arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as and, but or */
+void execute_orr_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = arm_reg(as, di, di->rn) | arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as and, but clears the bits of Rn that are set in Src2 */
+void execute_bic_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = arm_reg(as, di, di->rn) & ~arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Gets all information for Data Instruction (see above for details)
+Determines if it should be executed (ex. if addeq, but the values do not equal, 
+then do not execute and skip to next instruction (PC += 4)). If it is valid,
+adds Rn and Src2 and puts value in destination register.
+Then PC += 4 to get next instruction */
+void execute_add_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            as->flag_op = FLAGS_ADD;
+            as->flag_a = a;
+            as->flag_b = b;
+        }
+
+        arm_write_rd(as, di, a + b);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as add, plus the C flag */
+void execute_adc_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        arm_write_rd(as, di, arm_add_with_carry(as, a, b, arm_flags_carry(as), di->setflags));
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Gets all information for Data Instruction (see above for details)
+Determines if it should be executed (ex. if subeq, but the values do not equal, 
+then do not execute and skip to next instruction (PC += 4)). If it is valid,
+subtracts Src2 from Rn and puts value in destination register.
+Then PC += 4 to get next instruction */
+void execute_sub_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            as->flag_op = FLAGS_SUB;
+            as->flag_a = a;
+            as->flag_b = b;
+        }
+
+        arm_write_rd(as, di, a - b);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as sub, but Src2 - Rn */
+void execute_rsb_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            as->flag_op = FLAGS_SUB;
+            as->flag_a = b;
+            as->flag_b = a;
+        }
+
+        arm_write_rd(as, di, b - a);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as sub, minus 1 if the C flag is clear (Rn + ~Src2 + C) */
+void execute_sbc_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        arm_write_rd(as, di, arm_add_with_carry(as, a, ~b, arm_flags_carry(as), di->setflags));
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as rsb, minus 1 if the C flag is clear (Src2 + ~Rn + C) */
+void execute_rsc_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        arm_write_rd(as, di, arm_add_with_carry(as, b, ~a, arm_flags_carry(as), di->setflags));
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Sets the flags from Rn & Src2 without keeping the result */
+void execute_tst_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = arm_flags_carry(as);
+        result = arm_reg(as, di, di->rn) & arm_operand2(as, di, &carry);
+        arm_flags_logic(as, result, carry);
+
+    }
+
+    as->regs[PC] += 4;
+
+}
+
+/* Sets the flags from Rn ^ Src2 without keeping the result */
+void execute_teq_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = arm_flags_carry(as);
+        result = arm_reg(as, di, di->rn) ^ arm_operand2(as, di, &carry);
+        arm_flags_logic(as, result, carry);
+
+    }
+
+    as->regs[PC] += 4;
+
+}
+
+/* Compares by recording a subtraction for the lazy flags, nothing is
+worked out until a condition needs it */
+void execute_cmp_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        /* RRX reads C, so Src2 comes before the new flags are recorded */
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        as->flag_op = FLAGS_SUB;
+        as->flag_a = a;
+        as->flag_b = b;
+
+    }
+
+    as->regs[PC] += 4;
+
+}
+
+/* Same as cmp, but records an addition */
+void execute_cmn_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        a = arm_reg(as, di, di->rn);
+        b = arm_operand2(as, di, &carry);
+
+        as->flag_op = FLAGS_ADD;
+        as->flag_a = a;
+        as->flag_b = b;
+
+    }
+
+    as->regs[PC] += 4;
+
+}
+
+/* Gets all information for Data Instruction (see above for details)
+Determines if it should be executed (ex. if moveq, but the values do not equal,
+then do not execute and skip to next instruction (PC += 4)). If it is valid,
+put Src2 into destination register.
+Then PC += 4 to get next instruction */
+void execute_mov_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as mov, but puts the bitwise not of Src2 in the destination register */
+void execute_mvn_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        carry = di->setflags ? arm_flags_carry(as) : 0;
+        result = ~arm_operand2(as, di, &carry);
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, carry);
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Multiply. Rd = Rm * Rs, the low 32 bits of the product are the same
+for signed and unsigned numbers. With S set N and Z come from the result,
+C and V keep their old values */
+void execute_mul_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        result = as->regs[di->rm] * as->regs[di->rs];
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, arm_flags_carry(as));
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as mul, plus the accumulator Rn */
+void execute_mla_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int result;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        result = as->regs[di->rm] * as->regs[di->rs] + as->regs[di->rn];
+
+        if(di->setflags) {
+            arm_flags_logic(as, result, arm_flags_carry(as));
+        }
+
+        arm_write_rd(as, di, result);
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* The 64 bit accumulator of a long multiply, RdHi (di->rd) and RdLo (di->rn) */
+static inline unsigned long long arm_reg_long(struct arm_state *as, struct arm_decoded *di) {
+
+    return ((unsigned long long) as->regs[di->rd] << 32) | as->regs[di->rn];
+
+}
+
+/* Puts the 64 bit result of a long multiply in RdHi and RdLo. With S set
+N is bit 63 and Z is set if all 64 bits are 0, C and V keep their old values */
+static inline void arm_write_long(struct arm_state *as, struct arm_decoded *di, unsigned long long result) {
+
+    if(di->setflags) {
+        arm_flags_set(as, (arm_flags_nzcv(as) & 0b0011) | ((result >> 63) << 3) | ((result == 0) << 2));
+    }
+
+    as->regs[di->rn] = (unsigned int) result;
+    as->regs[di->rd] = result >> 32;
+
+    if(di->rd != PC && di->rn != PC) {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Unsigned long multiply. RdHi:RdLo = Rm * Rs as 64 bit unsigned numbers */
+void execute_umull_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+        arm_write_long(as, di, (unsigned long long) as->regs[di->rm] * as->regs[di->rs]);
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as umull, plus RdHi:RdLo */
+void execute_umlal_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+        arm_write_long(as, di, (unsigned long long) as->regs[di->rm] * as->regs[di->rs]
+                       + arm_reg_long(as, di));
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as umull, but the numbers are signed */
+void execute_smull_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+        arm_write_long(as, di, (long long) (int) as->regs[di->rm] * (int) as->regs[di->rs]);
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as smull, plus RdHi:RdLo */
+void execute_smlal_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+        arm_write_long(as, di, (long long) (int) as->regs[di->rm] * (int) as->regs[di->rs]
+                       + arm_reg_long(as, di));
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Signed divide. Rd = Rn / Rm rounded toward zero. Dividing by 0 gives 0
+(the divide by zero trap some cores have is not emulated) and the one
+quotient that does not fit, INT_MIN / -1, is INT_MIN */
+void execute_sdiv_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    int n, m;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+
+        n = as->regs[di->rn];
+        m = as->regs[di->rm];
+
+        if(m == 0) {
+            arm_write_rd(as, di, 0);
+        } else if(m == -1) {
+            arm_write_rd(as, di, -(unsigned int) n);
+        } else {
+            arm_write_rd(as, di, n / m);
+        }
+
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Same as sdiv, but the numbers are unsigned */
+void execute_udiv_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int m;
+
+    as->num_instr++;
+    as->data_instr++;
+
+    if(is_valid(as, di->cond)) {
+        m = as->regs[di->rm];
+        arm_write_rd(as, di, m == 0 ? 0 : as->regs[di->rn] / m);
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* Size of the edge coverage map (a power of two). Guest functions have a
+few hundred branches at most, and a map that fits in the L1 cache with
+room to spare makes clearing and scanning it after every run much cheaper */
+#define FUZZ_MAP_SIZE (1 << 14)
+
+/* Counts the edge from the branch at from to to (the next instruction if
+it was not taken) in as->cov. An edge is a hash of both ends, so the same
+target reached from two branches is two edges. Only the interp engine
+counts edges, threaded runs the branches without the handlers (see
+arm_branch_b) so it does not pay for the check */
+static inline void arm_cov_edge(struct arm_state *as, unsigned int from, unsigned int to) {
+
+    as->cov[((from >> 2) * 0x9E3779B1u ^ (to >> 2)) & (FUZZ_MAP_SIZE - 1)]++;
+
+}
+
+/* di->imm holds the sign extended offset already shifted left by 2,
+plus the 8 bytes the PC is ahead of the instruction when it executes */
+static inline void arm_branch_b(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->b_instr++;
+
+    if(is_valid(as, di->cond)) {
+        as->regs[PC] += di->imm;
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+static inline void arm_branch_bl(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->b_instr++;
+
+    if(is_valid(as, di->cond)) {
+        as->regs[LR] = as->regs[PC] + 4;
+        as->regs[PC] += di->imm;
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+void execute_b_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int pc = as->regs[PC];
+
+    arm_branch_b(as, di);
+
+    if(as->cov != NULL) {
+        arm_cov_edge(as, pc, as->regs[PC]);
+    }
+
+}
+
+void execute_bl_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int pc = as->regs[PC];
+
+    arm_branch_bl(as, di);
+
+    if(as->cov != NULL) {
+        arm_cov_edge(as, pc, as->regs[PC]);
+    }
+
+}
+
+/* Removes the decoded copy of the instruction at addr (if there is one),
+so code that is written by the program is decoded again before it runs */
+void arm_dcache_invalidate(struct arm_state *as, unsigned int addr) {
+
+    struct arm_decoded *di;
+
+    di = &as->dcache[DCACHE_INDEX(addr)];
+    if(di->pc == (addr & ~0b11)) {
+        di->pc = 0;
+    }
+
+}
+
+/* Throws away every translated block, the compiled code and the decode cache.
+The blocks are unlinked first so the block engine cannot follow a link into a
+block that is about to be reused */
+void arm_bcache_flush(struct arm_state *as) {
+
+    struct arm_bcache *bc = as->bcache;
+    int i;
+    unsigned int page, end_pc;
+
+    for(i = 0; i < bc->nblocks; i++) {
+
+        end_pc = bc->blocks[i].end_pc;
+        if(bc->blocks[i].idiom.kind != IDIOM_NONE) {
+            end_pc = bc->blocks[i].idiom.end_pc;
+        }
+
+        for(page = bc->blocks[i].pc >> CODE_PAGE_SHIFT; page <= (end_pc - 1) >> CODE_PAGE_SHIFT;
+            page++) {
+            bc->code_pages[page >> 3] = 0;
+        }
+
+        bc->blocks[i].succ[0] = NULL;
+        bc->blocks[i].succ[1] = NULL;
+
+        /* Stops the block engine after the store that caused the flush */
+        bc->blocks[i].nops = 0;
+
+    }
+
+    for(i = 0; i < BCACHE_SIZE; i++) {
+        bc->table[i] = NULL;
+    }
+
+    for(i = 0; i < DCACHE_SIZE; i++) {
+        as->dcache[i].pc = 0;
+    }
+
+    bc->nblocks = 0;
+    bc->nops = 0;
+    bc->jit_used = 0;
+    bc->flushes++;
+
+}
+
+/* Flushes the block cache if addr is in a page that holds translated code */
+void arm_bcache_invalidate(struct arm_state *as, unsigned int addr) {
+
+    unsigned int page;
+
+    page = addr >> CODE_PAGE_SHIFT;
+    if(as->bcache != NULL && (as->bcache->code_pages[page >> 3] & (1 << (page & 7)))) {
+        arm_bcache_flush(as);
+    }
+
+}
+
+/* The permissions of page. ARM_PAGE_CODE can be set by another thread
+fetching from the page (see arm_mem_fetch), so they are read atomically */
+static inline unsigned int arm_page_prot(struct arm_page *page) {
+
+    return __atomic_load_n(&page->prot, __ATOMIC_RELAXED);
+
+}
+
+/* Tells the other states of the address space that code has changed. as
+has already dropped its own stale copies, so it does not count the change
+unless it missed one of theirs */
+static inline void arm_code_changed(struct arm_state *as) {
+
+    unsigned int gen = __atomic_fetch_add(&as->mem->code_gen, 1, __ATOMIC_RELEASE);
+
+    if(as->code_gen == gen) {
+        as->code_gen = gen + 1;
+    }
+
+}
+
+/* Throws away everything as has decoded, and its write TLB that may hold
+a page that has since become code, if another state has changed code
+since the last time. The engines call it before they start, which for
+arm_state_run is every turn a scheduled state gets */
+static inline void arm_code_sync(struct arm_state *as) {
+
+    unsigned int gen = __atomic_load_n(&as->mem->code_gen, __ATOMIC_ACQUIRE);
+    int i;
+
+    if(gen == as->code_gen) {
+        return;
+    }
+
+    as->code_gen = gen;
+
+    if(as->bcache != NULL) {
+        arm_bcache_flush(as);
+    } else {
+        for(i = 0; i < DCACHE_SIZE; i++) {
+            as->dcache[i].pc = 0;
+        }
+    }
+
+    for(i = 0; i < ARM_TLB_SIZE; i++) {
+        as->tlb_write[i].tag = ARM_TLB_EMPTY;
+    }
+
+}
+
+/* Stops the guest because it touched memory it may not (kind is a
+FAULT_*). PC = 0 ends every engine, and flushing the block cache stops the
+block engine in the middle of a block. Only the first fault is kept */
+void arm_fault(struct arm_state *as, unsigned int kind, unsigned int addr) {
+
+    if(as->fault == FAULT_NONE) {
+        as->fault = kind;
+        as->fault_addr = addr;
+        as->fault_pc = as->regs[PC];
+    }
+
+    as->regs[PC] = 0;
+
+    if(as->bcache != NULL) {
+        arm_bcache_flush(as);
+    }
+
+}
+
+/* Snapshots (arm_state_snapshot). A snapshot is the registers, flags and
+counters of a state and the bytes of every writable page of its address
+space (its own stack, the data of the image and writable host mappings,
+but not the stacks of other states). Pages are copy on write: taking a
+snapshot only marks its pages ARM_PAGE_CLEAN (and drops them from the
+write TLB), the first store to a clean page copies it into the snapshot
+and puts it on the dirty list, and arm_state_restore copies back only the
+pages on that list. A state that restarts from the same point over and
+over pays for the pages it wrote, not for the whole address space.
+
+An address space tracks one snapshot at a time (mem->snap). Taking or
+restoring another one first copies in every page the old one had not
+saved yet, so it stays whole and can be restored later, just without the
+copy on write. Like a pool, this is not thread safe, the pages of a
+snapshot must stay mapped while it is tracked, and other states running in
+the address space need arm_tlb_flush after a snapshot or restore.
+
+arm_snapshot_save writes a snapshot to a file and arm_snapshot_load maps
+it back in (pages are only read in when a restore copies them), to start
+another process from the same point */
+
+#define SNAPSHOT_MAGIC "ARMSNP1"
+
+/* Registers, flags and counters (and where the stack was) */
+struct arm_snapshot_cpu {
+
+    unsigned int regs[NREGS];
+    unsigned int cpsr;
+    unsigned int flag_op;
+    unsigned int flag_a;
+    unsigned int flag_b;
+
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+    unsigned int fault;
+    unsigned int fault_addr;
+    unsigned int fault_pc;
+
+    unsigned int stack_addr;
+    unsigned int stack_size;
+
+};
+
+/* Bytes lo to hi - 1 of the guest page at guest are in the snapshot, and
+its copy is in the page of data with the same index once saved is set */
+struct arm_snapshot_page {
+
+    unsigned int guest;
+    unsigned short lo;
+    unsigned short hi;
+    bool saved;
+    bool dirty;
+
+};
+
+struct arm_snapshot {
+
+    struct arm_snapshot_cpu cpu;
+
+    struct arm_snapshot_page *pages;
+    int npages;
+    unsigned char *data;
+
+    /* Indexes of the pages written since the last restore, see arm_snapshot_dirty */
+    int *dirty;
+    int ndirty;
+
+    /* The file mapping data is in (arm_snapshot_load), or NULL if it was malloced */
+    void *map;
+    size_t map_size;
+
+};
+
+/* The start of the file, followed by npages arm_snapshot_range and then
+(from the next ARM_PAGE_SIZE boundary) a page of data for each of them.
+Files are written in host byte order */
+struct arm_snapshot_header {
+
+    char magic[8];
+    unsigned int page_size;
+    unsigned int npages;
+    struct arm_snapshot_cpu cpu;
+
+};
+
+struct arm_snapshot_range {
+
+    unsigned int guest;
+    unsigned int lo;
+    unsigned int hi;
+
+};
+
+/* Index in s of the page at guest address addr (which s must have) */
+static int arm_snapshot_find(struct arm_snapshot *s, unsigned int addr) {
+
+    int lo = 0, hi = s->npages - 1, mid;
+
+    addr &= ~ARM_PAGE_MASK;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(s->pages[mid].guest < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+
+}
+
+/* Copies page i of s from the guest unless it has been already */
+static void arm_snapshot_save_page(struct arm_snapshot *s, struct arm_mem *mem, int i) {
+
+    struct arm_snapshot_page *p = &s->pages[i];
+
+    if(!p->saved) {
+        memcpy(s->data + (size_t) i * ARM_PAGE_SIZE + p->lo,
+               arm_mem_page(mem, p->guest)->host + p->lo, p->hi - p->lo);
+        p->saved = true;
+    }
+
+}
+
+/* First store to page (holding addr) since the snapshot mem tracks was
+taken or restored. Called by arm_mem_write_slow before the store */
+void arm_snapshot_dirty(struct arm_mem *mem, struct arm_page *page, unsigned int addr) {
+
+    struct arm_snapshot *s = mem->snap;
+    int i = arm_snapshot_find(s, addr);
+
+    arm_snapshot_save_page(s, mem, i);
+
+    s->pages[i].dirty = true;
+    s->dirty[s->ndirty++] = i;
+    page->prot &= ~ARM_PAGE_CLEAN;
+
+}
+
+/* Stops mem tracking its snapshot. Unless the snapshot is about to be
+freed, the pages it has not saved yet are copied now */
+static void arm_snapshot_detach(struct arm_mem *mem, bool save) {
+
+    struct arm_snapshot *s = mem->snap;
+    struct arm_page *page;
+    int i;
+
+    for(i = 0; i < s->npages; i++) {
+        page = arm_mem_page(mem, s->pages[i].guest);
+        if(page != NULL && page->host != NULL) {
+            if(save) {
+                arm_snapshot_save_page(s, mem, i);
+            }
+            page->prot &= ~ARM_PAGE_CLEAN;
+        }
+    }
+
+    mem->snap = NULL;
+
+}
+
+/* Takes a snapshot of as and its address space (see above). Returns NULL
+if there is not enough memory */
+struct arm_snapshot *arm_state_snapshot(struct arm_state *as) {
+
+    struct arm_mem *mem = as->mem;
+    struct arm_snapshot *s;
+    struct arm_page *page;
+    unsigned int stack_lo, stack_hi;
+    int i, j, n, pass;
+
+    s = (struct arm_snapshot *) calloc(1, sizeof(struct arm_snapshot));
+    if(s == NULL) {
+        return NULL;
+    }
+
+    stack_lo = as->stack_addr & ~ARM_PAGE_MASK;
+    stack_hi = as->stack_addr + as->stack_size;
+
+    /* Counts the pages, then fills them in (in address order) */
+    for(pass = 0; pass < 2; pass++) {
+
+        n = 0;
+        for(i = 0; i < ARM_L1_SIZE; i++) {
+
+            if(mem->l2[i] == NULL) {
+                continue;
+            }
+
+            for(j = 0; j < ARM_L2_SIZE; j++) {
+
+                page = &mem->l2[i][j];
+                if(page->host == NULL || !(page->prot & ARM_PROT_WRITE)) {
+                    continue;
+                }
+
+                /* Other states' stacks are theirs */
+                if((page->prot & ARM_PAGE_STACK)
+                   && ((unsigned int) i << 22 | j << ARM_PAGE_SHIFT) - stack_lo >= stack_hi - stack_lo) {
+                    continue;
+                }
+
+                if(pass == 1) {
+                    s->pages[n].guest = (unsigned int) i << 22 | j << ARM_PAGE_SHIFT;
+                    s->pages[n].lo = page->lo;
+                    s->pages[n].hi = page->hi;
+                }
+                n++;
+
+            }
+
+        }
+
+        if(pass == 0) {
+            s->npages = n;
+            s->pages = (struct arm_snapshot_page *) calloc(n + 1, sizeof(struct arm_snapshot_page));
+            s->data = (unsigned char *) malloc(((size_t) n + 1) * ARM_PAGE_SIZE);
+            s->dirty = (int *) malloc((n + 1) * sizeof(int));
+            if(s->pages == NULL || s->data == NULL || s->dirty == NULL) {
+                free(s->pages);
+                free(s->data);
+                free(s->dirty);
+                free(s);
+                return NULL;
+            }
+        }
+
+    }
+
+    s->cpu.stack_addr = as->stack_addr;
+    s->cpu.stack_size = as->stack_size;
+    memcpy(s->cpu.regs, as->regs, sizeof(s->cpu.regs));
+    s->cpu.cpsr = as->cpsr;
+    s->cpu.flag_op = as->flag_op;
+    s->cpu.flag_a = as->flag_a;
+    s->cpu.flag_b = as->flag_b;
+    s->cpu.num_instr = as->num_instr;
+    s->cpu.data_instr = as->data_instr;
+    s->cpu.b_instr = as->b_instr;
+    s->cpu.mem_instr = as->mem_instr;
+    s->cpu.fault = as->fault;
+    s->cpu.fault_addr = as->fault_addr;
+    s->cpu.fault_pc = as->fault_pc;
+
+    if(mem->snap != NULL) {
+        arm_snapshot_detach(mem, true);
+    }
+
+    for(i = 0; i < s->npages; i++) {
+        arm_mem_page(mem, s->pages[i].guest)->prot |= ARM_PAGE_CLEAN;
+    }
+    mem->snap = s;
+
+    arm_tlb_flush(as);
+
+    return s;
+
+}
+
+/* Copies page i of s back into the guest, dropping decoded copies of any
+code on it */
+static void arm_snapshot_restore_page(struct arm_state *as, struct arm_snapshot *s,
+                                      struct arm_page *page, int i) {
+
+    struct arm_snapshot_page *p = &s->pages[i];
+    struct arm_tlb_entry *e;
+    unsigned int addr;
+
+    memcpy(page->host + p->lo, s->data + (size_t) i * ARM_PAGE_SIZE + p->lo, p->hi - p->lo);
+
+    if(arm_page_prot(page) & ARM_PAGE_CODE) {
+        for(addr = p->guest + p->lo; addr < p->guest + p->hi; addr += 4) {
+            arm_dcache_invalidate(as, addr);
+        }
+        arm_bcache_invalidate(as, p->guest);
+        arm_code_changed(as);
+    }
+
+    e = &as->tlb_write[ARM_TLB_INDEX(p->guest)];
+    if(e->tag == p->guest) {
+        e->tag = ARM_TLB_EMPTY;
+    }
+
+    page->prot |= ARM_PAGE_CLEAN;
+    p->dirty = false;
+
+}
+
+/* Puts as and its address space back the way they were when s was taken.
+If s is what the address space tracks only the dirty pages are copied,
+else all of them and s is tracked from now on. Returns -1 (and changes
+nothing) if the stack of as is not where it was or a page of s is not
+mapped writable */
+int arm_state_restore(struct arm_state *as, struct arm_snapshot *s) {
+
+    struct arm_mem *mem = as->mem;
+    struct arm_page *page;
+    int i;
+
+    if(as->stack_addr != s->cpu.stack_addr || as->stack_size != s->cpu.stack_size) {
+        return -1;
+    }
+
+    if(mem->snap == s) {
+
+        for(i = 0; i < s->ndirty; i++) {
+            arm_snapshot_restore_page(as, s, arm_mem_page(mem, s->pages[s->dirty[i]].guest), s->dirty[i]);
+        }
+
+    } else {
+
+        for(i = 0; i < s->npages; i++) {
+            page = arm_mem_page(mem, s->pages[i].guest);
+            if(page == NULL || page->host == NULL || !(page->prot & ARM_PROT_WRITE)) {
+                return -1;
+            }
+        }
+
+        if(mem->snap != NULL) {
+            arm_snapshot_detach(mem, true);
+        }
+
+        for(i = 0; i < s->npages; i++) {
+            arm_snapshot_restore_page(as, s, arm_mem_page(mem, s->pages[i].guest), i);
+        }
+        mem->snap = s;
+
+        arm_tlb_flush(as);
+
+    }
+
+    s->ndirty = 0;
+
+    memcpy(as->regs, s->cpu.regs, sizeof(as->regs));
+    as->cpsr = s->cpu.cpsr;
+    as->flag_op = s->cpu.flag_op;
+    as->flag_a = s->cpu.flag_a;
+    as->flag_b = s->cpu.flag_b;
+    as->num_instr = s->cpu.num_instr;
+    as->data_instr = s->cpu.data_instr;
+    as->b_instr = s->cpu.b_instr;
+    as->mem_instr = s->cpu.mem_instr;
+    as->fault = s->cpu.fault;
+    as->fault_addr = s->cpu.fault_addr;
+    as->fault_pc = s->cpu.fault_pc;
+
+    return 0;
+
+}
+
+/* Frees s. If mem tracks it, mem stops (mem must not have been freed yet) */
+void arm_snapshot_free(struct arm_mem *mem, struct arm_snapshot *s) {
+
+    if(mem != NULL && mem->snap == s) {
+        arm_snapshot_detach(mem, false);
+    }
+
+    if(s->map != NULL) {
+        munmap(s->map, s->map_size);
+    } else {
+        free(s->data);
+    }
+    free(s->pages);
+    free(s->dirty);
+    free(s);
+
+}
+
+/* Writes s (taken in mem) to the file path. Returns -1 if it cannot be written */
+int arm_snapshot_save(struct arm_mem *mem, struct arm_snapshot *s, const char *path) {
+
+    struct arm_snapshot_header header;
+    struct arm_snapshot_range range;
+    unsigned char page[ARM_PAGE_SIZE];
+    struct arm_snapshot_page *p;
+    long pad;
+    FILE *f;
+    int i;
+    bool ok;
+
+    f = fopen(path, "wb");
+    if(f == NULL) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.page_size = ARM_PAGE_SIZE;
+    header.npages = s->npages;
+    header.cpu = s->cpu;
+
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for(i = 0; ok && i < s->npages; i++) {
+        range.guest = s->pages[i].guest;
+        range.lo = s->pages[i].lo;
+        range.hi = s->pages[i].hi;
+        ok = fwrite(&range, sizeof(range), 1, f) == 1;
+    }
+
+    memset(page, 0, sizeof(page));
+    pad = -(long) (sizeof(header) + (size_t) s->npages * sizeof(range)) & ARM_PAGE_MASK;
+    ok = ok && fwrite(page, 1, pad, f) == (size_t) pad;
+
+    /* A page mem tracks s for that has not been saved is still as it was */
+    for(i = 0; ok && i < s->npages; i++) {
+        p = &s->pages[i];
+        memset(page, 0, sizeof(page));
+        if(p->saved) {
+            memcpy(page + p->lo, s->data + (size_t) i * ARM_PAGE_SIZE + p->lo, p->hi - p->lo);
+        } else {
+            memcpy(page + p->lo, arm_mem_page(mem, p->guest)->host + p->lo, p->hi - p->lo);
+        }
+        ok = fwrite(page, sizeof(page), 1, f) == 1;
+    }
+
+    if(fclose(f) != 0) {
+        ok = false;
+    }
+
+    return ok ? 0 : -1;
+
+}
+
+/* Maps the snapshot file path (see arm_snapshot_save) back in. Its first
+restore copies every page. Returns NULL and sets *error if it cannot be read */
+struct arm_snapshot *arm_snapshot_load(const char *path, const char **error) {
+
+    const struct arm_snapshot_header *header;
+    const struct arm_snapshot_range *ranges;
+    struct arm_snapshot *s;
+    struct stat st;
+    size_t data_offset;
+    void *map;
+    int fd, i;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        *error = "cannot open the file";
+        return NULL;
+    }
+
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct arm_snapshot_header)) {
+        close(fd);
+        *error = "not a snapshot";
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        *error = "cannot map the file";
+        return NULL;
+    }
+
+    header = (const struct arm_snapshot_header *) map;
+    ranges = (const struct arm_snapshot_range *) (header + 1);
+    data_offset = (sizeof(*header) + (size_t) header->npages * sizeof(*ranges) + ARM_PAGE_MASK)
+                  & ~(size_t) ARM_PAGE_MASK;
+
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+       || header->page_size != ARM_PAGE_SIZE || header->npages > ARM_L1_SIZE * ARM_L2_SIZE
+       || data_offset + (size_t) header->npages * ARM_PAGE_SIZE != (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        *error = "not a snapshot";
+        return NULL;
+    }
+
+    s = (struct arm_snapshot *) calloc(1, sizeof(struct arm_snapshot));
+    if(s != NULL) {
+        s->pages = (struct arm_snapshot_page *) calloc(header->npages + 1, sizeof(struct arm_snapshot_page));
+        s->dirty = (int *) malloc((header->npages + 1) * sizeof(int));
+    }
+    if(s == NULL || s->pages == NULL || s->dirty == NULL) {
+        if(s != NULL) {
+            free(s->pages);
+            free(s->dirty);
+            free(s);
+        }
+        munmap(map, st.st_size);
+        *error = "not enough memory";
+        return NULL;
+    }
+
+    s->cpu = header->cpu;
+    s->npages = header->npages;
+    s->data = (unsigned char *) map + data_offset;
+    s->map = map;
+    s->map_size = st.st_size;
+
+    for(i = 0; i < s->npages; i++) {
+        if(ranges[i].lo >= ranges[i].hi || ranges[i].hi > ARM_PAGE_SIZE
+           || (ranges[i].guest & ARM_PAGE_MASK) != 0
+           || (i > 0 && ranges[i].guest <= ranges[i - 1].guest)) {
+            arm_snapshot_free(NULL, s);
+            *error = "not a snapshot";
+            return NULL;
+        }
+        s->pages[i].guest = ranges[i].guest;
+        s->pages[i].lo = ranges[i].lo;
+        s->pages[i].hi = ranges[i].hi;
+        s->pages[i].saved = true;
+    }
+
+    return s;
+
+}
+
+/* The page holding the size bytes at addr (which must not cross a page) if
+it has all the permissions in prot and they are all mapped, else NULL */
+static inline struct arm_page *arm_mem_check(struct arm_state *as, unsigned int addr,
+                                             unsigned int size, unsigned int prot) {
+
+    struct arm_page *page = arm_mem_page(as->mem, addr);
+
+    if(page == NULL || (arm_page_prot(page) & prot) != prot || (addr & ARM_PAGE_MASK) < page->lo
+       || (addr & ARM_PAGE_MASK) + size > page->hi) {
+        return NULL;
+    }
+
+    return page;
+
+}
+
+/* True if all of page is mapped. Only those go in the TLB, whose hits are
+not checked against lo and hi */
+static inline bool arm_mem_whole(struct arm_page *page) {
+
+    return page->lo == 0 && page->hi == ARM_PAGE_SIZE;
+
+}
+
+/* The size bytes (1, 2 or 4) at host address p, zero extended */
+static inline unsigned int arm_host_read(uintptr_t p, unsigned int size) {
+
+    switch(size) {
+    case 1:
+        return *(unsigned char *) p;
+    case 2:
+        return *(unsigned short *) p;
+    default:
+        return *(unsigned int *) p;
+    }
+
+}
+
+/* Writes the low size bytes of value at host address p */
+static inline void arm_host_write(uintptr_t p, unsigned int size, unsigned int value) {
+
+    switch(size) {
+    case 1:
+        *(unsigned char *) p = value;
+        break;
+    case 2:
+        *(unsigned short *) p = value;
+        break;
+    default:
+        *(unsigned int *) p = value;
+        break;
+    }
+
+}
+
+/* Load of size bytes (1, 2 or 4) that missed the TLB. Fills the TLB for
+the page, unaligned accesses are read a byte at a time. Returns false after
+a fault */
+bool arm_mem_read_slow(struct arm_state *as, unsigned int addr, unsigned int size, unsigned int *value) {
+
+    struct arm_tlb_entry *e;
+    struct arm_page *page;
+    unsigned int i;
+
+    if(addr & (size - 1)) {
+
+        *value = 0;
+        for(i = 0; i < size; i++) {
+            page = arm_mem_check(as, addr + i, 1, ARM_PROT_READ);
+            if(page == NULL) {
+                arm_fault(as, FAULT_READ, addr + i);
+                return false;
+            }
+            *value |= page->host[(addr + i) & ARM_PAGE_MASK] << (8 * i);
+        }
+
+        return true;
+
+    }
+
+    page = arm_mem_check(as, addr, size, ARM_PROT_READ);
+    if(page == NULL) {
+        arm_fault(as, FAULT_READ, addr);
+        return false;
+    }
+
+    *value = arm_host_read((uintptr_t) page->host + (addr & ARM_PAGE_MASK), size);
+
+    if(arm_mem_whole(page)) {
+        e = &as->tlb_read[ARM_TLB_INDEX(addr)];
+        e->tag = addr & ~ARM_PAGE_MASK;
+        e->addend = (uintptr_t) page->host - e->tag;
+    }
+
+    return true;
+
+}
+
+/* Store of the low size bytes of value that missed the TLB. Pages with code
+on them are never put in the TLB, so every store to one comes here and drops
+the decoded and translated copies of what it overwrote. The first store to a
+clean page comes here too (see arm_snapshot_dirty). Returns false after a
+fault */
+bool arm_mem_write_slow(struct arm_state *as, unsigned int addr, unsigned int size, unsigned int value) {
+
+    struct arm_tlb_entry *e;
+    struct arm_page *page;
+    unsigned int i;
+
+    if(addr & (size - 1)) {
+
+        for(i = 0; i < size; i++) {
+            if(arm_mem_check(as, addr + i, 1, ARM_PROT_WRITE) == NULL) {
+                arm_fault(as, FAULT_WRITE, addr + i);
+                return false;
+            }
+        }
+
+        for(i = 0; i < size; i++) {
+            page = arm_mem_page(as->mem, addr + i);
+            if(page->prot & ARM_PAGE_CLEAN) {
+                arm_snapshot_dirty(as->mem, page, addr + i);
+            }
+            page->host[(addr + i) & ARM_PAGE_MASK] = value >> (8 * i);
+            if(arm_page_prot(page) & ARM_PAGE_CODE) {
+                arm_dcache_invalidate(as, addr + i);
+                arm_bcache_invalidate(as, addr + i);
+                arm_code_changed(as);
+            }
+        }
+
+        return true;
+
+    }
+
+    page = arm_mem_check(as, addr, size, ARM_PROT_WRITE);
+    if(page == NULL) {
+        arm_fault(as, FAULT_WRITE, addr);
+        return false;
+    }
+
+    if(page->prot & ARM_PAGE_CLEAN) {
+        arm_snapshot_dirty(as->mem, page, addr);
+    }
+
+    arm_host_write((uintptr_t) page->host + (addr & ARM_PAGE_MASK), size, value);
+
+    if(arm_page_prot(page) & ARM_PAGE_CODE) {
+        arm_dcache_invalidate(as, addr);
+        arm_bcache_invalidate(as, addr);
+        arm_code_changed(as);
+    } else if(arm_mem_whole(page)) {
+        e = &as->tlb_write[ARM_TLB_INDEX(addr)];
+        e->tag = addr & ~ARM_PAGE_MASK;
+        e->addend = (uintptr_t) page->host - e->tag;
+    }
+
+    return true;
+
+}
+
+/* Reads size bytes (1, 2 or 4, zero extended) at guest address addr into
+*value. Only accesses aligned to their size hit the TLB. Returns false if
+the guest was stopped with a fault */
+static inline bool arm_mem_read_size(struct arm_state *as, unsigned int addr, unsigned int size,
+                                     unsigned int *value) {
+
+    struct arm_tlb_entry *e = &as->tlb_read[ARM_TLB_INDEX(addr)];
+
+    if(e->tag == (addr & ARM_TLB_MASK_SIZE(size))) {
+        *value = arm_host_read(e->addend + addr, size);
+        return true;
+    }
+
+    return arm_mem_read_slow(as, addr, size, value);
+
+}
+
+/* Writes the low size bytes of value at guest address addr. Returns false
+if the guest was stopped with a fault */
+static inline bool arm_mem_write_size(struct arm_state *as, unsigned int addr, unsigned int size,
+                                      unsigned int value) {
+
+    struct arm_tlb_entry *e = &as->tlb_write[ARM_TLB_INDEX(addr)];
+
+    if(e->tag == (addr & ARM_TLB_MASK_SIZE(size))) {
+        arm_host_write(e->addend + addr, size, value);
+        return true;
+    }
+
+    return arm_mem_write_slow(as, addr, size, value);
+
+}
+
+/* Reads the word at guest address addr into *value. Returns false if the
+guest was stopped with a fault */
+static inline bool arm_mem_read(struct arm_state *as, unsigned int addr, unsigned int *value) {
+
+    return arm_mem_read_size(as, addr, 4, value);
+
+}
+
+/* Writes value to the word at guest address addr. Returns false if the
+guest was stopped with a fault */
+static inline bool arm_mem_write(struct arm_state *as, unsigned int addr, unsigned int value) {
+
+    return arm_mem_write_size(as, addr, 4, value);
+
+}
+
+/* Reads the instruction word at pc for the decoder and marks its page as
+holding code (see arm_mem_write_slow). Returns false if pc is not in an
+executable page */
+bool arm_mem_fetch(struct arm_state *as, unsigned int pc, unsigned int *iw) {
+
+    struct arm_tlb_entry *e;
+    struct arm_page *page;
+
+    page = arm_mem_check(as, pc, 4, ARM_PROT_EXEC);
+    if(page == NULL || (pc & 3) != 0) {
+        return false;
+    }
+
+    /* The page table is shared by every state of the address space, whose
+    write TLBs may still hold the page */
+    if(!(arm_page_prot(page) & ARM_PAGE_CODE)
+       && !(__atomic_fetch_or(&page->prot, ARM_PAGE_CODE, __ATOMIC_RELAXED) & ARM_PAGE_CODE)) {
+        arm_code_changed(as);
+    }
+
+    e = &as->tlb_write[ARM_TLB_INDEX(pc)];
+    if(e->tag == (pc & ~ARM_PAGE_MASK)) {
+        e->tag = ARM_TLB_EMPTY;
+    }
+
+    *iw = *(unsigned int *) (page->host + (pc & ARM_PAGE_MASK));
+
+    return true;
+
+}
+
+/* True for the single register loads and stores, LDR to LDRSH */
+static inline bool arm_op_transfer(unsigned int op) {
+
+    return op >= OP_LDR && op <= OP_LDRSH;
+
+}
+
+/* True if the single register transfer op is a load */
+static inline bool arm_op_load(unsigned int op) {
+
+    return op == OP_LDR || op == OP_LDRB || op == OP_LDRH || op == OP_LDRSB || op == OP_LDRSH;
+
+}
+
+/* Number of bytes the single register transfer op moves */
+static inline unsigned int arm_op_size(unsigned int op) {
+
+    switch(op) {
+    case OP_LDR:
+    case OP_STR:
+        return 4;
+    case OP_LDRB:
+    case OP_STRB:
+    case OP_LDRSB:
+        return 1;
+    default:
+        return 2;
+    }
+
+}
+
+/* The offset of a load or store in form (its di->form), added to Rn. For
+a register offset di->imm is 0 to add it and all ones to subtract it, for
+an immediate arm_decode already negated it when U = 0 */
+static inline unsigned int arm_transfer_offset(struct arm_state *as, struct arm_decoded *di,
+                                               unsigned int form) {
+
+    unsigned int carry, offset;
+
+    switch(form) {
+
+    case OPND_IMM:
+        return di->imm;
+
+    case OPND_REG:
+        offset = arm_reg(as, di, di->rm);
+        break;
+
+    default:
+        carry = di->shift_type == SHIFT_RRX ? arm_flags_carry(as) : 0;
+        offset = arm_shift(arm_reg(as, di, di->rm), di->shift_type, di->shift_amount, &carry);
+        break;
+
+    }
+
+    return (offset ^ di->imm) - di->imm;
+
+}
+
+/* The address the load or store di uses, and in *wb what Rn becomes with
+writeback. For the engines that do not have a handler per addressing mode */
+static inline unsigned int arm_transfer_addr(struct arm_state *as, struct arm_decoded *di,
+                                             unsigned int *wb) {
+
+    unsigned int base = arm_reg(as, di, di->rn);
+
+    *wb = base + arm_transfer_offset(as, di, di->form);
+
+    return di->index == INDEX_POST ? base : *wb;
+
+}
+
+/* Single register load or store. op, form and index are constants in each
+of the handlers below, so every addressing mode gets its own code with the
+unused parts left out. A fault leaves Rn as it was. A loaded Rd wins over
+the writeback when they are the same register */
+static inline __attribute__((always_inline))
+void arm_transfer(struct arm_state *as, struct arm_decoded *di, unsigned int op,
+                  unsigned int form, unsigned int index) {
+
+    unsigned int base, wb, addr, value;
+
+    as->num_instr++;
+    as->mem_instr++;
+
+    if(!is_valid(as, di->cond)) {
+        as->regs[PC] += 4;
+        return;
+    }
+
+    base = arm_reg(as, di, di->rn);
+    wb = base + arm_transfer_offset(as, di, form);
+    addr = index == INDEX_POST ? base : wb;
+
+    if(arm_op_load(op)) {
+
+        if(!arm_mem_read_size(as, addr, arm_op_size(op), &value)) {
+            return;
+        }
+        if(op == OP_LDRSB) {
+            value = (unsigned int) (signed char) value;
+        } else if(op == OP_LDRSH) {
+            value = (unsigned int) (short) value;
+        }
+
+        if(index != INDEX_OFFSET) {
+            as->regs[di->rn] = wb;
+        }
+        as->regs[di->rd] = value;
+        if(di->rd != PC) {
+            as->regs[PC] += 4;
+        }
+
+    } else {
+
+        if(!arm_mem_write_size(as, addr, arm_op_size(op), arm_reg(as, di, di->rd))) {
+            return;
+        }
+
+        if(index != INDEX_OFFSET) {
+            as->regs[di->rn] = wb;
+        }
+        as->regs[PC] += 4;
+
+    }
+
+}
+
+/* Defines the handlers of a load or store op for every offset form and
+index mode, ex. execute_ldrb_reg_post_instruction for ldrb rd, [rn], rm */
+#define ARM_TRANSFER_HANDLER(name, op, form, index) \
+    void execute_##name##_instruction(struct arm_state *as, struct arm_decoded *di) { \
+        arm_transfer(as, di, op, form, index); \
+    }
+
+#define ARM_TRANSFER_HANDLERS(name, op) \
+    ARM_TRANSFER_HANDLER(name##_imm_offset, op, OPND_IMM, INDEX_OFFSET) \
+    ARM_TRANSFER_HANDLER(name##_imm_pre, op, OPND_IMM, INDEX_PRE) \
+    ARM_TRANSFER_HANDLER(name##_imm_post, op, OPND_IMM, INDEX_POST) \
+    ARM_TRANSFER_HANDLER(name##_reg_offset, op, OPND_REG, INDEX_OFFSET) \
+    ARM_TRANSFER_HANDLER(name##_reg_pre, op, OPND_REG, INDEX_PRE) \
+    ARM_TRANSFER_HANDLER(name##_reg_post, op, OPND_REG, INDEX_POST) \
+    ARM_TRANSFER_HANDLER(name##_shift_offset, op, OPND_SHIFT_IMM, INDEX_OFFSET) \
+    ARM_TRANSFER_HANDLER(name##_shift_pre, op, OPND_SHIFT_IMM, INDEX_PRE) \
+    ARM_TRANSFER_HANDLER(name##_shift_post, op, OPND_SHIFT_IMM, INDEX_POST)
+
+ARM_TRANSFER_HANDLERS(ldr, OP_LDR)
+ARM_TRANSFER_HANDLERS(str, OP_STR)
+ARM_TRANSFER_HANDLERS(ldrb, OP_LDRB)
+ARM_TRANSFER_HANDLERS(strb, OP_STRB)
+ARM_TRANSFER_HANDLERS(ldrh, OP_LDRH)
+ARM_TRANSFER_HANDLERS(strh, OP_STRH)
+ARM_TRANSFER_HANDLERS(ldrsb, OP_LDRSB)
+ARM_TRANSFER_HANDLERS(ldrsh, OP_LDRSH)
+
+/* arm_transfer_handlers[op - OP_LDR][form][index], picked by arm_decode */
+#define ARM_TRANSFER_ROW(name) { \
+    {execute_##name##_imm_offset_instruction, execute_##name##_imm_pre_instruction, \
+     execute_##name##_imm_post_instruction}, \
+    {execute_##name##_reg_offset_instruction, execute_##name##_reg_pre_instruction, \
+     execute_##name##_reg_post_instruction}, \
+    {execute_##name##_shift_offset_instruction, execute_##name##_shift_pre_instruction, \
+     execute_##name##_shift_post_instruction}}
+
+const arm_handler arm_transfer_handlers[OP_LDRSH - OP_LDR + 1][3][3] = {
+    ARM_TRANSFER_ROW(ldr),
+    ARM_TRANSFER_ROW(str),
+    ARM_TRANSFER_ROW(ldrb),
+    ARM_TRANSFER_ROW(strb),
+    ARM_TRANSFER_ROW(ldrh),
+    ARM_TRANSFER_ROW(strh),
+    ARM_TRANSFER_ROW(ldrsb),
+    ARM_TRANSFER_ROW(ldrsh),
+};
+
+#undef ARM_TRANSFER_ROW
+#undef ARM_TRANSFER_HANDLERS
+#undef ARM_TRANSFER_HANDLER
+
+/* The addressing modes of LDM and STM (P and U, bits 24:23) */
+enum arm_multiple_mode {
+    MULTIPLE_DA,
+    MULTIPLE_IA,
+    MULTIPLE_DB,
+    MULTIPLE_IB
+};
+
+/* The lowest address LDM or STM di transfers, and in *wb what Rn becomes
+with writeback. The lowest register goes to the lowest address */
+static inline unsigned int arm_multiple_addr(struct arm_state *as, struct arm_decoded *di,
+                                             unsigned int *wb) {
+
+    unsigned int base = as->regs[di->rn], size = 4 * di->shift_amount;
+
+    switch(di->shift_type) {
+    case MULTIPLE_DA:
+        *wb = base - size;
+        return base - size + 4;
+    case MULTIPLE_IA:
+        *wb = base + size;
+        return base;
+    case MULTIPLE_DB:
+        *wb = base - size;
+        return base - size;
+    default:
+        *wb = base + size;
+        return base + 4;
+    }
+
+}
+
+/* Host address of the n words at addr if they are all in the page tlb has
+for addr, else NULL. Then each word goes through arm_mem_read or
+arm_mem_write, which fills the TLB for the next time. The TLB only holds
+pages that are mapped from end to end (see arm_mem_whole), so a span in
+one of them needs no check against the bytes a mapping covers; one that
+runs past a partly mapped page takes the word by word path and faults */
+static inline unsigned int *arm_mem_block(struct arm_tlb_entry *tlb, unsigned int addr, unsigned int n) {
+
+    struct arm_tlb_entry *e = &tlb[ARM_TLB_INDEX(addr)];
+
+    if(n == 0 || e->tag != (addr & ARM_TLB_MASK)
+       || ((addr ^ (addr + 4 * n - 1)) & ~ARM_PAGE_MASK) != 0) {
+        return NULL;
+    }
+
+    return (unsigned int *) (e->addend + addr);
+
+}
+
+/* Load multiple (and POP). The words are all read before any register is
+written, so a fault leaves the registers as they were. With the whole list
+in one page that the TLB has, it is one block copy */
+void execute_ldm_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int values[NREGS], *host, addr, wb;
+    int r, n, count = di->shift_amount;
+
+    as->num_instr++;
+    as->mem_instr++;
+
+    if(!is_valid(as, di->cond)) {
+        as->regs[PC] += 4;
+        return;
+    }
+
+    addr = arm_multiple_addr(as, di, &wb);
+
+    host = arm_mem_block(as->tlb_read, addr, count);
+    if(host != NULL) {
+        memcpy(values, host, 4 * count);
+    } else {
+        for(n = 0; n < count; n++) {
+            if(!arm_mem_read(as, addr + 4 * n, &values[n])) {
+                return;
+            }
+        }
+    }
+
+    /* A loaded Rn wins over the writeback, a loaded PC over PC + 4 */
+    if(di->writeback) {
+        as->regs[di->rn] = wb;
+    }
+    as->regs[PC] += 4;
+
+    for(r = 0, n = 0; n < count; r++) {
+        if(di->imm & (1 << r)) {
+            as->regs[r] = values[n++];
+        }
+    }
+
+}
+
+/* Store multiple (and PUSH). A stored PC is the address of the instruction
+plus 8 and a stored Rn is its value before the writeback */
+void execute_stm_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int values[NREGS], *host, addr, wb;
+    int r, n, count = di->shift_amount;
+
+    as->num_instr++;
+    as->mem_instr++;
+
+    if(!is_valid(as, di->cond)) {
+        as->regs[PC] += 4;
+        return;
+    }
+
+    addr = arm_multiple_addr(as, di, &wb);
+
+    for(r = 0, n = 0; n < count; r++) {
+        if(di->imm & (1 << r)) {
+            values[n++] = arm_reg(as, di, r);
+        }
+    }
+
+    host = arm_mem_block(as->tlb_write, addr, count);
+    if(host != NULL) {
+        memcpy(host, values, 4 * count);
+    } else {
+        for(n = 0; n < count; n++) {
+            if(!arm_mem_write(as, addr + 4 * n, values[n])) {
+                return;
+            }
+        }
+    }
+
+    if(di->writeback) {
+        as->regs[di->rn] = wb;
+    }
+    as->regs[PC] += 4;
+
+}
+
+/* Stands in for an instruction that could not be fetched */
+void execute_fetch_fault(struct arm_state *as, struct arm_decoded *di) {
+
+    arm_fault(as, FAULT_FETCH, as->regs[PC]);
+
+}
+
+static inline void arm_branch_bx(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr++;
+    as->b_instr++;
+
+    if(is_valid(as, di->cond)) {
+        as->regs[PC] = as->regs[di->rm];
+    } else {
+        as->regs[PC] += 4;
+    }
+
+}
+
+void execute_bx_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int pc = as->regs[PC];
+
+    arm_branch_bx(as, di);
+
+    if(as->cov != NULL) {
+        arm_cov_edge(as, pc, as->regs[PC]);
+    }
+
+}
+
+/* Instructions that are not decoded are skipped without changing any state */
+void execute_unknown_instruction(struct arm_state *as, struct arm_decoded *di) {
+
+}
+
+/* Handler for every op, in enum arm_op order. The loads and stores get the
+one for their addressing mode from arm_transfer_handlers in arm_decode */
+const arm_handler arm_handlers[OP_COUNT] = {
+    [OP_UNKNOWN] = execute_unknown_instruction,
+    [OP_AND] = execute_and_instruction,
+    [OP_EOR] = execute_eor_instruction,
+    [OP_SUB] = execute_sub_instruction,
+    [OP_RSB] = execute_rsb_instruction,
+    [OP_ADD] = execute_add_instruction,
+    [OP_ADC] = execute_adc_instruction,
+    [OP_SBC] = execute_sbc_instruction,
+    [OP_RSC] = execute_rsc_instruction,
+    [OP_TST] = execute_tst_instruction,
+    [OP_TEQ] = execute_teq_instruction,
+    [OP_CMP] = execute_cmp_instruction,
+    [OP_CMN] = execute_cmn_instruction,
+    [OP_ORR] = execute_orr_instruction,
+    [OP_MOV] = execute_mov_instruction,
+    [OP_BIC] = execute_bic_instruction,
+    [OP_MVN] = execute_mvn_instruction,
+    [OP_MUL] = execute_mul_instruction,
+    [OP_MLA] = execute_mla_instruction,
+    [OP_UMULL] = execute_umull_instruction,
+    [OP_UMLAL] = execute_umlal_instruction,
+    [OP_SMULL] = execute_smull_instruction,
+    [OP_SMLAL] = execute_smlal_instruction,
+    [OP_SDIV] = execute_sdiv_instruction,
+    [OP_UDIV] = execute_udiv_instruction,
+    [OP_LDR] = execute_ldr_imm_offset_instruction,
+    [OP_STR] = execute_str_imm_offset_instruction,
+    [OP_LDRB] = execute_ldrb_imm_offset_instruction,
+    [OP_STRB] = execute_strb_imm_offset_instruction,
+    [OP_LDRH] = execute_ldrh_imm_offset_instruction,
+    [OP_STRH] = execute_strh_imm_offset_instruction,
+    [OP_LDRSB] = execute_ldrsb_imm_offset_instruction,
+    [OP_LDRSH] = execute_ldrsh_imm_offset_instruction,
+    [OP_LDM] = execute_ldm_instruction,
+    [OP_STM] = execute_stm_instruction,
+    [OP_B] = execute_b_instruction,
+    [OP_BL] = execute_bl_instruction,
+    [OP_BX] = execute_bx_instruction,
+};
+
+/* arm_decode_table[bits 27:20 << 4 | bits 7:4] is the op of an instruction
+word. It is generated from arm_insns.def by mkdecode (see the Makefile) */
+#include "arm_decode_table.h"
+
+/* The offset and index mode of the load or store iw (see the notes at the
+top). Word and byte transfers have a 12 bit immediate or a register shifted
+by an immediate, halfword and signed ones an 8 bit immediate split over
+11:8 and 3:0 or a plain register. Picks the handler for the mode */
+static void arm_decode_transfer(struct arm_decoded *di, unsigned int iw) {
+
+    bool up = (iw >> 23) & 0b1, halfword = !((iw >> 26) & 0b1);
+
+    if(!((iw >> 24) & 0b1)) {
+        di->index = INDEX_POST;
+    } else if((iw >> 21) & 0b1) {
+        di->index = INDEX_PRE;
+    } else {
+        di->index = INDEX_OFFSET;
+    }
+    di->writeback = di->index != INDEX_OFFSET;
+
+    if(halfword ? (iw >> 22) & 0b1 : !((iw >> 25) & 0b1)) {
+
+        di->form = OPND_IMM;
+        di->imm = halfword ? ((iw >> 4) & 0xF0) | (iw & 0xF) : iw & 0xFFF;
+        if(!up) {
+            di->imm = -di->imm;
+        }
+
+    } else {
+
+        if(halfword || (di->shift_amount == 0 && di->shift_type == SHIFT_LSL)) {
+            di->form = OPND_REG;
+        } else {
+            di->form = OPND_SHIFT_IMM;
+            if(di->shift_amount == 0) {
+                if(di->shift_type == SHIFT_ROR) {
+                    di->shift_type = SHIFT_RRX;
+                } else {
+                    di->shift_amount = 32;
+                }
+            }
+        }
+        di->imm = up ? 0 : 0xFFFFFFFF;
+
+    }
+
+    di->handler = arm_transfer_handlers[di->op - OP_LDR][di->form][di->index];
+
+}
+
+/* Decodes the instruction word iw found at pc into di. The op comes from one
+lookup in arm_decode_table, then the fields the handler needs are pulled out
+(and the immediate rotated), so none of this has to be done again the next
+time pc is executed */
+void arm_decode(struct arm_decoded *di, unsigned int pc, unsigned int iw) {
+
+    unsigned int offset, rotate;
+
+    di->pc = pc;
+    di->iw = iw;
+
+    di->op = arm_decode_table[((iw >> 16) & 0xFF0) | ((iw >> 4) & 0xF)];
+    di->handler = arm_handlers[di->op];
+
+    di->cond = (iw >> 28) & 0xF;
+    di->rn = (iw >> 16) & 0xF;
+    di->rd = (iw >> 12) & 0xF;
+    di->rs = (iw >> 8) & 0xF;
+    di->rm = iw & 0xF;
+    di->setflags = (iw >> 20) & 0b1;
+    di->shift_type = (iw >> 5) & 0b11;
+    di->shift_amount = (iw >> 7) & 0x1F;
+    di->fused = FUSE_NONE;
+    di->writeback = 0;
+    di->index = INDEX_OFFSET;
+    di->imm = 0;
+
+    if(di->op == OP_B || di->op == OP_BL) {
+
+        offset = iw & 0xFFFFFF;
+        if(offset & 0x800000) {
+            offset = 0xFF000000 + offset;
+        }
+        di->imm = (offset << 2) + 8;
+
+    } else if(arm_op_transfer(di->op)) {
+
+        arm_decode_transfer(di, iw);
+
+    } else if(di->op >= OP_MUL && di->op <= OP_UDIV) {
+
+        /* Rd (RdHi for the long multiplies) is 19:16 and the accumulator
+        (RdLo) 15:12, the operands are Rm and Rs. The divides put Rd at
+        19:16 too and divide Rn (3:0) by Rm (11:8) */
+        di->form = OPND_REG;
+        di->rd = (iw >> 16) & 0xF;
+        if(di->op == OP_SDIV || di->op == OP_UDIV) {
+            di->rn = iw & 0xF;
+            di->rm = (iw >> 8) & 0xF;
+            di->setflags = 0;
+        } else {
+            di->rn = (iw >> 12) & 0xF;
+        }
+
+    } else if(di->op == OP_BX) {
+
+        di->form = OPND_REG;
+
+    } else if(di->op == OP_LDM || di->op == OP_STM) {
+
+        /* imm is the register list, shift_type the addressing mode
+        (P and U) and shift_amount the number of registers */
+        di->form = OPND_REG;
+        di->imm = iw & 0xFFFF;
+        di->shift_type = (iw >> 23) & 0b11;
+        di->shift_amount = __builtin_popcount(di->imm);
+        di->writeback = (iw >> 21) & 0b1;
+
+    } else if(di->op != OP_UNKNOWN) {
+
+        if((iw >> 25) & 0b1) {
+
+            /* imm8 rotated right by twice rot (11:8). shift_amount is the
+            rotation, when it is not 0 bit 31 is the shifter carry */
+            rotate = ((iw >> 8) & 0xF) * 2;
+            di->form = OPND_IMM;
+            di->imm = iw & 0xFF;
+            di->shift_amount = rotate;
+            if(rotate != 0) {
+                di->imm = (di->imm >> rotate) | (di->imm << (32 - rotate));
+            }
+
+        } else if((iw >> 4) & 0b1) {
+
+            di->form = OPND_SHIFT_REG;
+
+        } else if(di->shift_amount == 0 && di->shift_type == SHIFT_LSL) {
+
+            di->form = OPND_REG;
+
+        } else {
+
+            di->form = OPND_SHIFT_IMM;
+            if(di->shift_amount == 0) {
+                if(di->shift_type == SHIFT_ROR) {
+                    di->shift_type = SHIFT_RRX;
+                } else {
+                    di->shift_amount = 32;
+                }
+            }
+
+        }
+
+    }
+
+}
+
+/* Returns the decoded instruction at pc, decoding it on a cache miss */
+static inline struct arm_decoded *arm_dcache_lookup(struct arm_state *as, unsigned int pc) {
+
+    struct arm_decoded *di;
+    unsigned int iw;
+
+    di = &as->dcache[DCACHE_INDEX(pc)];
+    if(di->pc != pc) {
+
+        if(arm_mem_fetch(as, pc, &iw)) {
+            arm_decode(di, pc, iw);
+        } else {
+            /* Left out of the cache, so pc faults every time it is run */
+            arm_decode(di, pc, 0);
+            di->pc = 0;
+            di->op = OP_UNKNOWN;
+            di->cond = COND_AL;
+            di->handler = execute_fetch_fault;
+        }
+
+    }
+
+    return di;
+
+}
+
+void arm_state_execute_one(struct arm_state *as) {
+
+    struct arm_decoded *di;
+
+    di = arm_dcache_lookup(as, as->regs[PC]);
+    di->handler(as, di);
+
+}
+
+/* Runs the function one instruction at a time until it returns to PC = 0 */
+unsigned int arm_state_execute_interp(struct arm_state *as) {
+
+    while (as->regs[PC] != 0) {
+        arm_state_execute_one(as);
+    }
+
+    return as->regs[0];
+}
+
+#ifdef __GNUC__
+
+/* Direct-threaded engine. Every handler ends by looking up the next decoded
+instruction and jumping straight to the label for its op, so there is no call
+through di->handler and no return to a central loop (the rarer ops, words
+that could not be decoded or fetched and the loads and stores, which have a
+handler per addressing mode, share do_call, which does call the handler).
+Each label has its own indirect jump, which the host branch predictor can
+learn separately. */
+unsigned int arm_state_execute_threaded(struct arm_state *as) {
+
+    static void * const dispatch[OP_COUNT] = {
+        [OP_UNKNOWN] = &&do_call,
+        [OP_ADD] = &&do_add,
+        [OP_SUB] = &&do_sub,
+        [OP_MOV] = &&do_mov,
+        [OP_MVN] = &&do_mvn,
+        [OP_CMP] = &&do_cmp,
+        [OP_LDR] = &&do_call,
+        [OP_STR] = &&do_call,
+        [OP_LDRB] = &&do_call,
+        [OP_STRB] = &&do_call,
+        [OP_LDRH] = &&do_call,
+        [OP_STRH] = &&do_call,
+        [OP_LDRSB] = &&do_call,
+        [OP_LDRSH] = &&do_call,
+        [OP_LDM] = &&do_ldm,
+        [OP_STM] = &&do_stm,
+        [OP_B] = &&do_b,
+        [OP_BL] = &&do_bl,
+        [OP_BX] = &&do_bx,
+        [OP_AND] = &&do_call,
+        [OP_EOR] = &&do_call,
+        [OP_RSB] = &&do_call,
+        [OP_ADC] = &&do_call,
+        [OP_SBC] = &&do_call,
+        [OP_RSC] = &&do_call,
+        [OP_TST] = &&do_call,
+        [OP_TEQ] = &&do_call,
+        [OP_CMN] = &&do_call,
+        [OP_ORR] = &&do_call,
+        [OP_BIC] = &&do_call,
+        [OP_MUL] = &&do_call,
+        [OP_MLA] = &&do_call,
+        [OP_UMULL] = &&do_call,
+        [OP_UMLAL] = &&do_call,
+        [OP_SMULL] = &&do_call,
+        [OP_SMLAL] = &&do_call,
+        [OP_SDIV] = &&do_call,
+        [OP_UDIV] = &&do_call,
+    };
+    struct arm_decoded *di;
+
+#define DISPATCH() \
+    if(as->regs[PC] == 0) { \
+        return as->regs[0]; \
+    } \
+    di = arm_dcache_lookup(as, as->regs[PC]); \
+    goto *dispatch[di->op]
+
+    DISPATCH();
+
+do_add:
+    execute_add_instruction(as, di);
+    DISPATCH();
+do_sub:
+    execute_sub_instruction(as, di);
+    DISPATCH();
+do_mov:
+    execute_mov_instruction(as, di);
+    DISPATCH();
+do_mvn:
+    execute_mvn_instruction(as, di);
+    DISPATCH();
+do_cmp:
+    execute_cmp_instruction(as, di);
+    DISPATCH();
+do_ldm:
+    execute_ldm_instruction(as, di);
+    DISPATCH();
+do_stm:
+    execute_stm_instruction(as, di);
+    DISPATCH();
+do_b:
+    arm_branch_b(as, di);
+    DISPATCH();
+do_bl:
+    arm_branch_bl(as, di);
+    DISPATCH();
+do_bx:
+    arm_branch_bx(as, di);
+    DISPATCH();
+do_call:
+    di->handler(as, di);
+    DISPATCH();
+
+#undef DISPATCH
+}
+
+#else
+
+/* Computed goto is a GCC extension, other compilers get the plain loop */
+unsigned int arm_state_execute_threaded(struct arm_state *as) {
+
+    return arm_state_execute_interp(as);
+
+}
+
+#endif
+
+/* True if di can change PC to something other than the next instruction.
+Unknown instructions also end a block because they do not advance PC */
+bool arm_decoded_ends_block(struct arm_decoded *di) {
+
+    if(di->op == OP_B || di->op == OP_BL || di->op == OP_BX || di->op == OP_UNKNOWN) {
+        return true;
+    }
+
+    if(di->op == OP_TST || di->op == OP_TEQ || di->op == OP_CMP || di->op == OP_CMN
+       || di->op == OP_STM) {
+        return false;
+    }
+
+    if(di->op == OP_LDM) {
+        return (di->imm >> PC) & 1;
+    }
+
+    if(arm_op_transfer(di->op)) {
+        return (arm_op_load(di->op) && di->rd == PC) || (di->writeback && di->rn == PC);
+    }
+
+    if(di->op >= OP_UMULL && di->op <= OP_SMLAL) {
+        return di->rd == PC || di->rn == PC;
+    }
+
+    return di->rd == PC;
+
+}
+
+/* Superinstructions. Some pairs come up all the time in the guest code:
+sub sp, sp, #n then str rX, [sp] pushes a register, add sp, sp, #n then
+ldr rX, [sp] pops one, and a loop ends with cmp and a conditional branch.
+arm_block_translate gives the first op of such a pair a handler that runs
+both (the second op is the next one in the block), and the block engine
+skips the second, so the pair costs one dispatch. The fused cmp and branch
+tests the condition on the operands of the compare without working out
+NZCV (the lazy flags are still recorded for whoever reads them next). The
+jit engine compiles the two ops one at a time. */
+
+const char * const arm_fusion_names[FUSE_COUNT] = {"none", "push", "pop", "cmp+b"};
+
+/* True if cond passes on the flags a - b sets */
+static inline bool arm_sub_cond(unsigned int cond, unsigned int a, unsigned int b) {
+
+    unsigned int result = a - b;
+
+    switch(cond) {
+    case 0x0: /* EQ */
+        return a == b;
+    case 0x1: /* NE */
+        return a != b;
+    case 0x2: /* CS */
+        return a >= b;
+    case 0x3: /* CC */
+        return a < b;
+    case 0x4: /* MI */
+        return (int) result < 0;
+    case 0x5: /* PL */
+        return (int) result >= 0;
+    case 0x6: /* VS */
+        return ((a ^ b) & (a ^ result)) >> 31;
+    case 0x7: /* VC */
+        return !(((a ^ b) & (a ^ result)) >> 31);
+    case 0x8: /* HI */
+        return a > b;
+    case 0x9: /* LS */
+        return a <= b;
+    case 0xA: /* GE */
+        return (int) a >= (int) b;
+    case 0xB: /* LT */
+        return (int) a < (int) b;
+    case 0xC: /* GT */
+        return (int) a > (int) b;
+    case 0xD: /* LE */
+        return (int) a <= (int) b;
+    case COND_AL:
+        return true;
+    default:
+        return false;
+    }
+
+}
+
+/* sub sp, sp, #n; str rX, [sp] */
+void execute_fused_push(struct arm_state *as, struct arm_decoded *di) {
+
+    as->num_instr += 2;
+    as->data_instr++;
+    as->mem_instr++;
+
+    as->regs[SP] -= di->imm;
+    as->regs[PC] += 4;
+
+    if(arm_mem_write(as, as->regs[SP], as->regs[di[1].rd])) {
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* add sp, sp, #n; ldr rX, [sp] */
+void execute_fused_pop(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int value;
+
+    as->num_instr += 2;
+    as->data_instr++;
+    as->mem_instr++;
+
+    as->regs[SP] += di->imm;
+    as->regs[PC] += 4;
+
+    if(arm_mem_read(as, as->regs[SP], &value)) {
+        as->regs[di[1].rd] = value;
+        as->regs[PC] += 4;
+    }
+
+}
+
+/* cmp rn, Src2; b<cond> label */
+void execute_fused_cmp_b(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int carry, a, b;
+
+    as->num_instr += 2;
+    as->data_instr++;
+    as->b_instr++;
+
+    a = arm_reg(as, di, di->rn);
+    b = arm_operand2(as, di, &carry);
+
+    as->flag_op = FLAGS_SUB;
+    as->flag_a = a;
+    as->flag_b = b;
+
+    as->regs[PC] += 4;
+    as->regs[PC] += arm_sub_cond(di[1].cond, a, b) ? di[1].imm : 4;
+
+}
+
+const arm_handler arm_fused_handlers[FUSE_COUNT] = {
+    NULL,
+    execute_fused_push,
+    execute_fused_pop,
+    execute_fused_cmp_b
+};
+
+/* The pair a and b (the instruction after a) make, or FUSE_NONE. Only
+unconditional first instructions are fused, so the pair always runs both */
+enum arm_fusion arm_fuse(struct arm_decoded *a, struct arm_decoded *b) {
+
+    if(a->cond != COND_AL) {
+        return FUSE_NONE;
+    }
+
+    if((a->op == OP_SUB || a->op == OP_ADD) && !a->setflags && a->form == OPND_IMM
+       && a->rd == SP && a->rn == SP && b->cond == COND_AL && b->rn == SP && b->rd != PC
+       && b->form == OPND_IMM && b->imm == 0 && b->index == INDEX_OFFSET) {
+
+        if(a->op == OP_SUB && b->op == OP_STR) {
+            return FUSE_PUSH;
+        }
+        if(a->op == OP_ADD && b->op == OP_LDR) {
+            return FUSE_POP;
+        }
+
+    }
+
+    if(a->op == OP_CMP && b->op == OP_B && b->cond != COND_AL) {
+        return FUSE_CMP_B;
+    }
+
+    return FUSE_NONE;
+
+}
+
+/* Loop idioms. A loop that only adds up or takes the largest (or smallest)
+of the words of an array, like the ones in sum_array_a and find_max_a, is
+found when its header block is translated (arm_idiom_find). Every time the
+header is about to run, arm_idiom_run works out how many trips are left
+from the index and count registers and does them all at once on the host
+memory of the array, a vector at a time, leaving the registers, flags and
+counters as if each trip had run. The header then runs as normal and
+leaves the loop. Only whole pages that can be read are done that way, so
+a trip that would fault is left to the normal code. The vectors are GCC
+vector extensions, so with -mavx2 they are AVX2 registers */
+
+#ifdef __GNUC__
+
+#define IDIOM_LANES 8
+
+typedef unsigned int idiom_u32 __attribute__((vector_size(IDIOM_LANES * sizeof(unsigned int))));
+typedef int idiom_s32 __attribute__((vector_size(IDIOM_LANES * sizeof(int))));
+
+/* acc plus the n words at p */
+static unsigned int arm_idiom_sum(const unsigned int *p, unsigned int n, unsigned int acc) {
+
+    idiom_u32 sum = {0}, v;
+    unsigned int i;
+
+    for(i = 0; i + IDIOM_LANES <= n; i += IDIOM_LANES) {
+        memcpy(&v, p + i, sizeof(v));
+        sum += v;
+    }
+
+    for(; i < n; i++) {
+        acc += p[i];
+    }
+
+    for(i = 0; i < IDIOM_LANES; i++) {
+        acc += sum[i];
+    }
+
+    return acc;
+
+}
+
+/* The largest of acc and the n words at p, compared as signed numbers after
+an xor with flip */
+static unsigned int arm_idiom_max(const unsigned int *p, unsigned int n, unsigned int acc,
+                                  unsigned int flip) {
+
+    idiom_s32 best = {0}, v, gt;
+    int m = acc ^ flip;
+    unsigned int i;
+
+    best += m;
+    for(i = 0; i + IDIOM_LANES <= n; i += IDIOM_LANES) {
+        memcpy(&v, p + i, sizeof(v));
+        v ^= (int) flip;
+        gt = v > best;
+        best = (v & gt) | (best & ~gt);
+    }
+
+    for(i = 0; i < IDIOM_LANES; i++) {
+        if(best[i] > m) {
+            m = best[i];
+        }
+    }
+
+    for(i = n - n % IDIOM_LANES; i < n; i++) {
+        if((int) (p[i] ^ flip) > m) {
+            m = p[i] ^ flip;
+        }
+    }
+
+    return m ^ flip;
+
+}
+
+#else
+
+static unsigned int arm_idiom_sum(const unsigned int *p, unsigned int n, unsigned int acc) {
+
+    unsigned int i;
+
+    for(i = 0; i < n; i++) {
+        acc += p[i];
+    }
+
+    return acc;
+
+}
+
+static unsigned int arm_idiom_max(const unsigned int *p, unsigned int n, unsigned int acc,
+                                  unsigned int flip) {
+
+    int m = acc ^ flip;
+    unsigned int i;
+
+    for(i = 0; i < n; i++) {
+        if((int) (p[i] ^ flip) > m) {
+            m = p[i] ^ flip;
+        }
+    }
+
+    return m ^ flip;
+
+}
+
+#endif
+
+/* Adds the counts of one run of di to id */
+static void arm_idiom_count(struct arm_idiom *id, struct arm_decoded *di) {
+
+    id->num_instr++;
+
+    if(di->op == OP_B) {
+        id->b_instr++;
+    } else if(di->op == OP_LDR) {
+        id->mem_instr++;
+    } else {
+        id->data_instr++;
+    }
+
+}
+
+/* True if di is an unconditional data instruction that leaves the flags alone */
+static inline bool arm_idiom_plain(struct arm_decoded *di) {
+
+    return di->cond == COND_AL && !di->setflags;
+
+}
+
+/* Fills in b->idiom if b is the header of a loop arm_idiom_run can do.
+The registers the loop uses must all be different, and none of them SP,
+LR or PC */
+void arm_idiom_find(struct arm_state *as, struct arm_block *b) {
+
+    struct arm_idiom id;
+    struct arm_decoded body[BLOCK_MAX_OPS], *di;
+    unsigned int pc, used, greater, is_signed, flip;
+    int i, n;
+
+    b->idiom.kind = IDIOM_NONE;
+
+    /* cmp index, count; beq out */
+    if(b->nops != 2 || b->ops[0].op != OP_CMP || b->ops[0].cond != COND_AL
+       || b->ops[0].form != OPND_REG || b->ops[1].op != OP_B || b->ops[1].cond != 0x0) {
+        return;
+    }
+
+    memset(&id, 0, sizeof(id));
+    id.index = b->ops[0].rn;
+    id.count = b->ops[0].rm;
+    arm_idiom_count(&id, &b->ops[0]);
+    arm_idiom_count(&id, &b->ops[1]);
+
+    /* The body must end with b header */
+    pc = b->end_pc;
+    n = 0;
+    do {
+        body[n++] = *arm_dcache_lookup(as, pc);
+        pc += 4;
+    } while(!arm_decoded_ends_block(&body[n - 1]) && n < BLOCK_MAX_OPS);
+
+    di = &body[n - 1];
+    if(di->op != OP_B || di->cond != COND_AL || di->pc + di->imm != b->pc) {
+        return;
+    }
+    arm_idiom_count(&id, di);
+    id.end_pc = pc;
+
+    /* ldr value, [ptr], #4 first, then add index, index, #1 and the fold
+    (add acc, acc, value or cmp and a conditional mov acc, value) in any order */
+    di = &body[0];
+    if(n < 4 || di->op != OP_LDR || di->cond != COND_AL || di->form != OPND_IMM
+       || di->index != INDEX_POST || di->imm != 4) {
+        return;
+    }
+    id.value = di->rd;
+    id.ptr = di->rn;
+    arm_idiom_count(&id, di);
+
+    for(i = 1; i < n - 1; i++) {
+
+        di = &body[i];
+        arm_idiom_count(&id, di);
+
+        if(di->op == OP_ADD && arm_idiom_plain(di) && di->form == OPND_IMM && di->imm == 1
+           && di->rd == id.index && di->rn == id.index) {
+            continue;
+        }
+
+        if(id.kind != IDIOM_NONE) {
+            return;
+        }
+
+        if(di->op == OP_ADD && arm_idiom_plain(di) && di->form == OPND_REG && di->rd == di->rn
+           && di->rm == id.value) {
+            id.kind = IDIOM_SUM;
+            id.acc = di->rd;
+            continue;
+        }
+
+        if(di->op == OP_ADD && arm_idiom_plain(di) && di->form == OPND_REG && di->rd == di->rm
+           && di->rn == id.value) {
+            id.kind = IDIOM_SUM;
+            id.acc = di->rd;
+            continue;
+        }
+
+        /* cmp value, acc (or acc, value); mov<cond> acc, value */
+        if(di->op != OP_CMP || di->cond != COND_AL || di->form != OPND_REG || i + 2 >= n
+           || di[1].op != OP_MOV || di[1].setflags || di[1].form != OPND_REG
+           || di[1].rm != id.value) {
+            return;
+        }
+
+        id.acc = di[1].rd;
+        if(di->rn == id.value && di->rm == id.acc) {
+            id.value_first = 1;
+        } else if(di->rn != id.acc || di->rm != id.value) {
+            return;
+        }
+
+        /* The mov is taken when the new value is greater (or less) than acc.
+        The conditions that are also taken when they are equal do the same */
+        switch(di[1].cond) {
+        case 0xA: /* GE */
+        case 0xC: /* GT */
+            is_signed = 1;
+            greater = 1;
+            break;
+        case 0xB: /* LT */
+        case 0xD: /* LE */
+            is_signed = 1;
+            greater = 0;
+            break;
+        case 0x2: /* CS */
+        case 0x8: /* HI */
+            is_signed = 0;
+            greater = 1;
+            break;
+        case 0x3: /* CC */
+        case 0x9: /* LS */
+            is_signed = 0;
+            greater = 0;
+            break;
+        default:
+            return;
+        }
+        if(!id.value_first) {
+            greater = !greater;
+        }
+
+        flip = (is_signed ? 0 : 0x80000000) ^ (greater ? 0 : 0xFFFFFFFF);
+        id.kind = IDIOM_MAX;
+        id.flip = flip;
+
+        i++;
+        arm_idiom_count(&id, &di[1]);
+
+    }
+
+    if(id.kind == IDIOM_NONE || n - 1 != (id.kind == IDIOM_SUM ? 3 : 4)) {
+        return;
+    }
+
+    used = 1 << id.index | 1 << id.count | 1 << id.ptr | 1 << id.value | 1 << id.acc;
+    if(__builtin_popcount(used) != 5 || (used & (1 << SP | 1 << LR | 1 << PC))) {
+        return;
+    }
+
+    b->idiom = id;
+
+}
+
+/* Runs every trip around the loop b is the header of that is left, as
+long as the words it loads are mapped and can be read. PC stays at
+the header. The flags are those of the last compare a trip made */
+void arm_idiom_run(struct arm_state *as, struct arm_block *b) {
+
+    struct arm_idiom *id = &b->idiom;
+    struct arm_page *page;
+    const unsigned int *p;
+    unsigned int *regs = as->regs;
+    unsigned int left, done, chunk, addr, acc, prev, last;
+
+    left = regs[id->count] - regs[id->index];
+    addr = regs[id->ptr];
+    if(left == 0 || (addr & 3) != 0) {
+        return;
+    }
+
+    acc = regs[id->acc];
+    prev = acc;
+    last = regs[id->value];
+    done = 0;
+
+    while(done < left) {
+
+        page = arm_mem_page(as->mem, addr);
+        if(page == NULL || page->host == NULL || !(arm_page_prot(page) & ARM_PROT_READ)
+           || (addr & ARM_PAGE_MASK) < page->lo || (addr & ARM_PAGE_MASK) + 4 > page->hi) {
+            break;
+        }
+
+        /* Only the bytes of the page the mapping covers */
+        chunk = (page->hi - (addr & ARM_PAGE_MASK)) / 4;
+        if(chunk > left - done) {
+            chunk = left - done;
+        }
+        p = (const unsigned int *) (page->host + (addr & ARM_PAGE_MASK));
+
+        /* The last word of each chunk is done on its own, so the acc the
+        last compare saw is known */
+        if(id->kind == IDIOM_SUM) {
+            acc = arm_idiom_sum(p, chunk, acc);
+        } else {
+            prev = arm_idiom_max(p, chunk - 1, acc, id->flip);
+            last = p[chunk - 1];
+            acc = arm_idiom_max(&last, 1, prev, id->flip);
+        }
+        last = p[chunk - 1];
+
+        done += chunk;
+        addr += chunk * 4;
+
+    }
+
+    if(done == 0) {
+        return;
+    }
+
+    regs[id->index] += done;
+    regs[id->ptr] = addr;
+    regs[id->value] = last;
+    regs[id->acc] = acc;
+
+    as->flag_op = FLAGS_SUB;
+    if(id->kind == IDIOM_SUM) {
+        as->flag_a = regs[id->index] - 1;
+        as->flag_b = regs[id->count];
+    } else if(id->value_first) {
+        as->flag_a = last;
+        as->flag_b = prev;
+    } else {
+        as->flag_a = prev;
+        as->flag_b = last;
+    }
+
+    as->num_instr += done * id->num_instr;
+    as->data_instr += done * id->data_instr;
+    as->b_instr += done * id->b_instr;
+    as->mem_instr += done * id->mem_instr;
+
+}
+
+/* Decodes the block starting at pc into the block cache */
+struct arm_block *arm_block_translate(struct arm_state *as, unsigned int pc) {
+
+    struct arm_bcache *bc = as->bcache;
+    struct arm_block *b;
+    struct arm_decoded *di;
+    unsigned int page, end_pc;
+    int i;
+
+    if(bc->nblocks == BLOCK_POOL_SIZE || bc->nops + BLOCK_MAX_OPS > BLOCK_OPS_SIZE) {
+        arm_bcache_flush(as);
+    }
+
+    b = &bc->blocks[bc->nblocks++];
+    b->pc = pc;
+    b->ops = &bc->ops[bc->nops];
+    b->nops = 0;
+
+    do {
+
+        di = arm_dcache_lookup(as, pc);
+        b->ops[b->nops++] = *di;
+        pc += 4;
+
+    } while(!arm_decoded_ends_block(di) && b->nops < BLOCK_MAX_OPS);
+
+    bc->nops += b->nops;
+    b->end_pc = pc;
+
+    for(i = 0; i + 1 < b->nops; i++) {
+        b->ops[i].fused = arm_fuse(&b->ops[i], &b->ops[i + 1]);
+        if(b->ops[i].fused != FUSE_NONE) {
+            b->ops[i].handler = arm_fused_handlers[b->ops[i].fused];
+            i++;
+        }
+    }
+
+    /* Branches know both of their successors already */
+    if(di->op == OP_B || di->op == OP_BL) {
+        b->succ_pc[0] = di->pc + di->imm;
+    } else {
+        b->succ_pc[0] = 0;
+    }
+    b->succ_pc[1] = b->end_pc;
+    b->succ[0] = NULL;
+    b->succ[1] = NULL;
+
+    /* A store into the body of a loop found here has to flush b as well */
+    end_pc = b->end_pc;
+    b->idiom.kind = IDIOM_NONE;
+    if(as->idioms) {
+        arm_idiom_find(as, b);
+        if(b->idiom.kind != IDIOM_NONE) {
+            end_pc = b->idiom.end_pc;
+        }
+    }
+
+    for(page = b->pc >> CODE_PAGE_SHIFT; page <= (end_pc - 1) >> CODE_PAGE_SHIFT; page++) {
+        bc->code_pages[page >> 3] |= 1 << (page & 7);
+    }
+
+    b->count = 0;
+    b->code = NULL;
+
+    bc->table[BCACHE_INDEX(b->pc)] = b;
+
+    return b;
+
+}
+
+/* Returns the translated block starting at pc, translating it on a miss */
+struct arm_block *arm_block_lookup(struct arm_state *as, unsigned int pc) {
+
+    struct arm_block *b;
+
+    b = as->bcache->table[BCACHE_INDEX(pc)];
+    if(b == NULL || b->pc != pc) {
+        b = arm_block_translate(as, pc);
+    }
+
+    return b;
+
+}
+
+#ifdef JIT_ENABLED
+
+/* x86-64 code generation for the jit engine. A compiled block is a function
+struct arm_block *code(struct arm_state *as) that keeps as in rbx and the
+guest registers, flags and counters in the arm_state struct. It returns the
+last block that ran, because an exit can jump straight into the next compiled
+block instead of returning. Instructions the code generator does not handle
+call their normal handler. */
+
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+/* Room that must be left in the buffer before an instruction is compiled */
+#define JIT_MAX_OP_BYTES 256
+
+#define JIT_REG(r) (offsetof(struct arm_state, regs) + 4 * (r))
+#define JIT_FIELD(f) offsetof(struct arm_state, f)
+
+struct jit_emit {
+
+    unsigned char *p;
+    struct arm_state *as;
+    struct arm_block *b;
+
+    /* True while the flags are known to come from a subtraction (CMP or SUBS)
+recorded in flag_a and flag_b, so conditions can be tested with an x86 cmp */
+    bool flags_sub;
+
+    /* Counts from instructions that always count, added once at each exit */
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+    /* Jumps to the epilogue, patched once the epilogue is emitted */
+    unsigned char *to_epilogue[BLOCK_MAX_OPS * 2 + 2];
+    int nto_epilogue;
+
+};
+
+void jit_emit8(struct jit_emit *e, unsigned int v) {
+
+    *e->p++ = v;
+
+}
+
+void jit_emit32(struct jit_emit *e, unsigned int v) {
+
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+
+}
+
+void jit_emit64(struct jit_emit *e, unsigned long long v) {
+
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+
+}
+
+/* op reg, [rbx + disp32] (or op [rbx + disp32], reg) */
+void jit_emit_mem(struct jit_emit *e, unsigned int opcode, unsigned int reg, unsigned int disp) {
+
+    jit_emit8(e, opcode);
+    jit_emit8(e, 0x80 | (reg << 3) | 3);
+    jit_emit32(e, disp);
+
+}
+
+/* op reg, [rbx + rcx + disp32] */
+void jit_emit_mem_index(struct jit_emit *e, unsigned int opcode, unsigned int reg, unsigned int disp) {
+
+    jit_emit8(e, opcode);
+    jit_emit8(e, 0x84 | (reg << 3));
+    jit_emit8(e, 0x0B);
+    jit_emit32(e, disp);
+
+}
+
+/* op dword [rbx + disp32], imm32 where ext selects the op (0 = add, 7 = cmp) */
+void jit_emit_mem_imm(struct jit_emit *e, unsigned int opcode, unsigned int ext,
+                      unsigned int disp, unsigned int imm) {
+
+    jit_emit_mem(e, opcode, ext, disp);
+    jit_emit32(e, imm);
+
+}
+
+/* Emits a jump with an empty rel32 (jmp if cc is 0, else the jcc opcode)
+and returns where the rel32 is so it can be patched */
+unsigned char *jit_emit_jump(struct jit_emit *e, unsigned int cc) {
+
+    if(cc == 0) {
+        jit_emit8(e, 0xE9);
+    } else {
+        jit_emit8(e, 0x0F);
+        jit_emit8(e, cc);
+    }
+
+    jit_emit32(e, 0);
+    return e->p - 4;
+
+}
+
+void jit_patch(unsigned char *rel32, unsigned char *target) {
+
+    int rel = target - (rel32 + 4);
+
+    memcpy(rel32, &rel, 4);
+
+}
+
+/* mov rdi, rbx; mov rax, imm64; call rax. The caller puts the second
+argument in rsi */
+void jit_emit_call(struct jit_emit *e, void *func) {
+
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0x89);
+    jit_emit8(e, 0xDF);
+
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0xB8);
+    jit_emit64(e, (unsigned long long) func);
+
+    jit_emit8(e, 0xFF);
+    jit_emit8(e, 0xD0);
+
+}
+
+void jit_emit_counts(struct jit_emit *e) {
+
+    if(e->num_instr > 0) {
+        jit_emit_mem_imm(e, 0x81, 0, JIT_FIELD(num_instr), e->num_instr);
+    }
+    if(e->data_instr > 0) {
+        jit_emit_mem_imm(e, 0x81, 0, JIT_FIELD(data_instr), e->data_instr);
+    }
+    if(e->b_instr > 0) {
+        jit_emit_mem_imm(e, 0x81, 0, JIT_FIELD(b_instr), e->b_instr);
+    }
+    if(e->mem_instr > 0) {
+        jit_emit_mem_imm(e, 0x81, 0, JIT_FIELD(mem_instr), e->mem_instr);
+    }
+
+}
+
+/* Leaves the block with PC already set, returning b to the block engine */
+void jit_emit_exit(struct jit_emit *e) {
+
+    jit_emit_counts(e);
+
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0xB8);
+    jit_emit64(e, (unsigned long long) e->b);
+
+    e->to_epilogue[e->nto_epilogue++] = jit_emit_jump(e, 0);
+
+}
+
+/* Leaves the block for a successor whose address is known. The jump can
+later be patched to go straight into the compiled successor */
+void jit_emit_static_exit(struct jit_emit *e, int slot, unsigned int pc) {
+
+    jit_emit_mem_imm(e, 0xC7, 0, JIT_REG(PC), pc);
+    jit_emit_exit(e);
+    e->b->exit_jmp[slot] = e->to_epilogue[e->nto_epilogue - 1];
+
+}
+
+/* x86 jcc opcodes that skip an instruction whose condition fails, when the
+flags come from cmp flag_a, flag_b. The x86 carry is the inverse of the ARM
+one after a subtraction, so CS skips on jb and HI skips on jbe */
+const unsigned char jit_skip_cc[16] = {
+    0x85, 0x84, 0x82, 0x83, 0x89, 0x88, 0x81, 0x80,
+    0x86, 0x87, 0x8C, 0x8D, 0x8E, 0x8F, 0x00, 0x00
+};
+
+/* Emits the same test as is_valid for cond. Returns the number of jumps
+that are taken when the instruction should be skipped */
+int jit_emit_cond(struct jit_emit *e, unsigned int cond, unsigned char **skip) {
+
+    if(cond == COND_AL) {
+        return 0;
+
+    } else if(cond == COND_NV) {
+        skip[0] = jit_emit_jump(e, 0);
+
+    } else if(e->flags_sub) {
+
+        /* mov eax, [flag_a]; cmp eax, [flag_b] */
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_FIELD(flag_a));
+        jit_emit_mem(e, 0x3B, JIT_EAX, JIT_FIELD(flag_b));
+        skip[0] = jit_emit_jump(e, jit_skip_cc[cond]);
+
+    } else {
+
+        /* mov esi, cond; call is_valid; test al, al */
+        jit_emit8(e, 0xBE);
+        jit_emit32(e, cond);
+        jit_emit_call(e, is_valid);
+        jit_emit8(e, 0x84);
+        jit_emit8(e, 0xC0);
+        skip[0] = jit_emit_jump(e, 0x84);
+
+    }
+
+    return 1;
+
+}
+
+/* Records a flag setting subtraction or addition of eax and ecx */
+void jit_emit_flags(struct jit_emit *e, unsigned int flag_op) {
+
+    jit_emit_mem(e, 0x89, JIT_EAX, JIT_FIELD(flag_a));
+    jit_emit_mem(e, 0x89, JIT_ECX, JIT_FIELD(flag_b));
+    jit_emit_mem_imm(e, 0xC7, 0, JIT_FIELD(flag_op), flag_op);
+
+}
+
+void jit_patch_cond(struct jit_emit *e, unsigned char **skip, int nskip) {
+
+    int i;
+
+    for(i = 0; i < nskip; i++) {
+        jit_patch(skip[i], e->p);
+    }
+
+}
+
+/* Second operand of a data instruction into reg */
+void jit_emit_op2(struct jit_emit *e, struct arm_decoded *di, unsigned int reg) {
+
+    if(di->form == OPND_IMM) {
+        jit_emit8(e, 0xB8 + reg);
+        jit_emit32(e, di->imm);
+    } else {
+        jit_emit_mem(e, 0x8B, reg, JIT_REG(di->rm));
+    }
+
+}
+
+/* Slow paths of the loads and stores compiled by the jit engine, for
+accesses that miss the TLB. They return nonzero if the compiled block must
+stop, after a fault or a store that flushed the block cache */
+int arm_jit_load(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int addr, wb, value;
+
+    addr = arm_transfer_addr(as, di, &wb);
+    if(!arm_mem_read_slow(as, addr, arm_op_size(di->op), &value)) {
+        return 1;
+    }
+
+    if(di->op == OP_LDRSB) {
+        value = (unsigned int) (signed char) value;
+    } else if(di->op == OP_LDRSH) {
+        value = (unsigned int) (short) value;
+    }
+    as->regs[di->rd] = value;
+
+    return 0;
+
+}
+
+int arm_jit_store(struct arm_state *as, struct arm_decoded *di) {
+
+    unsigned int flushes = as->bcache->flushes, addr, wb;
+
+    addr = arm_transfer_addr(as, di, &wb);
+    if(!arm_mem_write_slow(as, addr, arm_op_size(di->op), as->regs[di->rd])) {
+        return 1;
+    }
+
+    /* The block engine carries on after the store (and the writeback the
+    compiled code would have done) */
+    if(flushes != as->bcache->flushes) {
+        if(di->writeback) {
+            as->regs[di->rn] = wb;
+        }
+        as->regs[PC] = di->pc + 4;
+        return 1;
+    }
+
+    return 0;
+
+}
+
+/* Looks up the guest address in eax in the TLB at offset tlb of arm_state
+for an access of size bytes. On a hit rax ends up as the host address, on a
+miss the returned jump is taken (ecx and edx are used too) */
+unsigned char *jit_emit_tlb(struct jit_emit *e, unsigned int tlb, unsigned int size) {
+
+    unsigned char *miss;
+
+    /* mov ecx, eax; shr ecx, ARM_PAGE_SHIFT - 4; and ecx, (ARM_TLB_SIZE - 1) << 4
+    (the entries are 16 bytes, so ecx is the offset of the entry) */
+    jit_emit8(e, 0x89);
+    jit_emit8(e, 0xC1);
+    jit_emit8(e, 0xC1);
+    jit_emit8(e, 0xE9);
+    jit_emit8(e, ARM_PAGE_SHIFT - 4);
+    jit_emit8(e, 0x81);
+    jit_emit8(e, 0xE1);
+    jit_emit32(e, (ARM_TLB_SIZE - 1) << 4);
+
+    /* mov edx, eax; and edx, ARM_TLB_MASK_SIZE(size); cmp edx, [rbx + rcx + tag]; jne miss */
+    jit_emit8(e, 0x89);
+    jit_emit8(e, 0xC2);
+    jit_emit8(e, 0x81);
+    jit_emit8(e, 0xE2);
+    jit_emit32(e, ARM_TLB_MASK_SIZE(size));
+    jit_emit_mem_index(e, 0x3B, JIT_EDX, tlb + offsetof(struct arm_tlb_entry, tag));
+    miss = jit_emit_jump(e, 0x85);
+
+    /* add rax, [rbx + rcx + addend] */
+    jit_emit8(e, 0x48);
+    jit_emit_mem_index(e, 0x03, JIT_EAX, tlb + offsetof(struct arm_tlb_entry, addend));
+
+    return miss;
+
+}
+
+/* Calls the slow path func for the load or store di and leaves the block
+if it returns nonzero. Patches miss to jump here */
+void jit_emit_mem_slow(struct jit_emit *e, struct arm_decoded *di, unsigned char *miss, void *func) {
+
+    unsigned char *done, *carry_on;
+
+    done = jit_emit_jump(e, 0);
+    jit_patch(miss, e->p);
+
+    /* mov dword [PC], pc; mov rsi, di; call func; test eax, eax; jz carry_on */
+    jit_emit_mem_imm(e, 0xC7, 0, JIT_REG(PC), di->pc);
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0xBE);
+    jit_emit64(e, (unsigned long long) di);
+    jit_emit_call(e, func);
+    jit_emit8(e, 0x85);
+    jit_emit8(e, 0xC0);
+    carry_on = jit_emit_jump(e, 0x84);
+    jit_emit_exit(e);
+
+    jit_patch(done, e->p);
+    jit_patch(carry_on, e->p);
+
+}
+
+/* The load or store di (see jit_op_native). eax = Rn, plus the offset
+unless it is post-indexed, is looked up in the TLB. Pages with code are
+never in the TLB, so stores to them take the slow path. The writeback comes
+last, after either path */
+void jit_emit_transfer(struct jit_emit *e, struct arm_decoded *di) {
+
+    unsigned int size = arm_op_size(di->op);
+    unsigned char *miss;
+
+    jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rn));
+    if(di->index != INDEX_POST && di->form == OPND_IMM && di->imm != 0) {
+        /* add eax, imm32 */
+        jit_emit8(e, 0x05);
+        jit_emit32(e, di->imm);
+    } else if(di->index != INDEX_POST && di->form == OPND_REG) {
+        /* add eax, [rbx + rm] or sub eax, [rbx + rm] */
+        jit_emit_mem(e, di->imm == 0 ? 0x03 : 0x2B, JIT_EAX, JIT_REG(di->rm));
+    }
+
+    if(arm_op_load(di->op)) {
+
+        /* mov eax, [rax], movzx or movsx eax, byte or word [rax]; mov [rbx + rd], eax */
+        miss = jit_emit_tlb(e, JIT_FIELD(tlb_read), size);
+        if(size != 4) {
+            jit_emit8(e, 0x0F);
+            jit_emit8(e, (di->op == OP_LDRSB || di->op == OP_LDRSH ? 0xBE : 0xB6) | (size == 2));
+        } else {
+            jit_emit8(e, 0x8B);
+        }
+        jit_emit8(e, 0x00);
+        jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(di->rd));
+        jit_emit_mem_slow(e, di, miss, arm_jit_load);
+
+    } else {
+
+        /* mov edx, [rbx + rd]; mov [rax], edx (or dx, dl) */
+        miss = jit_emit_tlb(e, JIT_FIELD(tlb_write), size);
+        jit_emit_mem(e, 0x8B, JIT_EDX, JIT_REG(di->rd));
+        if(size == 2) {
+            jit_emit8(e, 0x66);
+        }
+        jit_emit8(e, size == 1 ? 0x88 : 0x89);
+        jit_emit8(e, 0x10);
+        jit_emit_mem_slow(e, di, miss, arm_jit_store);
+
+    }
+
+    if(di->writeback && di->form == OPND_IMM && di->imm != 0) {
+        /* add dword [rbx + rn], imm32 */
+        jit_emit_mem_imm(e, 0x81, 0, JIT_REG(di->rn), di->imm);
+    } else if(di->writeback && di->form == OPND_REG) {
+        /* mov eax, [rbx + rm]; add or sub [rbx + rn], eax */
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rm));
+        jit_emit_mem(e, di->imm == 0 ? 0x01 : 0x29, JIT_EAX, JIT_REG(di->rn));
+    }
+
+}
+
+/* True if Src2 of di is an immediate or a plain register other than PC */
+static inline bool jit_op2_native(struct arm_decoded *di) {
+
+    return di->form == OPND_IMM || (di->form == OPND_REG && di->rm != PC);
+
+}
+
+/* True if the code generator handles di itself. Anything that reads or
+writes PC as a normal register or uses a shifted Src2 is left to the handler */
+bool jit_op_native(struct arm_decoded *di) {
+
+    switch(di->op) {
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CMP:
+        return di->rd != PC && di->rn != PC && jit_op2_native(di);
+
+    case OP_MOV:
+    case OP_MVN:
+        return di->rd != PC && jit_op2_native(di) && !di->setflags;
+
+    case OP_MUL:
+    case OP_MLA:
+        return !di->setflags && di->rd != PC && di->rn != PC && di->rm != PC && di->rs != PC;
+
+    case OP_UMULL:
+    case OP_UMLAL:
+    case OP_SMULL:
+    case OP_SMLAL:
+        return !di->setflags && di->rd != PC && di->rn != PC && di->rm != PC && di->rs != PC
+            && di->rd != di->rn;
+
+    case OP_LDR:
+    case OP_STR:
+    case OP_LDRB:
+    case OP_STRB:
+    case OP_LDRH:
+    case OP_STRH:
+    case OP_LDRSB:
+    case OP_LDRSH:
+        /* A load with writeback must not overwrite the registers the
+        writeback reads afterwards */
+        if(arm_op_load(di->op) && di->writeback
+           && (di->rd == di->rn || (di->form == OPND_REG && di->rd == di->rm))) {
+            return false;
+        }
+        return di->rd != PC && di->rn != PC && jit_op2_native(di);
+
+    case OP_B:
+    case OP_BL:
+        return true;
+
+    case OP_BX:
+        return di->rm != PC;
+
+    default:
+        return false;
+
+    }
+
+}
+
+void jit_emit_op(struct jit_emit *e, struct arm_decoded *di) {
+
+    unsigned char *skip[1];
+    int nskip;
+
+    switch(di->op) {
+
+    case OP_ADD:
+    case OP_SUB:
+
+        e->num_instr++;
+        e->data_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rn));
+        jit_emit_op2(e, di, JIT_ECX);
+
+        if(di->setflags) {
+            jit_emit_flags(e, di->op == OP_ADD ? FLAGS_ADD : FLAGS_SUB);
+        }
+
+        /* add eax, ecx or sub eax, ecx */
+        jit_emit8(e, di->op == OP_ADD ? 0x01 : 0x29);
+        jit_emit8(e, 0xC8);
+        jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(di->rd));
+        jit_patch_cond(e, skip, nskip);
+
+        /* A conditional SUBS leaves either its own or the old subtraction */
+        if(di->setflags && di->op == OP_ADD) {
+            e->flags_sub = false;
+        } else if(di->setflags) {
+            e->flags_sub = e->flags_sub || di->cond == COND_AL;
+        }
+        break;
+
+    case OP_MOV:
+    case OP_MVN:
+
+        e->num_instr++;
+        e->data_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_op2(e, di, JIT_EAX);
+
+        /* not eax */
+        if(di->op == OP_MVN) {
+            jit_emit8(e, 0xF7);
+            jit_emit8(e, 0xD0);
+        }
+
+        jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(di->rd));
+        jit_patch_cond(e, skip, nskip);
+        break;
+
+    case OP_CMP:
+
+        e->num_instr++;
+        e->data_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rn));
+        jit_emit_op2(e, di, JIT_ECX);
+        jit_emit_flags(e, FLAGS_SUB);
+        jit_patch_cond(e, skip, nskip);
+
+        e->flags_sub = e->flags_sub || di->cond == COND_AL;
+        break;
+
+    case OP_MUL:
+    case OP_MLA:
+
+        e->num_instr++;
+        e->data_instr++;
+
+        /* mov eax, [rbx + rm]; imul eax, [rbx + rs]; (add eax, [rbx + rn]); mov [rbx + rd], eax */
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rm));
+        jit_emit8(e, 0x0F);
+        jit_emit_mem(e, 0xAF, JIT_EAX, JIT_REG(di->rs));
+        if(di->op == OP_MLA) {
+            jit_emit_mem(e, 0x03, JIT_EAX, JIT_REG(di->rn));
+        }
+        jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(di->rd));
+        jit_patch_cond(e, skip, nskip);
+        break;
+
+    case OP_UMULL:
+    case OP_UMLAL:
+    case OP_SMULL:
+    case OP_SMLAL:
+
+        e->num_instr++;
+        e->data_instr++;
+
+        /* mov eax, [rbx + rm]; mul or imul dword [rbx + rs] (edx:eax is the
+        product); mov, or add and adc, [rbx + RdLo], eax and [rbx + RdHi], edx */
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rm));
+        jit_emit_mem(e, 0xF7, di->op >= OP_SMULL ? 5 : 4, JIT_REG(di->rs));
+        if(di->op == OP_UMLAL || di->op == OP_SMLAL) {
+            jit_emit_mem(e, 0x01, JIT_EAX, JIT_REG(di->rn));
+            jit_emit_mem(e, 0x11, JIT_EDX, JIT_REG(di->rd));
+        } else {
+            jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(di->rn));
+            jit_emit_mem(e, 0x89, JIT_EDX, JIT_REG(di->rd));
+        }
+        jit_patch_cond(e, skip, nskip);
+        break;
+
+    case OP_LDR:
+    case OP_STR:
+    case OP_LDRB:
+    case OP_STRB:
+    case OP_LDRH:
+    case OP_STRH:
+    case OP_LDRSB:
+    case OP_LDRSH:
+
+        e->num_instr++;
+        e->mem_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_transfer(e, di);
+        jit_patch_cond(e, skip, nskip);
+        break;
+
+    case OP_B:
+    case OP_BL:
+
+        e->num_instr++;
+        e->b_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        if(di->op == OP_BL) {
+            jit_emit_mem_imm(e, 0xC7, 0, JIT_REG(LR), di->pc + 4);
+        }
+        jit_emit_static_exit(e, 0, di->pc + di->imm);
+
+        if(nskip > 0) {
+            jit_patch_cond(e, skip, nskip);
+            jit_emit_static_exit(e, 1, di->pc + 4);
+        }
+        break;
+
+    case OP_BX:
+
+        e->num_instr++;
+        e->b_instr++;
+
+        nskip = jit_emit_cond(e, di->cond, skip);
+        jit_emit_mem(e, 0x8B, JIT_EAX, JIT_REG(di->rm));
+        jit_emit_mem(e, 0x89, JIT_EAX, JIT_REG(PC));
+        jit_emit_exit(e);
+
+        if(nskip > 0) {
+            jit_patch_cond(e, skip, nskip);
+            jit_emit_static_exit(e, 1, di->pc + 4);
+        }
+        break;
+
+    }
+
+}
+
+/* Compiles b into the jit buffer. Returns false if the buffer is full */
+bool arm_jit_compile(struct arm_state *as, struct arm_block *b) {
+
+    struct arm_bcache *bc = as->bcache;
+    struct jit_emit e;
+    struct arm_decoded *di;
+    unsigned char *start, *carry_on;
+    int i;
+
+    if(bc->jit_buf == NULL) {
+        return true;
+    }
+
+    if(bc->jit_used + (b->nops + 2) * JIT_MAX_OP_BYTES > JIT_BUF_SIZE) {
+        return false;
+    }
+
+    memset(&e, 0, sizeof(e));
+    start = bc->jit_buf + bc->jit_used;
+    e.p = start;
+    e.as = as;
+    e.b = b;
+
+    b->exit_jmp[0] = NULL;
+    b->exit_jmp[1] = NULL;
+
+    /* push rbx; mov rbx, rdi */
+    jit_emit8(&e, 0x53);
+    jit_emit8(&e, 0x48);
+    jit_emit8(&e, 0x89);
+    jit_emit8(&e, 0xFB);
+    b->body = e.p;
+
+    /* mov rsi, b; call arm_idiom_run */
+    if(b->idiom.kind != IDIOM_NONE) {
+        jit_emit8(&e, 0x48);
+        jit_emit8(&e, 0xBE);
+        jit_emit64(&e, (unsigned long long) b);
+        jit_emit_call(&e, arm_idiom_run);
+    }
+
+    for(i = 0; i < b->nops; i++) {
+
+        di = &b->ops[i];
+
+        if(jit_op_native(di)) {
+            jit_emit_op(&e, di);
+            continue;
+        }
+
+        /* mov dword [PC], pc; mov rsi, di; call handler (of di alone
+        if di starts a fused pair) */
+        jit_emit_mem_imm(&e, 0xC7, 0, JIT_REG(PC), di->pc);
+        jit_emit8(&e, 0x48);
+        jit_emit8(&e, 0xBE);
+        jit_emit64(&e, (unsigned long long) di);
+        jit_emit_call(&e, di->fused != FUSE_NONE ? arm_handlers[di->op] : di->handler);
+        e.flags_sub = false;
+
+        if(arm_decoded_ends_block(di)) {
+            jit_emit_exit(&e);
+            continue;
+        }
+
+        /* Leave if the handler stopped the guest with a fault
+        (cmp dword [rbx + fault], 0; je carry_on) */
+        jit_emit_mem_imm(&e, 0x81, 7, JIT_FIELD(fault), 0);
+        carry_on = jit_emit_jump(&e, 0x84);
+        jit_emit_exit(&e);
+        jit_patch(carry_on, e.p);
+
+    }
+
+    if(!arm_decoded_ends_block(&b->ops[b->nops - 1])) {
+        jit_emit_static_exit(&e, 1, b->end_pc);
+    }
+
+    /* pop rbx; ret */
+    b->epilogue = e.p;
+    jit_emit8(&e, 0x5B);
+    jit_emit8(&e, 0xC3);
+
+    for(i = 0; i < e.nto_epilogue; i++) {
+        jit_patch(e.to_epilogue[i], b->epilogue);
+    }
+
+    bc->jit_used = ((e.p - bc->jit_buf) + 15) & ~15;
+    b->code = (struct arm_block *(*)(struct arm_state *)) start;
+
+    return true;
+
+}
+
+/* Makes the compiled exit of b for succ_pc[slot] jump straight into next */
+void arm_jit_chain(struct arm_block *b, int slot, struct arm_block *next) {
+
+    if(b->code != NULL && next->code != NULL && b->exit_jmp[slot] != NULL) {
+        jit_patch(b->exit_jmp[slot], next->body);
+    }
+
+}
+
+#endif
+
+/* Makes the block cache (and the jit buffer) of as the first time it needs
+them. Returns false if there is not enough memory for the block cache */
+bool arm_block_setup(struct arm_state *as) {
+
+    if(as->bcache == NULL) {
+
+        as->bcache = (struct arm_bcache *) calloc(1, sizeof(struct arm_bcache));
+        if(as->bcache == NULL) {
+            return false;
+        }
+
+    }
+
+#ifdef JIT_ENABLED
+    if(as->engine == ENGINE_JIT && as->bcache->jit_buf == NULL) {
+
+        as->bcache->jit_buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        /* Without an executable buffer the jit engine is the block engine */
+        if(as->bcache->jit_buf == MAP_FAILED) {
+            as->bcache->jit_buf = NULL;
+        }
+
+    }
+#endif
+
+    return true;
+
+}
+
+/* The loop of the block engine. budgeted is a constant in each caller, so
+arm_state_execute_block has none of the budget code. With a budget the
+loop stops before a block with more ops than *left and takes the ops it
+runs off *left, and compiled code and reduction loops that do not fit in
+what is left are not used (arm_state_run) */
+static inline __attribute__((always_inline))
+void arm_block_loop(struct arm_state *as, bool budgeted, long long *left) {
+
+    struct arm_block *b, *next;
+    struct arm_decoded *di;
+    unsigned int pc, flushes;
+    int i, slot, before;
+
+    if(as->regs[PC] == 0) {
+        return;
+    }
+
+    b = arm_block_lookup(as, as->regs[PC]);
+
+    while(1) {
+
+        if(budgeted && b->nops > *left) {
+            break;
+        }
+
+        flushes = as->bcache->flushes;
+
+#ifdef JIT_ENABLED
+        if(b->code != NULL && !budgeted) {
+
+            b = b->code(as);
+
+        } else {
+#endif
+
+            if(b->idiom.kind != IDIOM_NONE) {
+                if(!budgeted) {
+                    arm_idiom_run(as, b);
+                } else if((unsigned long long) (as->regs[b->idiom.count] - as->regs[b->idiom.index])
+                          * b->idiom.num_instr + b->nops <= (unsigned long long) *left) {
+                    before = as->num_instr;
+                    arm_idiom_run(as, b);
+                    *left -= as->num_instr - before;
+                }
+            }
+
+            /* b->nops is read every time around because a store into
+            translated code sets it to 0. A fused op runs the next op too */
+            for(i = 0; i < b->nops; i += di->fused != FUSE_NONE ? 2 : 1) {
+                di = &b->ops[i];
+                di->handler(as, di);
+            }
+
+            if(budgeted) {
+                *left -= i;
+
+                /* An undecoded word ends its block without moving PC, so
+                leave it to arm_state_run rather than run it again */
+                if(i > 0 && di->op == OP_UNKNOWN) {
+                    break;
+                }
+            }
+
+#ifdef JIT_ENABLED
+            /* If the jit buffer is full, start again with an empty cache */
+            if(!budgeted && as->engine == ENGINE_JIT && ++b->count == as->jit_threshold
+               && !arm_jit_compile(as, b)) {
+                arm_bcache_flush(as);
+            }
+
+        }
+#endif
+
+        pc = as->regs[PC];
+
+        /* The block cache was flushed while b ran, so b cannot be linked */
+        if(flushes != as->bcache->flushes) {
+
+            if(pc == 0) {
+                break;
+            }
+
+            b = arm_block_lookup(as, pc);
+            continue;
+
+        }
+
+        if(pc == b->succ_pc[0] && b->succ[0] != NULL) {
+            slot = 0;
+
+        } else if(pc == b->succ_pc[1] && b->succ[1] != NULL) {
+            slot = 1;
+
+        } else {
+
+            if(pc == 0) {
+                break;
+            }
+
+            flushes = as->bcache->flushes;
+            next = arm_block_lookup(as, pc);
+
+            /* After a flush b may already have been reused, so leave it alone */
+            if(flushes != as->bcache->flushes) {
+                b = next;
+                continue;
+            }
+
+            if(pc == b->succ_pc[0] || b->succ_pc[0] == 0) {
+                slot = 0;
+            } else {
+                slot = 1;
+            }
+
+            b->succ_pc[slot] = pc;
+            b->succ[slot] = next;
+
+        }
+
+#ifdef JIT_ENABLED
+        arm_jit_chain(b, slot, b->succ[slot]);
+#endif
+
+        b = b->succ[slot];
+
+    }
+
+}
+
+/* Block engine. Runs a whole block without checking PC between instructions,
+then follows the link to the next block. Links are only looked up (and then
+filled in) the first time a block exits to a given address. With the jit engine
+a block that has run as->jit_threshold times is compiled and from then on the
+compiled code runs instead */
+unsigned int arm_state_execute_block(struct arm_state *as) {
+
+    /* Without memory for the block cache run on the interpreter */
+    if(!arm_block_setup(as)) {
+        return arm_state_execute_interp(as);
+    }
+
+    arm_block_loop(as, false, NULL);
+
+    return as->regs[0];
+}
+#ifdef ARM_PROFILE
+
+/* Execution profiler, built in with -DARM_PROFILE (make armemu_prof) and
+turned on with -p. Without ARM_PROFILE none of this is compiled and the
+engines are untouched. Profiled states run through arm_prof_execute, which
+is the interp loop with bookkeeping around each instruction: a count for
+each PC, for each basic block start and for each way a branch went, and a
+call tree built from BL and BX LR, which gives both the call graph edges and
+the stacks for a flamegraph. */
+
+struct arm_prof_pc {
+
+    unsigned int pc;
+    unsigned int iw;
+    long long count;
+    long long block_count;
+    long long taken;
+    long long not_taken;
+
+};
+
+/* A function in the call tree. Node 0 is the root, which is the host */
+struct arm_prof_node {
+
+    unsigned int func;
+    int parent;
+    int first_child;
+    int next_sibling;
+    long long calls;
+    long long self;
+
+};
+
+struct arm_prof {
+
+    /* Open addressing hash table of the PCs run, pcs_size is a power of 2 */
+    struct arm_prof_pc *pcs;
+    unsigned int pcs_size;
+    unsigned int npcs;
+
+    struct arm_prof_node *nodes;
+    int nnodes;
+    int nodes_size;
+    int current;
+
+    /* Instructions that could not be recorded because memory ran out, and
+    calls left out of the call tree for the same reason */
+    long long lost;
+    int lost_calls;
+
+    /* Pairs that ran which the block engine runs as one op (see arm_fuse) */
+    long long fused[FUSE_COUNT];
+
+};
+
+#define PROF_HASH(pc) (((pc) >> 2) * 2654435761u)
+
+/* Makes an empty profile. Returns NULL if there is not enough memory */
+struct arm_prof *arm_prof_new(void) {
+
+    struct arm_prof *prof;
+
+    prof = (struct arm_prof *) calloc(1, sizeof(struct arm_prof));
+    if(prof == NULL) {
+        return NULL;
+    }
+
+    prof->pcs_size = 1024;
+    prof->pcs = (struct arm_prof_pc *) calloc(prof->pcs_size, sizeof(struct arm_prof_pc));
+    prof->nodes_size = 64;
+    prof->nodes = (struct arm_prof_node *) calloc(prof->nodes_size, sizeof(struct arm_prof_node));
+
+    if(prof->pcs == NULL || prof->nodes == NULL) {
+        free(prof->pcs);
+        free(prof->nodes);
+        free(prof);
+        return NULL;
+    }
+
+    prof->nodes[0].parent = -1;
+    prof->nodes[0].first_child = -1;
+    prof->nodes[0].next_sibling = -1;
+    prof->nnodes = 1;
+
+    return prof;
+
+}
+
+void arm_prof_free(struct arm_prof *prof) {
+
+    free(prof->pcs);
+    free(prof->nodes);
+    free(prof);
+
+}
+
+/* The slot of the table that holds pc, or the free one where it would go.
+PC 0 never runs, so it marks a free slot */
+struct arm_prof_pc *arm_prof_slot(struct arm_prof *prof, unsigned int pc) {
+
+    unsigned int i;
+
+    i = PROF_HASH(pc) & (prof->pcs_size - 1);
+    while(prof->pcs[i].pc != pc && prof->pcs[i].pc != 0) {
+        i = (i + 1) & (prof->pcs_size - 1);
+    }
+
+    return &prof->pcs[i];
+
+}
+
+/* The entry for pc, added if it is new. Returns NULL if the table needed to
+grow and there is not enough memory */
+struct arm_prof_pc *arm_prof_pc(struct arm_prof *prof, unsigned int pc) {
+
+    struct arm_prof_pc *grown, *p;
+    unsigned int i, k;
+
+    p = arm_prof_slot(prof, pc);
+    if(p->pc == pc) {
+        return p;
+    }
+
+    /* Kept at most half full */
+    if(2 * (prof->npcs + 1) > prof->pcs_size) {
+
+        grown = (struct arm_prof_pc *) calloc(2 * prof->pcs_size, sizeof(struct arm_prof_pc));
+        if(grown == NULL) {
+            return NULL;
+        }
+
+        for(k = 0; k < prof->pcs_size; k++) {
+            if(prof->pcs[k].pc != 0) {
+                i = PROF_HASH(prof->pcs[k].pc) & (2 * prof->pcs_size - 1);
+                while(grown[i].pc != 0) {
+                    i = (i + 1) & (2 * prof->pcs_size - 1);
+                }
+                grown[i] = prof->pcs[k];
+            }
+        }
+
+        free(prof->pcs);
+        prof->pcs = grown;
+        prof->pcs_size *= 2;
+
+        return arm_prof_pc(prof, pc);
+
+    }
+
+    p->pc = pc;
+    prof->npcs++;
+
+    return p;
+
+}
+
+/* Moves down the call tree into func. Returns false if there is not enough
+memory for a new node */
+bool arm_prof_call(struct arm_prof *prof, unsigned int func) {
+
+    struct arm_prof_node *grown, *node;
+    int n;
+
+    for(n = prof->nodes[prof->current].first_child; n >= 0; n = prof->nodes[n].next_sibling) {
+        if(prof->nodes[n].func == func) {
+            break;
+        }
+    }
+
+    if(n < 0) {
+
+        if(prof->nnodes == prof->nodes_size) {
+            grown = (struct arm_prof_node *) realloc(prof->nodes,
+                                                     2 * prof->nodes_size * sizeof(struct arm_prof_node));
+            if(grown == NULL) {
+                return false;
+            }
+            prof->nodes = grown;
+            prof->nodes_size *= 2;
+        }
+
+        n = prof->nnodes++;
+        node = &prof->nodes[n];
+        memset(node, 0, sizeof(struct arm_prof_node));
+        node->func = func;
+        node->parent = prof->current;
+        node->first_child = -1;
+        node->next_sibling = prof->nodes[prof->current].first_child;
+        prof->nodes[prof->current].first_child = n;
+
+    }
+
+    prof->nodes[n].calls++;
+    prof->current = n;
+
+    return true;
+
+}
+
+/* Runs as like the interp engine, recording every instruction in as->prof */
+unsigned int arm_prof_execute(struct arm_state *as) {
+
+    struct arm_prof *prof = as->prof;
+    struct arm_decoded *di, *pair = NULL;
+    struct arm_prof_pc *p;
+    unsigned int pc;
+    bool block_start = true, taken;
+    enum arm_fusion fused;
+
+    prof->current = 0;
+    prof->lost_calls = 0;
+    if(!arm_prof_call(prof, as->regs[PC])) {
+        prof->lost_calls++;
+    }
+
+    while(as->regs[PC] != 0) {
+
+        pc = as->regs[PC];
+        di = arm_dcache_lookup(as, pc);
+        di->handler(as, di);
+
+        taken = as->regs[PC] != pc + 4;
+        prof->nodes[prof->current].self++;
+
+        p = arm_prof_pc(prof, pc);
+        if(p == NULL) {
+            prof->lost++;
+        } else {
+
+            p->iw = di->iw;
+            p->count++;
+            if(block_start) {
+                p->block_count++;
+            }
+
+            if(di->op == OP_B || di->op == OP_BL || di->op == OP_BX) {
+                if(taken) {
+                    p->taken++;
+                } else {
+                    p->not_taken++;
+                }
+            }
+
+        }
+
+        /* pair is the instruction before di in its block, unless that one
+        was already fused with the one before it */
+        if(block_start || pair == NULL) {
+            pair = di;
+        } else if((fused = arm_fuse(pair, di)) != FUSE_NONE) {
+            prof->fused[fused]++;
+            pair = NULL;
+        } else {
+            pair = di;
+        }
+
+        if(di->op == OP_BL && taken) {
+            if(prof->lost_calls > 0 || !arm_prof_call(prof, as->regs[PC])) {
+                prof->lost_calls++;
+            }
+        } else if(di->op == OP_BX && di->rm == LR && taken) {
+            if(prof->lost_calls > 0) {
+                prof->lost_calls--;
+            } else if(prof->current > 0) {
+                prof->current = prof->nodes[prof->current].parent;
+            }
+        }
+
+        /* The same blocks as the block engine makes, as long as they are
+        shorter than BLOCK_MAX_OPS */
+        block_start = taken || arm_decoded_ends_block(di);
+
+    }
+
+    return as->regs[0];
+
+}
+
+/* Writes addr as symbol+offset (or just the address if img has no symbol
+for it) */
+void arm_prof_print_addr(FILE *f, struct arm_image *img, unsigned int addr) {
+
+    const char *name;
+    unsigned int offset;
+
+    name = arm_image_symbol_name(img, addr, &offset);
+    if(name == NULL) {
+        fprintf(f, "0x%08x", addr);
+    } else if(offset == 0) {
+        fprintf(f, "%s", name);
+    } else {
+        fprintf(f, "%s+0x%x", name, offset);
+    }
+
+}
+
+/* The key each sort of the report orders by, biggest first */
+enum arm_prof_key {
+    PROF_BY_COUNT,
+    PROF_BY_BLOCK,
+    PROF_BY_BRANCH
+};
+
+long long arm_prof_key(struct arm_prof_pc *p, enum arm_prof_key key) {
+
+    switch(key) {
+    case PROF_BY_BLOCK:
+        return p->block_count;
+    case PROF_BY_BRANCH:
+        return p->taken + p->not_taken;
+    default:
+        return p->count;
+    }
+
+}
+
+static enum arm_prof_key arm_prof_sort_key;
+
+int arm_prof_compare(const void *a, const void *b) {
+
+    long long ka = arm_prof_key((struct arm_prof_pc *) a, arm_prof_sort_key);
+    long long kb = arm_prof_key((struct arm_prof_pc *) b, arm_prof_sort_key);
+
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+
+}
+
+/* Writes the folded stacks below node (one line per stack, ex.
+"fib_rec_a;fib_rec_a 120"), which flamegraph.pl turns into a flamegraph */
+void arm_prof_fold(FILE *f, struct arm_prof *prof, struct arm_image *img, int node) {
+
+    int stack[256], depth = 0, n, i;
+
+    if(prof->nodes[node].self > 0) {
+
+        for(n = node; n > 0 && depth < 256; n = prof->nodes[n].parent) {
+            stack[depth++] = n;
+        }
+
+        for(i = depth - 1; i >= 0; i--) {
+            arm_prof_print_addr(f, img, prof->nodes[stack[i]].func);
+            fprintf(f, i > 0 ? ";" : " ");
+        }
+        fprintf(f, "%lld\n", prof->nodes[node].self);
+
+    }
+
+    for(n = prof->nodes[node].first_child; n >= 0; n = prof->nodes[n].next_sibling) {
+        arm_prof_fold(f, prof, img, n);
+    }
+
+}
+
+/* Number of lines in each part of the report */
+#define PROF_TOP 20
+
+/* Writes the hot spot report (the hottest instructions, blocks and branches
+and every call graph edge) to f */
+void arm_prof_report(FILE *f, struct arm_prof *prof, struct arm_image *img) {
+
+    struct arm_prof_pc *sorted, *p;
+    struct arm_decoded di;
+    long long total = 0;
+    unsigned int i, k, n, len;
+    int a, b;
+
+    /* The table with the empty slots squeezed out */
+    sorted = (struct arm_prof_pc *) malloc((prof->npcs + 1) * sizeof(struct arm_prof_pc));
+    if(sorted == NULL) {
+        fprintf(f, "not enough memory for the report\n");
+        return;
+    }
+
+    for(i = 0, n = 0; i < prof->pcs_size; i++) {
+        if(prof->pcs[i].pc != 0) {
+            sorted[n++] = prof->pcs[i];
+            total += prof->pcs[i].count;
+        }
+    }
+
+    fprintf(f, "%lld instructions at %u addresses", total, n);
+    if(prof->lost > 0) {
+        fprintf(f, " (%lld more not recorded, out of memory)", prof->lost);
+    }
+    fprintf(f, "\n\nFused pairs (one dispatch instead of two on the block engine)\n%12s %6s  %s\n",
+            "count", "%", "pair");
+    for(i = FUSE_NONE + 1; i < FUSE_COUNT; i++) {
+        fprintf(f, "%12lld %6.2f  %s\n", prof->fused[i], total == 0 ? 0.0 : 200.0 * prof->fused[i] / total,
+                arm_fusion_names[i]);
+    }
+
+    fprintf(f, "\nHot instructions\n%12s %6s  %-10s %s\n", "count", "%", "word", "address");
+
+    arm_prof_sort_key = PROF_BY_COUNT;
+    qsort(sorted, n, sizeof(struct arm_prof_pc), arm_prof_compare);
+    for(i = 0; i < n && i < PROF_TOP; i++) {
+        fprintf(f, "%12lld %6.2f  0x%08x ", sorted[i].count, 100.0 * sorted[i].count / total, sorted[i].iw);
+        arm_prof_print_addr(f, img, sorted[i].pc);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nHot blocks\n%12s %6s  %s\n", "entries", "length", "address");
+
+    arm_prof_sort_key = PROF_BY_BLOCK;
+    qsort(sorted, n, sizeof(struct arm_prof_pc), arm_prof_compare);
+    for(i = 0; i < n && i < PROF_TOP && sorted[i].block_count > 0; i++) {
+
+        /* The block runs on to the first instruction that ends one */
+        len = 0;
+        for(k = sorted[i].pc; (p = arm_prof_slot(prof, k))->pc == k; k += 4) {
+            len++;
+            arm_decode(&di, k, p->iw);
+            if(arm_decoded_ends_block(&di) || len == BLOCK_MAX_OPS) {
+                break;
+            }
+        }
+
+        fprintf(f, "%12lld %6u  ", sorted[i].block_count, len);
+        arm_prof_print_addr(f, img, sorted[i].pc);
+        fprintf(f, "\n");
+
+    }
+
+    fprintf(f, "\nBranches\n%12s %12s  %s\n", "taken", "not taken", "address");
+
+    arm_prof_sort_key = PROF_BY_BRANCH;
+    qsort(sorted, n, sizeof(struct arm_prof_pc), arm_prof_compare);
+    for(i = 0; i < n && i < PROF_TOP && arm_prof_key(&sorted[i], PROF_BY_BRANCH) > 0; i++) {
+        fprintf(f, "%12lld %12lld  ", sorted[i].taken, sorted[i].not_taken);
+        arm_prof_print_addr(f, img, sorted[i].pc);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nCalls\n%12s  %s\n", "count", "caller -> callee");
+
+    /* Every edge of the call tree, with the same pairs in different
+    places of the tree added together */
+    for(a = 1; a < prof->nnodes; a++) {
+
+        for(b = 1; b < a; b++) {
+            if(prof->nodes[b].func == prof->nodes[a].func
+               && prof->nodes[prof->nodes[b].parent].func == prof->nodes[prof->nodes[a].parent].func) {
+                break;
+            }
+        }
+
+        /* Printed with the first node of the pair */
+        if(b < a) {
+            continue;
+        }
+
+        total = 0;
+        for(b = a; b < prof->nnodes; b++) {
+            if(prof->nodes[b].func == prof->nodes[a].func
+               && prof->nodes[prof->nodes[b].parent].func == prof->nodes[prof->nodes[a].parent].func) {
+                total += prof->nodes[b].calls;
+            }
+        }
+
+        fprintf(f, "%12lld  ", total);
+        if(prof->nodes[a].parent == 0) {
+            fprintf(f, "host");
+        } else {
+            arm_prof_print_addr(f, img, prof->nodes[prof->nodes[a].parent].func);
+        }
+        fprintf(f, " -> ");
+        arm_prof_print_addr(f, img, prof->nodes[a].func);
+        fprintf(f, "\n");
+
+    }
+
+    free(sorted);
+
+}
+
+/* Writes the report to name.txt and the folded stacks to name.folded.
+Returns -1 if a file cannot be written */
+int arm_prof_write(struct arm_prof *prof, struct arm_image *img, const char *name) {
+
+    char path[1024];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.txt", name);
+    f = fopen(path, "w");
+    if(f == NULL) {
+        return -1;
+    }
+    arm_prof_report(f, prof, img);
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s.folded", name);
+    f = fopen(path, "w");
+    if(f == NULL) {
+        return -1;
+    }
+    arm_prof_fold(f, prof, img, 0);
+    fclose(f);
+
+    return 0;
+
+}
+
+#endif
+
+/* Timing model, turned on with -m. It estimates how many cycles the code
+would take on an ARM1176 (the core of the first Raspberry Pi): one issue
+per cycle, an extra cycle for a shift by a register, loads whose result is
+ready TIMING_LOAD_LATENCY cycles after they issue, multiplies that issue in
+more than one cycle and whose result comes TIMING_MUL_LATENCY cycles after
+that (the ARM1176 has no divide, SDIV and UDIV are charged like a short
+software divide), a BTAC of 2-bit counters
+with static backward-taken prediction when it misses, a return stack for
+BX LR, and L1 I and D caches of any size, associativity and line size. A
+miss costs the same mem_latency cycles every time and stores go through a
+write buffer, so they never stall and do not allocate a line. Timed states
+run through arm_timing_execute, the interp loop with the model around each
+instruction. The numbers are estimates, good for comparing versions of a
+kernel, not for predicting the hardware to the cycle. */
+
+/* Defaults are the ARM1176 of the Raspberry Pi */
+#define TIMING_CACHE_SIZE 16384
+#define TIMING_CACHE_WAYS 4
+#define TIMING_CACHE_LINE 32
+#define TIMING_MEM_LATENCY 60
+#define TIMING_LOAD_LATENCY 3
+#define TIMING_MUL_LATENCY 3
+#define TIMING_DIV_CYCLES 12
+#define TIMING_MISPREDICT 5
+#define TIMING_BTAC_SIZE 128
+#define TIMING_RAS_SIZE 3
+
+#define ARM_CACHE_EMPTY 0xFFFFFFFF
+
+/* Geometry of a cache in bytes. size is ways * line * a power of 2 */
+struct arm_cache_config {
+
+    unsigned int size;
+    unsigned int ways;
+    unsigned int line;
+
+};
+
+struct arm_timing_config {
+
+    struct arm_cache_config icache;
+    struct arm_cache_config dcache;
+    unsigned int mem_latency;
+
+};
+
+/* A set associative cache that only keeps tags. Each set replaces its
+ways round robin, which is one of the two policies of the ARM1176 */
+struct arm_cache {
+
+    struct arm_cache_config config;
+    unsigned int sets;
+    unsigned int line_shift;
+
+    /* sets * ways line numbers (address >> line_shift) */
+    unsigned int *tags;
+    unsigned int *victim;
+
+    long long accesses;
+    long long misses;
+
+};
+
+struct arm_btac_entry {
+
+    unsigned int pc;
+    unsigned int counter;
+
+};
+
+struct arm_timing {
+
+    struct arm_timing_config config;
+    struct arm_cache icache;
+    struct arm_cache dcache;
+
+    struct arm_btac_entry btac[TIMING_BTAC_SIZE];
+    unsigned int ras[TIMING_RAS_SIZE];
+    unsigned int ras_top;
+    unsigned int ras_count;
+
+    /* The cycle each register can be read in, later than cycles while
+    a load or multiply to it is in flight */
+    long long ready[NREGS];
+
+    long long cycles;
+    long long instrs;
+    long long branches;
+    long long mispredicts;
+
+    /* Where the cycles beyond one per instruction went */
+    long long stall_load;
+    long long stall_shift;
+    long long stall_multiple;
+    long long stall_mul;
+    long long stall_branch;
+    long long stall_icache;
+    long long stall_dcache;
+
+};
+
+/* Sets c to the ARM1176 defaults */
+void arm_timing_config_default(struct arm_timing_config *c) {
+
+    c->icache.size = TIMING_CACHE_SIZE;
+    c->icache.ways = TIMING_CACHE_WAYS;
+    c->icache.line = TIMING_CACHE_LINE;
+    c->dcache = c->icache;
+    c->mem_latency = TIMING_MEM_LATENCY;
+
+}
+
+/* Parses a cache as "size/ways/line" (ex. "16k/4/32") and sets *end to
+the first character after it. Returns false if s is not a usable cache */
+bool arm_cache_parse(struct arm_cache_config *c, const char *s, const char **end) {
+
+    unsigned int sets;
+    char *p;
+
+    c->size = strtoul(s, &p, 0);
+    if(*p == 'k') {
+        c->size *= 1024;
+        p++;
+    }
+    if(*p++ != '/') {
+        return false;
+    }
+
+    c->ways = strtoul(p, &p, 0);
+    if(*p++ != '/') {
+        return false;
+    }
+
+    c->line = strtoul(p, &p, 0);
+    *end = p;
+
+    if(c->ways == 0 || c->line < 4 || (c->line & (c->line - 1)) != 0
+       || c->size == 0 || c->size % (c->ways * c->line) != 0) {
+        return false;
+    }
+
+    sets = c->size / (c->ways * c->line);
+
+    return (sets & (sets - 1)) == 0;
+
+}
+
+/* Parses the argument of -m, a comma separated list of "arm1176" (the
+defaults), "i=size/ways/line", "d=size/ways/line" and "mem=cycles", into
+c. Returns false if spec has anything else in it */
+bool arm_timing_parse(struct arm_timing_config *c, const char *spec) {
+
+    const char *p = spec;
+    char *end;
+
+    arm_timing_config_default(c);
+
+    while(*p != '\0') {
+
+        if(strncmp(p, "arm1176", 7) == 0) {
+            p += 7;
+        } else if(strncmp(p, "i=", 2) == 0) {
+            if(!arm_cache_parse(&c->icache, p + 2, &p)) {
+                return false;
+            }
+        } else if(strncmp(p, "d=", 2) == 0) {
+            if(!arm_cache_parse(&c->dcache, p + 2, &p)) {
+                return false;
+            }
+        } else if(strncmp(p, "mem=", 4) == 0) {
+            c->mem_latency = strtoul(p + 4, &end, 0);
+            if(end == p + 4) {
+                return false;
+            }
+            p = end;
+        } else {
+            return false;
+        }
+
+        if(*p == ',') {
+            p++;
+        } else if(*p != '\0') {
+            return false;
+        }
+
+    }
+
+    return true;
+
+}
+
+/* Empties the caches and predictors and zeroes the counts */
+void arm_timing_reset(struct arm_timing *t) {
+
+    unsigned int i;
+
+    for(i = 0; i < t->icache.sets * t->icache.config.ways; i++) {
+        t->icache.tags[i] = ARM_CACHE_EMPTY;
+    }
+    for(i = 0; i < t->dcache.sets * t->dcache.config.ways; i++) {
+        t->dcache.tags[i] = ARM_CACHE_EMPTY;
+    }
+    memset(t->icache.victim, 0, t->icache.sets * sizeof(unsigned int));
+    memset(t->dcache.victim, 0, t->dcache.sets * sizeof(unsigned int));
+    t->icache.accesses = t->icache.misses = 0;
+    t->dcache.accesses = t->dcache.misses = 0;
+
+    memset(t->btac, 0, sizeof(t->btac));
+    t->ras_top = 0;
+    t->ras_count = 0;
+    memset(t->ready, 0, sizeof(t->ready));
+
+    t->cycles = 0;
+    t->instrs = 0;
+    t->branches = 0;
+    t->mispredicts = 0;
+    t->stall_load = 0;
+    t->stall_shift = 0;
+    t->stall_multiple = 0;
+    t->stall_mul = 0;
+    t->stall_branch = 0;
+    t->stall_icache = 0;
+    t->stall_dcache = 0;
+
+}
+
+/* Allocates the tags of an empty cache. Returns -1 if there is not enough memory */
+int arm_cache_init(struct arm_cache *c, struct arm_cache_config *config) {
+
+    c->config = *config;
+    c->sets = config->size / (config->ways * config->line);
+    for(c->line_shift = 0; (1u << c->line_shift) < config->line; c->line_shift++) {
+    }
+
+    c->tags = (unsigned int *) malloc(c->sets * config->ways * sizeof(unsigned int));
+    c->victim = (unsigned int *) malloc(c->sets * sizeof(unsigned int));
+
+    return c->tags == NULL || c->victim == NULL ? -1 : 0;
+
+}
+
+void arm_timing_free(struct arm_timing *t) {
+
+    free(t->icache.tags);
+    free(t->icache.victim);
+    free(t->dcache.tags);
+    free(t->dcache.victim);
+    free(t);
+
+}
+
+/* Makes a timing model with cold caches. Returns NULL if there is not enough memory */
+struct arm_timing *arm_timing_new(struct arm_timing_config *config) {
+
+    struct arm_timing *t;
+
+    t = (struct arm_timing *) calloc(1, sizeof(struct arm_timing));
+    if(t == NULL) {
+        return NULL;
+    }
+
+    t->config = *config;
+    if(arm_cache_init(&t->icache, &config->icache) != 0
+       || arm_cache_init(&t->dcache, &config->dcache) != 0) {
+        arm_timing_free(t);
+        return NULL;
+    }
+
+    arm_timing_reset(t);
+
+    return t;
+
+}
+
+/* Looks addr up in c. Returns false on a miss, which brings the line in
+if allocate is set */
+static inline bool arm_cache_access(struct arm_cache *c, unsigned int addr, bool allocate) {
+
+    unsigned int line = addr >> c->line_shift;
+    unsigned int set = line & (c->sets - 1);
+    unsigned int *tags = &c->tags[set * c->config.ways];
+    unsigned int i;
+
+    c->accesses++;
+
+    for(i = 0; i < c->config.ways; i++) {
+        if(tags[i] == line) {
+            return true;
+        }
+    }
+
+    c->misses++;
+
+    if(allocate) {
+        tags[c->victim[set]] = line;
+        c->victim[set] = (c->victim[set] + 1) % c->config.ways;
+    }
+
+    return false;
+
+}
+
+/* Predicts the B or BL di and trains the BTAC with where it went. A
+branch that is not in the BTAC is guessed taken if it goes backwards (or
+is unconditional). Returns true if the guess was right */
+static bool arm_timing_predict(struct arm_timing *t, struct arm_decoded *di, bool taken) {
+
+    struct arm_btac_entry *e = &t->btac[(di->pc >> 2) & (TIMING_BTAC_SIZE - 1)];
+    bool guess;
+
+    if(e->pc == di->pc) {
+
+        guess = e->counter >= 2;
+        if(taken && e->counter < 3) {
+            e->counter++;
+        } else if(!taken && e->counter > 0) {
+            e->counter--;
+        }
+
+    } else {
+
+        guess = di->cond == COND_AL || (int) di->imm <= 0;
+        e->pc = di->pc;
+        e->counter = taken ? 2 : 1;
+
+    }
+
+    return guess == taken;
+
+}
+
+/* Puts the registers di reads in regs (room for NREGS + 1) and returns
+how many there are */
+static int arm_timing_sources(struct arm_decoded *di, unsigned int *regs) {
+
+    unsigned int r;
+    int n = 0;
+
+    switch(di->op) {
+
+    case OP_UNKNOWN:
+    case OP_B:
+    case OP_BL:
+        break;
+
+    case OP_BX:
+        regs[n++] = di->rm;
+        break;
+
+    case OP_LDR:
+    case OP_STR:
+    case OP_LDRB:
+    case OP_STRB:
+    case OP_LDRH:
+    case OP_STRH:
+    case OP_LDRSB:
+    case OP_LDRSH:
+        regs[n++] = di->rn;
+        if(di->form != OPND_IMM) {
+            regs[n++] = di->rm;
+        }
+        if(!arm_op_load(di->op)) {
+            regs[n++] = di->rd;
+        }
+        break;
+
+    case OP_MLA:
+    case OP_SDIV:
+    case OP_UDIV:
+        regs[n++] = di->rn;
+        regs[n++] = di->rm;
+        if(di->op == OP_MLA) {
+            regs[n++] = di->rs;
+        }
+        break;
+
+    case OP_MUL:
+    case OP_UMULL:
+    case OP_SMULL:
+        regs[n++] = di->rm;
+        regs[n++] = di->rs;
+        break;
+
+    case OP_UMLAL:
+    case OP_SMLAL:
+        regs[n++] = di->rd;
+        regs[n++] = di->rn;
+        regs[n++] = di->rm;
+        regs[n++] = di->rs;
+        break;
+
+    case OP_LDM:
+        regs[n++] = di->rn;
+        break;
+
+    case OP_STM:
+        regs[n++] = di->rn;
+        for(r = 0; r < NREGS; r++) {
+            if(di->imm & (1 << r)) {
+                regs[n++] = r;
+            }
+        }
+        break;
+
+    default:
+        if(di->op != OP_MOV && di->op != OP_MVN) {
+            regs[n++] = di->rn;
+        }
+        if(di->form != OPND_IMM) {
+            regs[n++] = di->rm;
+        }
+        if(di->form == OPND_SHIFT_REG) {
+            regs[n++] = di->rs;
+        }
+        break;
+
+    }
+
+    return n;
+
+}
+
+/* Runs as like the interp engine, adding what each instruction costs to
+as->timing */
+unsigned int arm_timing_execute(struct arm_state *as) {
+
+    struct arm_timing *t = as->timing;
+    struct arm_decoded *di;
+    unsigned int pc, addr = 0, wb, regs[NREGS + 1], target;
+    long long ready;
+    bool valid, taken, predicted;
+    int i, n, r;
+
+    while(as->regs[PC] != 0) {
+
+        pc = as->regs[PC];
+        di = arm_dcache_lookup(as, pc);
+
+        if(!arm_cache_access(&t->icache, pc, true)) {
+            t->cycles += t->config.mem_latency;
+            t->stall_icache += t->config.mem_latency;
+        }
+
+        /* Held up until the loads it depends on are done */
+        ready = t->cycles;
+        n = arm_timing_sources(di, regs);
+        for(i = 0; i < n; i++) {
+            if(t->ready[regs[i]] > ready) {
+                ready = t->ready[regs[i]];
+            }
+        }
+        t->stall_load += ready - t->cycles;
+        t->cycles = ready;
+
+        valid = is_valid(as, di->cond);
+        if(arm_op_transfer(di->op)) {
+            addr = arm_transfer_addr(as, di, &wb);
+        } else if(di->op == OP_LDM || di->op == OP_STM) {
+            addr = arm_multiple_addr(as, di, &wb);
+        }
+
+        di->handler(as, di);
+        if(as->fault != FAULT_NONE) {
+            break;
+        }
+
+        t->instrs++;
+        t->cycles++;
+
+        if(valid && arm_op_transfer(di->op) && arm_op_load(di->op)) {
+            if(!arm_cache_access(&t->dcache, addr, true)) {
+                t->cycles += t->config.mem_latency;
+                t->stall_dcache += t->config.mem_latency;
+            }
+            t->ready[di->rd] = t->cycles + TIMING_LOAD_LATENCY - 1;
+        } else if(valid && arm_op_transfer(di->op)) {
+            arm_cache_access(&t->dcache, addr, false);
+        } else if(valid && (di->op == OP_LDM || di->op == OP_STM)) {
+
+            /* Two registers a cycle, each word looked up in the D-cache */
+            if(di->shift_amount > 2) {
+                t->cycles += (di->shift_amount + 1) / 2 - 1;
+                t->stall_multiple += (di->shift_amount + 1) / 2 - 1;
+            }
+            for(i = 0; i < di->shift_amount; i++) {
+                if(!arm_cache_access(&t->dcache, addr + 4 * i, di->op == OP_LDM) && di->op == OP_LDM) {
+                    t->cycles += t->config.mem_latency;
+                    t->stall_dcache += t->config.mem_latency;
+                }
+            }
+            for(r = 0; r < NREGS && di->op == OP_LDM; r++) {
+                if(di->imm & (1 << r)) {
+                    t->ready[r] = t->cycles + TIMING_LOAD_LATENCY - 1;
+                }
+            }
+
+        } else if(valid && di->op >= OP_MUL && di->op <= OP_UDIV) {
+
+            /* Issue takes one more cycle for MUL and MLA and two for the
+            long multiplies, two more with S set */
+            if(di->op == OP_SDIV || di->op == OP_UDIV) {
+                i = TIMING_DIV_CYCLES;
+            } else {
+                i = (di->op <= OP_MLA ? 1 : 2) + 2 * di->setflags;
+            }
+            t->cycles += i;
+            t->stall_mul += i;
+            t->ready[di->rd] = t->cycles + TIMING_MUL_LATENCY - 1;
+            if(di->op >= OP_UMULL && di->op <= OP_SMLAL) {
+                t->ready[di->rn] = t->cycles + TIMING_MUL_LATENCY - 1;
+            }
+
+        } else if(valid && di->op >= OP_AND && di->op <= OP_MVN && di->form == OPND_SHIFT_REG) {
+            t->cycles++;
+            t->stall_shift++;
+        }
+
+        target = as->regs[PC];
+        taken = target != pc + 4;
+
+        if(di->op == OP_B || di->op == OP_BL) {
+            predicted = arm_timing_predict(t, di, taken);
+        } else if(valid && ((di->op == OP_BX && di->rm == LR)
+                            || (di->op == OP_LDM && di->rn == SP && (di->imm >> PC) & 1))) {
+            /* Returns (BX LR and POP {..., pc}) are predicted from the return stack */
+            predicted = false;
+            if(t->ras_count > 0) {
+                t->ras_count--;
+                t->ras_top = (t->ras_top + TIMING_RAS_SIZE - 1) % TIMING_RAS_SIZE;
+                predicted = t->ras[t->ras_top] == target;
+            }
+        } else if(taken) {
+            /* Any other write to PC is found out too late to predict */
+            predicted = false;
+        } else {
+            continue;
+        }
+
+        if(di->op == OP_BL && valid) {
+            t->ras[t->ras_top] = pc + 4;
+            t->ras_top = (t->ras_top + 1) % TIMING_RAS_SIZE;
+            if(t->ras_count < TIMING_RAS_SIZE) {
+                t->ras_count++;
+            }
+        }
+
+        t->branches++;
+        if(!predicted) {
+            t->mispredicts++;
+            t->cycles += TIMING_MISPREDICT;
+            t->stall_branch += TIMING_MISPREDICT;
+        }
+
+    }
+
+    return as->regs[0];
+
+}
+
+static double arm_timing_rate(long long part, long long total) {
+
+    return total == 0 ? 0.0 : 100.0 * part / total;
+
+}
+
+/* Prints what the model counted, each line starting with name */
+void arm_timing_report(FILE *f, struct arm_timing *t, const char *name) {
+
+    fprintf(f, "%s Cycles %lld (CPI %.2f)\n", name, t->cycles,
+            t->instrs == 0 ? 0.0 : (double) t->cycles / t->instrs);
+    fprintf(f, "%s Stall Cycles load-use %lld, register shift %lld, load/store multiple %lld, "
+            "multiply/divide %lld, branch %lld, I-cache %lld, D-cache %lld\n", name, t->stall_load,
+            t->stall_shift, t->stall_multiple, t->stall_mul, t->stall_branch, t->stall_icache,
+            t->stall_dcache);
+    fprintf(f, "%s I-cache %lld accesses, %lld misses (%.2f%%)\n", name, t->icache.accesses,
+            t->icache.misses, arm_timing_rate(t->icache.misses, t->icache.accesses));
+    fprintf(f, "%s D-cache %lld accesses, %lld misses (%.2f%%)\n", name, t->dcache.accesses,
+            t->dcache.misses, arm_timing_rate(t->dcache.misses, t->dcache.accesses));
+    fprintf(f, "%s Branches %lld, %lld mispredicted (%.2f%%)\n", name, t->branches,
+            t->mispredicts, arm_timing_rate(t->mispredicts, t->branches));
+
+}
+
+
+/* Memoisation of pure calls, turned on with -M on. Memoised states run
+through arm_memo_execute, the interp loop that watches every BL. Each call
+that is still running is tracked with a tag for every register, the flags
+and every word of stack below the SP it was called with. The tag says the
+value is the one a register (or the flags) had when the call was made
+(MEMO_ENTRY), was worked out from r0-r3 and the call's own stack only
+(MEMO_COMPUTED), or is not known (MEMO_UNKNOWN, ex. a stack word the call
+has not written). A call stops being pure when it works out anything from
+a value it was not given (r4 and up, SP or the flags), touches memory
+outside its own frame, or returns with a register or the flags holding
+anything but their own entry value or a computed one, so a function that
+saves r4 on the stack and loads it back is still pure. When a pure call
+returns, the registers and flags it changed and the instructions it ran
+are kept in the memo table under its address and r0-r3, and a later BL to
+it with the same r0-r3 puts them back without running it (the stack below
+SP is left as it was). A store into a page code was fetched from empties
+the table. The table is not shared between threads */
+
+/* The memo table has 1 << MEMO_BITS entries */
+#define MEMO_BITS 12
+#define MEMO_SIZE (1 << MEMO_BITS)
+
+/* Calls nested deeper than this run untracked, and the calls around them
+are not kept */
+#define MEMO_DEPTH 64
+
+/* Words of stack a tracked call can use */
+#define MEMO_FRAME_WORDS 1024
+
+/* Tags. MEMO_ENTRY(r) is the value r had when the call was made, with
+MEMO_FLAGS (NREGS) for the flags */
+#define MEMO_ENTRY(r) (r)
+#define MEMO_FLAGS NREGS
+#define MEMO_COMPUTED (NREGS + 1)
+#define MEMO_UNKNOWN (NREGS + 2)
+
+/* A call that is still running. The counts are the ones before the BL */
+struct arm_memo_call {
+
+    unsigned int func;
+    unsigned int args[4];
+    unsigned int sp;
+    unsigned int ret;
+    bool pure;
+
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+    unsigned char tags[NREGS + 1];
+
+    /* stack[i] is the tag of the word at sp - 4 * (i + 1). The words from
+    nstack up are MEMO_UNKNOWN */
+    int nstack;
+    unsigned char stack[MEMO_FRAME_WORDS];
+
+};
+
+/* What a pure call did. func is 0 if the entry is empty. Bit r of changed
+is set if the call leaves regs[r] in register r (bit MEMO_FLAGS if it leaves
+nzcv in the flags), the others are left alone */
+struct arm_memo_entry {
+
+    unsigned int func;
+    unsigned int args[4];
+    unsigned int changed;
+    unsigned int regs[NREGS];
+    unsigned int nzcv;
+
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+};
+
+struct arm_memo {
+
+    struct arm_memo_entry table[MEMO_SIZE];
+
+    struct arm_memo_call calls[MEMO_DEPTH];
+    int depth;
+
+    long long hits;
+    long long misses;
+    long long kept;
+    long long impure;
+    long long invalidations;
+
+};
+
+/* Makes an empty memo table. Returns NULL if there is not enough memory */
+struct arm_memo *arm_memo_new(void) {
+
+    return (struct arm_memo *) calloc(1, sizeof(struct arm_memo));
+
+}
+
+void arm_memo_free(struct arm_memo *m) {
+
+    free(m);
+
+}
+
+/* Zeroes the counts, the table is kept */
+void arm_memo_reset(struct arm_memo *m) {
+
+    m->hits = 0;
+    m->misses = 0;
+    m->kept = 0;
+    m->impure = 0;
+    m->invalidations = 0;
+
+}
+
+static inline struct arm_memo_entry *arm_memo_slot(struct arm_memo *m, unsigned int func,
+                                                   const unsigned int *args) {
+
+    unsigned int h = func * 0x9E3779B1;
+    int i;
+
+    for(i = 0; i < 4; i++) {
+        h = (h ^ args[i]) * 0x85EBCA6B;
+    }
+
+    return &m->table[h >> (32 - MEMO_BITS)];
+
+}
+
+/* The tag of the stack word holding addr, or NULL if it is not in the frame of f */
+static inline unsigned char *arm_memo_word(struct arm_memo_call *f, unsigned int addr) {
+
+    unsigned int i;
+
+    if(addr >= f->sp) {
+        return NULL;
+    }
+
+    i = (f->sp - 4 - (addr & ~3)) / 4;
+    if(i >= MEMO_FRAME_WORDS) {
+        return NULL;
+    }
+
+    while(f->nstack <= (int) i) {
+        f->stack[f->nstack++] = MEMO_UNKNOWN;
+    }
+
+    return &f->stack[i];
+
+}
+
+/* A register can be jumped to if it was worked out or is the return address */
+static inline bool arm_memo_target(unsigned char tag) {
+
+    return tag == MEMO_COMPUTED || tag == MEMO_ENTRY(LR);
+
+}
+
+/* Updates the tags of f for di, which is about to run (valid is whether its
+condition passes, and addr is the first address it loads or stores) */
+static void arm_memo_track(struct arm_memo_call *f, struct arm_decoded *di, bool valid,
+                           unsigned int addr) {
+
+    unsigned char *t = f->tags, *w;
+    unsigned int regs[NREGS + 1], r, size;
+    int i, n;
+
+    if(di->cond != COND_AL && t[MEMO_FLAGS] != MEMO_COMPUTED) {
+        f->pure = false;
+        return;
+    }
+
+    if(!valid) {
+        return;
+    }
+
+    switch(di->op) {
+
+    case OP_UNKNOWN:
+        f->pure = false;
+        return;
+
+    case OP_B:
+        return;
+
+    case OP_BL:
+        t[LR] = MEMO_COMPUTED;
+        return;
+
+    case OP_BX:
+        f->pure = arm_memo_target(t[di->rm]);
+        return;
+
+    case OP_LDM:
+    case OP_STM:
+
+        if(t[di->rn] != MEMO_COMPUTED && t[di->rn] != MEMO_ENTRY(SP)) {
+            f->pure = false;
+            return;
+        }
+
+        for(r = 0; r < NREGS; r++) {
+
+            if(!(di->imm & (1 << r))) {
+                continue;
+            }
+
+            w = arm_memo_word(f, addr);
+            addr += 4;
+            if(w == NULL || (di->op == OP_LDM && *w == MEMO_UNKNOWN)
+               || (di->op == OP_LDM && r == PC && !arm_memo_target(*w))) {
+                f->pure = false;
+                return;
+            }
+
+            if(di->op == OP_LDM) {
+                t[r] = *w;
+            } else {
+                *w = t[r];
+            }
+
+        }
+
+        return;
+
+    default:
+        break;
+
+    }
+
+    if(arm_op_transfer(di->op)) {
+
+        size = arm_op_size(di->op);
+        w = (addr & (size - 1)) ? NULL : arm_memo_word(f, addr);
+        if(w == NULL || (t[di->rn] != MEMO_COMPUTED && t[di->rn] != MEMO_ENTRY(SP))
+           || (di->form != OPND_IMM && t[di->rm] != MEMO_COMPUTED)) {
+            f->pure = false;
+            return;
+        }
+
+        /* Part of a word only keeps its tag if the whole word was worked out */
+        if(arm_op_load(di->op)) {
+            if(*w == MEMO_UNKNOWN || (size < 4 && *w != MEMO_COMPUTED)
+               || (di->rd == PC && !arm_memo_target(*w))) {
+                f->pure = false;
+                return;
+            }
+            t[di->rd] = size < 4 ? MEMO_COMPUTED : *w;
+        } else if(size == 4) {
+            *w = t[di->rd];
+        } else if(*w != MEMO_COMPUTED || t[di->rd] != MEMO_COMPUTED) {
+            *w = MEMO_UNKNOWN;
+        }
+
+        return;
+
+    }
+
+    /* add sp, sp, #n and sub sp, sp, #n leave SP where it was relative to
+    the frame, and mov pc, lr is a return */
+    if(!di->setflags && di->form == OPND_IMM && (di->op == OP_ADD || di->op == OP_SUB)
+       && di->rd == SP && di->rn == SP) {
+        return;
+    }
+    if(!di->setflags && di->form == OPND_REG && di->op == OP_MOV && di->rd == PC
+       && arm_memo_target(t[di->rm])) {
+        return;
+    }
+
+    n = arm_timing_sources(di, regs);
+    for(i = 0; i < n; i++) {
+        if(t[regs[i]] != MEMO_COMPUTED) {
+            f->pure = false;
+            return;
+        }
+    }
+
+    /* These read C */
+    if((di->op == OP_ADC || di->op == OP_SBC || di->op == OP_RSC
+        || (di->form != OPND_IMM && di->shift_type == SHIFT_RRX))
+       && t[MEMO_FLAGS] != MEMO_COMPUTED) {
+        f->pure = false;
+        return;
+    }
+
+    /* The logical ops and the multiplies keep some of the old flags */
+    if(di->setflags) {
+        if((di->op >= OP_SUB && di->op <= OP_RSC) || di->op == OP_CMP || di->op == OP_CMN) {
+            t[MEMO_FLAGS] = MEMO_COMPUTED;
+        } else if(t[MEMO_FLAGS] != MEMO_COMPUTED) {
+            t[MEMO_FLAGS] = MEMO_UNKNOWN;
+        }
+    }
+
+    if(di->op == OP_TST || di->op == OP_TEQ || di->op == OP_CMP || di->op == OP_CMN) {
+        return;
+    }
+
+    t[di->rd] = MEMO_COMPUTED;
+    if(di->op >= OP_UMULL && di->op <= OP_SMLAL) {
+        t[di->rn] = MEMO_COMPUTED;
+    }
+
+}
+
+/* Starts tracking the call to func the BL at pc is about to make */
+static void arm_memo_push(struct arm_memo *m, struct arm_state *as, unsigned int func,
+                          unsigned int pc) {
+
+    struct arm_memo_call *f;
+    int i;
+
+    if(m->depth == MEMO_DEPTH) {
+        for(i = 0; i < m->depth; i++) {
+            m->calls[i].pure = false;
+        }
+        return;
+    }
+
+    f = &m->calls[m->depth++];
+    f->func = func;
+    memcpy(f->args, as->regs, sizeof(f->args));
+    f->sp = as->regs[SP];
+    f->ret = pc + 4;
+    f->pure = (f->sp & 3) == 0;
+
+    f->num_instr = as->num_instr;
+    f->data_instr = as->data_instr;
+    f->b_instr = as->b_instr;
+    f->mem_instr = as->mem_instr;
+
+    for(i = 0; i <= NREGS; i++) {
+        f->tags[i] = i < 4 || i == PC ? MEMO_COMPUTED : MEMO_ENTRY(i);
+    }
+    f->nstack = 0;
+
+}
+
+/* Ends the call on top of the tracking stack, keeping what it did if it was pure */
+static void arm_memo_pop(struct arm_memo *m, struct arm_state *as) {
+
+    struct arm_memo_call *f = &m->calls[--m->depth];
+    struct arm_memo_entry e;
+    unsigned int r;
+
+    e.changed = 0;
+    for(r = 0; r <= NREGS && f->pure; r++) {
+        if(r == PC || f->tags[r] == MEMO_ENTRY(r)) {
+            continue;
+        }
+        if(f->tags[r] != MEMO_COMPUTED || r == SP) {
+            f->pure = false;
+        }
+        e.changed |= 1 << r;
+        if(r < NREGS) {
+            e.regs[r] = as->regs[r];
+        }
+    }
+
+    if(!f->pure) {
+        m->impure++;
+        return;
+    }
+
+    e.func = f->func;
+    memcpy(e.args, f->args, sizeof(e.args));
+    e.nzcv = (e.changed >> MEMO_FLAGS) & 1 ? arm_flags_nzcv(as) : 0;
+    e.num_instr = as->num_instr - f->num_instr;
+    e.data_instr = as->data_instr - f->data_instr;
+    e.b_instr = as->b_instr - f->b_instr;
+    e.mem_instr = as->mem_instr - f->mem_instr;
+
+    *arm_memo_slot(m, e.func, e.args) = e;
+    m->kept++;
+
+}
+
+/* Does what the call kept in e did, for the BL at pc. To the calls being
+tracked, what it changed is worked out if r0-r3 were, and the stack below
+SP was not written */
+static void arm_memo_hit(struct arm_memo *m, struct arm_state *as, struct arm_memo_entry *e,
+                         unsigned int pc) {
+
+    struct arm_memo_call *f;
+    unsigned char tag;
+    unsigned int r;
+    int i;
+
+    as->regs[LR] = pc + 4;
+    as->regs[PC] = pc + 4;
+    for(r = 0; r < NREGS; r++) {
+        if((e->changed >> r) & 1) {
+            as->regs[r] = e->regs[r];
+        }
+    }
+    if((e->changed >> MEMO_FLAGS) & 1) {
+        arm_flags_set(as, e->nzcv);
+    }
+
+    as->num_instr += e->num_instr;
+    as->data_instr += e->data_instr;
+    as->b_instr += e->b_instr;
+    as->mem_instr += e->mem_instr;
+
+    for(i = 0; i < m->depth; i++) {
+
+        f = &m->calls[i];
+        tag = MEMO_COMPUTED;
+        for(r = 0; r < 4; r++) {
+            if(f->tags[r] != MEMO_COMPUTED) {
+                tag = MEMO_UNKNOWN;
+            }
+        }
+
+        for(r = 0; r <= NREGS; r++) {
+            if((e->changed >> r) & 1) {
+                f->tags[r] = tag;
+            }
+        }
+
+        if(as->regs[SP] >= f->sp) {
+            f->nstack = 0;
+        } else if(f->nstack > (int) ((f->sp - as->regs[SP]) / 4)) {
+            f->nstack = (f->sp - as->regs[SP]) / 4;
+        }
+
+    }
+
+    m->hits++;
+
+}
+
+/* Runs as like the interp engine, keeping and reusing what pure calls do
+(see arm_memo_track) */
+unsigned int arm_memo_execute(struct arm_state *as) {
+
+    struct arm_memo *m = as->memo;
+    struct arm_memo_entry *e;
+    struct arm_decoded *di;
+    struct arm_page *page;
+    unsigned int pc, addr, wb, func;
+    bool valid;
+    int i;
+
+    m->depth = 0;
+
+    while(as->regs[PC] != 0) {
+
+        pc = as->regs[PC];
+        di = arm_dcache_lookup(as, pc);
+        valid = is_valid(as, di->cond);
+
+        addr = 0;
+        if(arm_op_transfer(di->op)) {
+            addr = arm_transfer_addr(as, di, &wb);
+        } else if(di->op == OP_LDM || di->op == OP_STM) {
+            addr = arm_multiple_addr(as, di, &wb);
+        }
+
+        for(i = 0; i < m->depth; i++) {
+            if(m->calls[i].pure) {
+                arm_memo_track(&m->calls[i], di, valid, addr);
+            }
+        }
+
+        if(valid && di->op == OP_BL) {
+
+            func = pc + di->imm;
+            e = arm_memo_slot(m, func, as->regs);
+            if(e->func == func && memcmp(e->args, as->regs, sizeof(e->args)) == 0) {
+                arm_memo_hit(m, as, e, pc);
+                continue;
+            }
+
+            m->misses++;
+            arm_memo_push(m, as, func, pc);
+
+        }
+
+        di->handler(as, di);
+        if(as->fault != FAULT_NONE) {
+            break;
+        }
+
+        /* Code may have changed under the calls that were kept */
+        if(valid && ((arm_op_transfer(di->op) && !arm_op_load(di->op)) || di->op == OP_STM)) {
+            page = arm_mem_page(as->mem, addr);
+            if(page != NULL && (arm_page_prot(page) & ARM_PAGE_CODE)) {
+                memset(m->table, 0, sizeof(m->table));
+                m->invalidations++;
+            }
+        }
+
+        /* A call is over when it gets back to its return address with SP
+        where it was, or when SP goes above where it was without that */
+        while(m->depth > 0) {
+            if(as->regs[PC] == m->calls[m->depth - 1].ret
+               && as->regs[SP] == m->calls[m->depth - 1].sp) {
+                arm_memo_pop(m, as);
+                break;
+            }
+            if(as->regs[SP] <= m->calls[m->depth - 1].sp) {
+                break;
+            }
+            m->calls[--m->depth].pure = false;
+            m->impure++;
+        }
+
+    }
+
+    m->depth = 0;
+
+    return as->regs[0];
+
+}
+
+/* Prints what the memo table did, starting with name */
+void arm_memo_report(FILE *f, struct arm_memo *m, const char *name) {
+
+    fprintf(f, "%s Memo %lld hits, %lld misses (%.2f%% hits), %lld results kept, "
+            "%lld impure calls, %lld invalidations\n", name, m->hits, m->misses,
+            arm_timing_rate(m->hits, m->hits + m->misses), m->kept, m->impure, m->invalidations);
+
+}
+
+/* Ahead of time translation. armemu-aot (make armemu-aot) writes C for the
+functions named on its command line and every function they call: each
+guest function becomes a C function with the registers and NZCV in locals,
+a label for every branch target and each instruction turned into a few C
+statements (see arm_aot_emit_insn), and a BL to another translated function
+is a C call. make armemu_aot compiles that with -O3 and links it into
+armemu, so the host compiler keeps the guest registers in host registers,
+drops the flags nothing reads and lays the blocks out, and none of it is
+done again when armemu starts. arm_aot_execute is an interp loop that runs
+a translated function instead whenever the guest calls one.
+
+Whatever cannot be translated (a word that does not decode, a write to PC
+that is not a return, a B or BL to code outside the image) leaves the
+translated function with PC pointing at it and the interp loop carries on
+from there. Loads and stores go through arm_aot_load and arm_aot_store, so
+faults and stores to code behave as in the engines, but translated code is
+only used while the image holds the words it was made from (arm_aot_verify
+is checked every time the guest calls into it), and a function that writes
+its own code does not see the change until it is called again */
+
+/* What arm_aot_execute and the generated code share. armemu-aot prints the
+same declarations at the top of the file it writes (see arm_aot_prelude),
+the two must be kept the same */
+struct arm_aot_cpu {
+
+    unsigned int *regs;
+    unsigned int nzcv;
+    int depth;
+
+    /* The TLBs of the state, which the generated code looks in before
+    calling arm_aot_load or arm_aot_store */
+    struct arm_tlb_entry *tlb_read;
+    struct arm_tlb_entry *tlb_write;
+
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+    void *as;
+
+};
+
+typedef int (*arm_aot_native)(struct arm_aot_cpu *cpu);
+
+/* A translated function, entered at pc and made from the words lo to hi */
+struct arm_aot_entry {
+
+    unsigned int pc;
+    unsigned int lo;
+    unsigned int hi;
+    arm_aot_native code;
+
+};
+
+/* What a translated function returns. ARM_AOT_RETURN when it jumped to
+the address LR had when it was called, ARM_AOT_EXIT when it stopped
+anywhere else (PC is where to carry on, 0 after a fault) */
+#define ARM_AOT_RETURN 0
+#define ARM_AOT_EXIT 1
+
+/* BLs nested deeper than this leave the translated code instead of calling
+it, so deep guest recursion does not use up the host stack */
+#define ARM_AOT_DEPTH 4096
+
+/* Most functions and instructions per function armemu-aot translates */
+#define AOT_MAX_FUNCS 256
+#define AOT_MAX_INSNS 4096
+
+#define AOT_HASH_START 2166136261u
+
+/* FNV-1a of the words from lo up to hi, going on from h. *ok is cleared if
+some of them are not mapped */
+unsigned int arm_aot_hash(struct arm_mem *mem, unsigned int lo, unsigned int hi,
+                          unsigned int h, bool *ok) {
+
+    struct arm_page *page;
+    unsigned int addr;
+
+    for(addr = lo; addr < hi; addr += 4) {
+
+        page = arm_mem_page(mem, addr);
+        if(page == NULL || page->host == NULL || (addr & ARM_PAGE_MASK) < page->lo
+           || (addr & ARM_PAGE_MASK) + 4 > page->hi) {
+            *ok = false;
+            return h;
+        }
+
+        h = (h ^ *(unsigned int *) (page->host + (addr & ARM_PAGE_MASK))) * 16777619;
+
+    }
+
+    return h;
+
+}
+
+#ifdef ARM_AOT
+
+/* Written by armemu-aot, sorted by pc */
+extern const struct arm_aot_entry arm_aot_table[];
+extern const int arm_aot_count;
+extern const unsigned int arm_aot_image_hash;
+
+/* Loads and stores of translated code. pc is the instruction doing them,
+which is where a fault is reported. Return 0 after a fault */
+int arm_aot_load(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,
+                 unsigned int size, unsigned int *value) {
+
+    struct arm_state *as = (struct arm_state *) cpu->as;
+
+    if(arm_mem_read_size(as, addr, size, value)) {
+        return 1;
+    }
+
+    as->fault_pc = pc;
+
+    return 0;
+
+}
+
+int arm_aot_store(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,
+                  unsigned int size, unsigned int value) {
+
+    struct arm_state *as = (struct arm_state *) cpu->as;
+
+    if(arm_mem_write_size(as, addr, size, value)) {
+        return 1;
+    }
+
+    as->fault_pc = pc;
+
+    return 0;
+
+}
+
+/* The translated function entered at pc, or NULL */
+static const struct arm_aot_entry *arm_aot_lookup(unsigned int pc) {
+
+    int lo = 0, hi = arm_aot_count - 1, mid;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(arm_aot_table[mid].pc == pc) {
+            return &arm_aot_table[mid];
+        }
+        if(arm_aot_table[mid].pc < pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+
+}
+
+/* True if mem holds the code all the translated functions were made from
+(they call one another, so they are checked together) */
+static bool arm_aot_verify(struct arm_mem *mem) {
+
+    unsigned int h = AOT_HASH_START;
+    bool ok = true;
+    int i;
+
+    for(i = 0; i < arm_aot_count; i++) {
+        h = arm_aot_hash(mem, arm_aot_table[i].lo, arm_aot_table[i].hi, h, &ok);
+    }
+
+    return ok && h == arm_aot_image_hash;
+
+}
+
+/* Runs as like the interp engine, except that a call to a translated
+function (the first instruction, or the one after a BL) runs the native
+code instead. The counts come out the same as on interp */
+unsigned int arm_aot_execute(struct arm_state *as) {
+
+    const struct arm_aot_entry *e;
+    struct arm_aot_cpu cpu;
+    struct arm_decoded *di;
+    bool call = true;
+
+    cpu.regs = as->regs;
+    cpu.depth = 0;
+    cpu.tlb_read = as->tlb_read;
+    cpu.tlb_write = as->tlb_write;
+    cpu.as = as;
+
+    while(as->regs[PC] != 0) {
+
+        if(call && (e = arm_aot_lookup(as->regs[PC])) != NULL && arm_aot_verify(as->mem)) {
+
+            cpu.nzcv = arm_flags_nzcv(as);
+            cpu.num_instr = 0;
+            cpu.data_instr = 0;
+            cpu.b_instr = 0;
+            cpu.mem_instr = 0;
+
+            e->code(&cpu);
+
+            arm_flags_set(as, cpu.nzcv);
+            as->num_instr += cpu.num_instr;
+            as->data_instr += cpu.data_instr;
+            as->b_instr += cpu.b_instr;
+            as->mem_instr += cpu.mem_instr;
+
+        } else {
+
+            di = arm_dcache_lookup(as, as->regs[PC]);
+            call = di->op == OP_BL;
+            di->handler(as, di);
+
+        }
+
+        if(as->fault != FAULT_NONE) {
+            break;
+        }
+
+    }
+
+    return as->regs[0];
+
+}
+
+#endif
+
+/* A function armemu-aot translates. insns holds its instructions sorted
+by pc, label is set on the ones something branches to */
+struct arm_aot_insn {
+
+    struct arm_decoded di;
+    bool label;
+
+};
+
+struct arm_aot_function {
+
+    unsigned int entry;
+    const char *name;
+    struct arm_aot_insn *insns;
+    int ninsns;
+
+};
+
+struct arm_aot_gen {
+
+    struct arm_state *as;
+    struct arm_image *img;
+    struct arm_aot_function funcs[AOT_MAX_FUNCS];
+    int nfuncs;
+
+};
+
+/* The declarations at the top of the generated file, see struct arm_aot_cpu.
+aot_load and aot_store are the TLB hits of arm_mem_read_size and
+arm_mem_write_size (ARM_TLB_SIZE and ARM_PAGE_SHIFT are written out), and
+aot_shift is arm_shift for the register specified shifts */
+const char * const arm_aot_prelude =
+    "#include <stdint.h>\n"
+    "\n"
+    "struct arm_aot_tlb {\n"
+    "    unsigned int tag;\n"
+    "    uintptr_t addend;\n"
+    "};\n"
+    "\n"
+    "struct arm_aot_cpu {\n"
+    "    unsigned int *regs;\n"
+    "    unsigned int nzcv;\n"
+    "    int depth;\n"
+    "    struct arm_aot_tlb *tlb_read;\n"
+    "    struct arm_aot_tlb *tlb_write;\n"
+    "    int num_instr;\n"
+    "    int data_instr;\n"
+    "    int b_instr;\n"
+    "    int mem_instr;\n"
+    "    void *as;\n"
+    "};\n"
+    "\n"
+    "typedef int (*arm_aot_native)(struct arm_aot_cpu *cpu);\n"
+    "\n"
+    "struct arm_aot_entry {\n"
+    "    unsigned int pc;\n"
+    "    unsigned int lo;\n"
+    "    unsigned int hi;\n"
+    "    arm_aot_native code;\n"
+    "};\n"
+    "\n"
+    "#define ARM_AOT_RETURN 0\n"
+    "#define ARM_AOT_EXIT 1\n"
+    "#define ARM_AOT_DEPTH 4096\n"
+    "\n"
+    "int arm_aot_load(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,\n"
+    "                 unsigned int size, unsigned int *value);\n"
+    "int arm_aot_store(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,\n"
+    "                  unsigned int size, unsigned int value);\n"
+    "\n"
+    "static inline int aot_load(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,\n"
+    "                           unsigned int size, unsigned int *value) {\n"
+    "    struct arm_aot_tlb *e = &cpu->tlb_read[(addr >> 12) & 255];\n"
+    "    if(e->tag == (addr & (0xFFFFF000u | (size - 1)))) {\n"
+    "        uintptr_t p = e->addend + addr;\n"
+    "        *value = size == 1 ? *(unsigned char *) p : size == 2 ? *(unsigned short *) p : *(unsigned int *) p;\n"
+    "        return 1;\n"
+    "    }\n"
+    "    return arm_aot_load(cpu, pc, addr, size, value);\n"
+    "}\n"
+    "\n"
+    "static inline int aot_store(struct arm_aot_cpu *cpu, unsigned int pc, unsigned int addr,\n"
+    "                            unsigned int size, unsigned int value) {\n"
+    "    struct arm_aot_tlb *e = &cpu->tlb_write[(addr >> 12) & 255];\n"
+    "    if(e->tag == (addr & (0xFFFFF000u | (size - 1)))) {\n"
+    "        uintptr_t p = e->addend + addr;\n"
+    "        if(size == 1) {\n"
+    "            *(unsigned char *) p = value;\n"
+    "        } else if(size == 2) {\n"
+    "            *(unsigned short *) p = value;\n"
+    "        } else {\n"
+    "            *(unsigned int *) p = value;\n"
+    "        }\n"
+    "        return 1;\n"
+    "    }\n"
+    "    return arm_aot_store(cpu, pc, addr, size, value);\n"
+    "}\n"
+    "\n"
+    "static inline unsigned int aot_shift(unsigned int value, unsigned int type,\n"
+    "                                     unsigned int amount, unsigned int *carry) {\n"
+    "    if(amount == 0) {\n"
+    "        return value;\n"
+    "    }\n"
+    "    switch(type) {\n"
+    "    case 0:\n"
+    "        if(amount < 32) {\n"
+    "            *carry = (value >> (32 - amount)) & 1;\n"
+    "            return value << amount;\n"
+    "        }\n"
+    "        *carry = amount == 32 ? value & 1 : 0;\n"
+    "        return 0;\n"
+    "    case 1:\n"
+    "        if(amount < 32) {\n"
+    "            *carry = (value >> (amount - 1)) & 1;\n"
+    "            return value >> amount;\n"
+    "        }\n"
+    "        *carry = amount == 32 ? value >> 31 : 0;\n"
+    "        return 0;\n"
+    "    case 2:\n"
+    "        if(amount < 32) {\n"
+    "            *carry = (value >> (amount - 1)) & 1;\n"
+    "            return (unsigned int) ((int) value >> amount);\n"
+    "        }\n"
+    "        *carry = value >> 31;\n"
+    "        return (unsigned int) ((int) value >> 31);\n"
+    "    default:\n"
+    "        amount &= 31;\n"
+    "        if(amount == 0) {\n"
+    "            *carry = value >> 31;\n"
+    "            return value;\n"
+    "        }\n"
+    "        *carry = (value >> (amount - 1)) & 1;\n"
+    "        return (value >> amount) | (value << (32 - amount));\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "/* Writes the locals back for the caller, or loads them after a call */\n"
+    "#define AOT_SPILL() do { \\\n"
+    "    regs[0] = r0; regs[1] = r1; regs[2] = r2; regs[3] = r3; \\\n"
+    "    regs[4] = r4; regs[5] = r5; regs[6] = r6; regs[7] = r7; \\\n"
+    "    regs[8] = r8; regs[9] = r9; regs[10] = r10; regs[11] = r11; \\\n"
+    "    regs[12] = r12; regs[13] = r13; regs[14] = r14; \\\n"
+    "    cpu->nzcv = n << 3 | z << 2 | c << 1 | v; \\\n"
+    "    cpu->num_instr += ni; cpu->data_instr += nd; \\\n"
+    "    cpu->b_instr += nb; cpu->mem_instr += nm; \\\n"
+    "    ni = nd = nb = nm = 0; \\\n"
+    "} while(0)\n"
+    "\n"
+    "#define AOT_FILL() do { \\\n"
+    "    r0 = regs[0]; r1 = regs[1]; r2 = regs[2]; r3 = regs[3]; \\\n"
+    "    r4 = regs[4]; r5 = regs[5]; r6 = regs[6]; r7 = regs[7]; \\\n"
+    "    r8 = regs[8]; r9 = regs[9]; r10 = regs[10]; r11 = regs[11]; \\\n"
+    "    r12 = regs[12]; r13 = regs[13]; r14 = regs[14]; \\\n"
+    "    n = cpu->nzcv >> 3 & 1; z = cpu->nzcv >> 2 & 1; \\\n"
+    "    c = cpu->nzcv >> 1 & 1; v = cpu->nzcv & 1; \\\n"
+    "} while(0)\n"
+    "\n";
+
+/* The C of each condition code on the flag locals */
+const char * const arm_aot_conds[16] = {
+    "z", "!z", "c", "!c", "n", "!n", "v", "!v",
+    "c && !z", "!c || z", "n == v", "n != v", "!z && n == v", "z || n != v", "1", "0"
+};
+
+/* Register r as an operand of di (PC reads as the address plus 8), and as
+the handlers that use as->regs directly see it (PC is the address) */
+static const char *arm_aot_reg(char *buf, struct arm_decoded *di, unsigned int r) {
+
+    if(r == PC) {
+        sprintf(buf, "0x%08xu", di->pc + 8);
+    } else {
+        sprintf(buf, "r%u", r);
+    }
+
+    return buf;
+
+}
+
+static const char *arm_aot_raw(char *buf, struct arm_decoded *di, unsigned int r) {
+
+    if(r == PC) {
+        sprintf(buf, "0x%08xu", di->pc);
+    } else {
+        sprintf(buf, "r%u", r);
+    }
+
+    return buf;
+
+}
+
+/* The instruction of f at pc, or NULL */
+static struct arm_aot_insn *arm_aot_find(struct arm_aot_function *f, unsigned int pc) {
+
+    int lo = 0, hi = f->ninsns - 1, mid;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(f->insns[mid].di.pc == pc) {
+            return &f->insns[mid];
+        }
+        if(f->insns[mid].di.pc < pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+
+}
+
+/* The translated function entered at pc, or NULL */
+static struct arm_aot_function *arm_aot_function(struct arm_aot_gen *g, unsigned int pc) {
+
+    int i;
+
+    for(i = 0; i < g->nfuncs; i++) {
+        if(g->funcs[i].entry == pc) {
+            return &g->funcs[i];
+        }
+    }
+
+    return NULL;
+
+}
+
+/* True if di can be translated. The rest leave the translated function */
+static bool arm_aot_supported(struct arm_decoded *di) {
+
+    switch(di->op) {
+
+    case OP_UNKNOWN:
+        return false;
+
+    case OP_MUL:
+    case OP_MLA:
+    case OP_SDIV:
+    case OP_UDIV:
+        return di->rd != PC;
+
+    case OP_UMULL:
+    case OP_UMLAL:
+    case OP_SMULL:
+    case OP_SMLAL:
+        return di->rd != PC && di->rn != PC;
+
+    case OP_LDM:
+    case OP_STM:
+        return di->rn != PC;
+
+    default:
+        return !arm_op_transfer(di->op) || di->index == INDEX_OFFSET || di->rn != PC;
+
+    }
+
+}
+
+/* The instructions that can run after di in its function. Returns how many */
+static int arm_aot_next(struct arm_decoded *di, unsigned int *next) {
+
+    int n = 0;
+
+    if(!arm_aot_supported(di)) {
+        return 0;
+    }
+
+    if(di->op == OP_B) {
+        next[n++] = di->pc + di->imm;
+    }
+
+    if(di->op == OP_BL || di->cond != COND_AL || !arm_decoded_ends_block(di)) {
+        next[n++] = di->pc + 4;
+    }
+
+    return n;
+
+}
+
+static int arm_aot_insn_compare(const void *a, const void *b) {
+
+    unsigned int x = ((const struct arm_aot_insn *) a)->di.pc;
+    unsigned int y = ((const struct arm_aot_insn *) b)->di.pc;
+
+    return x < y ? -1 : x > y;
+
+}
+
+/* Adds the function at entry (if it is not there yet) and finds its
+instructions by following the branches from entry. BL targets are added
+as functions too. Returns false if there are too many functions */
+bool arm_aot_add(struct arm_aot_gen *g, unsigned int entry, const char *name) {
+
+    struct arm_aot_function *f;
+    struct arm_aot_insn *in;
+    unsigned int *work, next[2], iw, pc, offset;
+    int nwork = 0, i, j, n;
+
+    if(arm_aot_function(g, entry) != NULL) {
+        return true;
+    }
+    if(g->nfuncs == AOT_MAX_FUNCS) {
+        return false;
+    }
+
+    if(name == NULL) {
+        name = arm_image_symbol_name(g->img, entry, &offset);
+        if(name != NULL && offset != 0) {
+            name = NULL;
+        }
+    }
+
+    f = &g->funcs[g->nfuncs++];
+    f->entry = entry;
+    f->name = name;
+    f->insns = (struct arm_aot_insn *) calloc(AOT_MAX_INSNS, sizeof(struct arm_aot_insn));
+    f->ninsns = 0;
+    work = (unsigned int *) malloc(2 * AOT_MAX_INSNS * sizeof(unsigned int));
+    if(f->insns == NULL || work == NULL) {
+        free(work);
+        return false;
+    }
+
+    work[nwork++] = entry;
+
+    while(nwork > 0 && f->ninsns < AOT_MAX_INSNS) {
+
+        pc = work[--nwork];
+        for(i = 0; i < f->ninsns && f->insns[i].di.pc != pc; i++) {
+        }
+        if(i < f->ninsns) {
+            continue;
+        }
+
+        /* A word that cannot be fetched is left for the interp loop, which faults */
+        in = &f->insns[f->ninsns++];
+        if(arm_mem_fetch(g->as, pc, &iw)) {
+            arm_decode(&in->di, pc, iw);
+        } else {
+            arm_decode(&in->di, pc, 0);
+            in->di.op = OP_UNKNOWN;
+        }
+
+        n = arm_aot_next(&in->di, next);
+        for(j = 0; j < n; j++) {
+            work[nwork++] = next[j];
+        }
+
+    }
+
+    free(work);
+
+    qsort(f->insns, f->ninsns, sizeof(struct arm_aot_insn), arm_aot_insn_compare);
+
+    for(i = 0; i < f->ninsns; i++) {
+        if(f->insns[i].di.op == OP_B && (in = arm_aot_find(f, f->insns[i].di.pc + f->insns[i].di.imm)) != NULL) {
+            in->label = true;
+        }
+    }
+
+    /* Only calls into the image are translated, anything else is left to the interp loop */
+    for(i = 0; i < f->ninsns; i++) {
+        if(f->insns[i].di.op == OP_BL && arm_mem_fetch(g->as, f->insns[i].di.pc + f->insns[i].di.imm, &iw)
+           && !arm_aot_add(g, f->insns[i].di.pc + f->insns[i].di.imm, NULL)) {
+            return false;
+        }
+    }
+
+    return true;
+
+}
+
+/* Prints one line of generated C, indent levels deep */
+static void arm_aot_line(FILE *out, int indent, const char *fmt, ...) {
+
+    va_list ap;
+
+    fprintf(out, "%*s", 4 * indent, "");
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+    fputc('\n', out);
+
+}
+
+/* b = x shifted by a constant (an immediate shift of arm_decode, amount
+1 - 32), and sc = the shifter carry if carry is set */
+static void arm_aot_emit_shift(FILE *out, int d, const char *x, unsigned int type,
+                               unsigned int amount, bool carry) {
+
+    switch(type) {
+
+    case SHIFT_LSL:
+        arm_aot_line(out, d, "b = %s << %u;", x, amount);
+        if(carry) {
+            arm_aot_line(out, d, "sc = %s >> %u & 1;", x, 32 - amount);
+        }
+        break;
+
+    case SHIFT_LSR:
+        if(amount < 32) {
+            arm_aot_line(out, d, "b = %s >> %u;", x, amount);
+        } else {
+            arm_aot_line(out, d, "b = 0;");
+        }
+        if(carry) {
+            arm_aot_line(out, d, "sc = %s >> %u & 1;", x, amount - 1);
+        }
+        break;
+
+    case SHIFT_ASR:
+        arm_aot_line(out, d, "b = (unsigned int) ((int) %s >> %u);", x, amount < 32 ? amount : 31);
+        if(carry) {
+            arm_aot_line(out, d, "sc = %s >> %u & 1;", x, amount - 1);
+        }
+        break;
+
+    case SHIFT_ROR:
+        arm_aot_line(out, d, "b = %s >> %u | %s << %u;", x, amount, x, 32 - amount);
+        if(carry) {
+            arm_aot_line(out, d, "sc = %s >> %u & 1;", x, amount - 1);
+        }
+        break;
+
+    default:
+        arm_aot_line(out, d, "b = c << 31 | %s >> 1;", x);
+        if(carry) {
+            arm_aot_line(out, d, "sc = %s & 1;", x);
+        }
+        break;
+
+    }
+
+}
+
+/* b = Src2 of the data instruction di, and sc = the shifter carry if carry is set */
+static void arm_aot_emit_operand2(FILE *out, int d, struct arm_decoded *di, bool carry) {
+
+    char x[16], s[16];
+
+    switch(di->form) {
+
+    case OPND_IMM:
+        arm_aot_line(out, d, "b = 0x%08xu;", di->imm);
+        if(carry && di->shift_amount != 0) {
+            arm_aot_line(out, d, "sc = %u;", di->imm >> 31);
+        } else if(carry) {
+            arm_aot_line(out, d, "sc = c;");
+        }
+        break;
+
+    case OPND_REG:
+        arm_aot_line(out, d, "b = %s;", arm_aot_reg(x, di, di->rm));
+        if(carry) {
+            arm_aot_line(out, d, "sc = c;");
+        }
+        break;
+
+    case OPND_SHIFT_IMM:
+        arm_aot_emit_shift(out, d, arm_aot_reg(x, di, di->rm), di->shift_type, di->shift_amount, carry);
+        break;
+
+    default:
+        arm_aot_line(out, d, "sc = c;");
+        arm_aot_line(out, d, "b = aot_shift(%s, %u, %s & 0xFF, &sc);", arm_aot_reg(x, di, di->rm),
+                     di->shift_type, arm_aot_raw(s, di, di->rs));
+        break;
+
+    }
+
+}
+
+/* Goes on at pc, in f if it is there, else leaves f */
+static void arm_aot_emit_goto(FILE *out, int d, struct arm_aot_function *f, unsigned int pc) {
+
+    if(arm_aot_find(f, pc) != NULL) {
+        arm_aot_line(out, d, "goto L_%08x;", pc);
+    } else {
+        arm_aot_line(out, d, "pc = 0x%08xu;", pc);
+        arm_aot_line(out, d, "goto exit;");
+    }
+
+}
+
+/* The data instructions, see the handlers for what each one does to the flags */
+static void arm_aot_emit_data(FILE *out, int d, struct arm_decoded *di) {
+
+    bool logic, compare, flags;
+    char x[16];
+
+    logic = di->op == OP_AND || di->op == OP_EOR || di->op == OP_ORR || di->op == OP_BIC
+            || di->op == OP_MOV || di->op == OP_MVN || di->op == OP_TST || di->op == OP_TEQ;
+    compare = di->op >= OP_TST && di->op <= OP_CMN;
+    flags = di->setflags || compare;
+
+    if(di->op != OP_MOV && di->op != OP_MVN) {
+        arm_aot_line(out, d, "a = %s;", arm_aot_reg(x, di, di->rn));
+    }
+    arm_aot_emit_operand2(out, d, di, logic && flags);
+
+    switch(di->op) {
+    case OP_AND:
+    case OP_TST:
+        arm_aot_line(out, d, "t = a & b;");
+        break;
+    case OP_EOR:
+    case OP_TEQ:
+        arm_aot_line(out, d, "t = a ^ b;");
+        break;
+    case OP_ORR:
+        arm_aot_line(out, d, "t = a | b;");
+        break;
+    case OP_BIC:
+        arm_aot_line(out, d, "t = a & ~b;");
+        break;
+    case OP_MOV:
+        arm_aot_line(out, d, "t = b;");
+        break;
+    case OP_MVN:
+        arm_aot_line(out, d, "t = ~b;");
+        break;
+    case OP_ADD:
+    case OP_CMN:
+        arm_aot_line(out, d, "t = a + b;");
+        break;
+    case OP_SUB:
+    case OP_CMP:
+        arm_aot_line(out, d, "t = a - b;");
+        break;
+    case OP_RSB:
+        arm_aot_line(out, d, "t = b - a;");
+        break;
+    default:
+        /* ADC, and SBC and RSC as an ADC of the operands arm_add_with_carry gets */
+        if(di->op == OP_SBC) {
+            arm_aot_line(out, d, "b = ~b;");
+        } else if(di->op == OP_RSC) {
+            arm_aot_line(out, d, "t = a;");
+            arm_aot_line(out, d, "a = b;");
+            arm_aot_line(out, d, "b = ~t;");
+        }
+        arm_aot_line(out, d, "w = (unsigned long long) a + b + c;");
+        arm_aot_line(out, d, "t = (unsigned int) w;");
+        break;
+    }
+
+    if(flags) {
+
+        arm_aot_line(out, d, "n = t >> 31;");
+        arm_aot_line(out, d, "z = t == 0;");
+
+        if(logic) {
+            arm_aot_line(out, d, "c = sc;");
+        } else if(di->op == OP_ADD || di->op == OP_CMN) {
+            arm_aot_line(out, d, "c = t < a;");
+            arm_aot_line(out, d, "v = (~(a ^ b) & (a ^ t)) >> 31;");
+        } else if(di->op == OP_SUB || di->op == OP_CMP) {
+            arm_aot_line(out, d, "c = a >= b;");
+            arm_aot_line(out, d, "v = ((a ^ b) & (a ^ t)) >> 31;");
+        } else if(di->op == OP_RSB) {
+            arm_aot_line(out, d, "c = b >= a;");
+            arm_aot_line(out, d, "v = ((b ^ a) & (b ^ t)) >> 31;");
+        } else {
+            arm_aot_line(out, d, "c = (unsigned int) (w >> 32);");
+            arm_aot_line(out, d, "v = (~(a ^ b) & (a ^ t)) >> 31;");
+        }
+
+    }
+
+    if(compare) {
+        return;
+    }
+
+    if(di->rd == PC) {
+        arm_aot_line(out, d, "pc = t;");
+        arm_aot_line(out, d, "goto jump;");
+    } else {
+        arm_aot_line(out, d, "r%u = t;", di->rd);
+    }
+
+}
+
+/* The multiplies and divides, which read their registers raw like their handlers */
+static void arm_aot_emit_multiply(FILE *out, int d, struct arm_decoded *di) {
+
+    char x[16], y[16], s[16];
+
+    arm_aot_raw(x, di, di->rm);
+    arm_aot_raw(y, di, di->rs);
+
+    switch(di->op) {
+
+    case OP_MUL:
+    case OP_MLA:
+        if(di->op == OP_MUL) {
+            arm_aot_line(out, d, "t = %s * %s;", x, y);
+        } else {
+            arm_aot_line(out, d, "t = %s * %s + %s;", x, y, arm_aot_raw(s, di, di->rn));
+        }
+        if(di->setflags) {
+            arm_aot_line(out, d, "n = t >> 31;");
+            arm_aot_line(out, d, "z = t == 0;");
+        }
+        arm_aot_line(out, d, "r%u = t;", di->rd);
+        break;
+
+    case OP_SDIV:
+    case OP_UDIV:
+        arm_aot_line(out, d, "a = %s;", arm_aot_raw(s, di, di->rn));
+        arm_aot_line(out, d, "b = %s;", x);
+        if(di->op == OP_SDIV) {
+            arm_aot_line(out, d, "t = b == 0 ? 0 : b == 0xFFFFFFFFu ? -a : (unsigned int) ((int) a / (int) b);");
+        } else {
+            arm_aot_line(out, d, "t = b == 0 ? 0 : a / b;");
+        }
+        arm_aot_line(out, d, "r%u = t;", di->rd);
+        break;
+
+    default:
+        if(di->op == OP_UMULL || di->op == OP_UMLAL) {
+            arm_aot_line(out, d, "w = (unsigned long long) %s * %s;", x, y);
+        } else {
+            arm_aot_line(out, d, "w = (unsigned long long) ((long long) (int) %s * (int) %s);", x, y);
+        }
+        if(di->op == OP_UMLAL || di->op == OP_SMLAL) {
+            arm_aot_raw(x, di, di->rd);
+            arm_aot_line(out, d, "w += (unsigned long long) %s << 32 | %s;", x, arm_aot_raw(y, di, di->rn));
+        }
+        if(di->setflags) {
+            arm_aot_line(out, d, "n = (unsigned int) (w >> 63);");
+            arm_aot_line(out, d, "z = w == 0;");
+        }
+        arm_aot_line(out, d, "r%u = (unsigned int) w;", di->rn);
+        arm_aot_line(out, d, "r%u = (unsigned int) (w >> 32);", di->rd);
+        break;
+
+    }
+
+}
+
+/* Single register loads and stores, see arm_transfer */
+static void arm_aot_emit_transfer(FILE *out, int d, struct arm_decoded *di) {
+
+    const char *addr = di->index == INDEX_POST ? "a" : "t";
+    char x[16];
+
+    arm_aot_line(out, d, "a = %s;", arm_aot_reg(x, di, di->rn));
+
+    if(di->form == OPND_IMM) {
+        arm_aot_line(out, d, "b = 0x%08xu;", di->imm);
+    } else {
+        if(di->form == OPND_REG) {
+            arm_aot_line(out, d, "b = %s;", arm_aot_reg(x, di, di->rm));
+        } else {
+            arm_aot_emit_shift(out, d, arm_aot_reg(x, di, di->rm), di->shift_type, di->shift_amount, false);
+        }
+        if(di->imm != 0) {
+            arm_aot_line(out, d, "b = -b;");
+        }
+    }
+    arm_aot_line(out, d, "t = a + b;");
+
+    if(arm_op_load(di->op)) {
+
+        arm_aot_line(out, d, "if(!aot_load(cpu, 0x%08xu, %s, %u, &y)) {", di->pc, addr, arm_op_size(di->op));
+        arm_aot_line(out, d + 1, "goto fault;");
+        arm_aot_line(out, d, "}");
+        if(di->op == OP_LDRSB) {
+            arm_aot_line(out, d, "y = (unsigned int) (signed char) y;");
+        } else if(di->op == OP_LDRSH) {
+            arm_aot_line(out, d, "y = (unsigned int) (short) y;");
+        }
+
+        if(di->index != INDEX_OFFSET) {
+            arm_aot_line(out, d, "r%u = t;", di->rn);
+        }
+        if(di->rd == PC) {
+            arm_aot_line(out, d, "pc = y;");
+            arm_aot_line(out, d, "goto jump;");
+        } else {
+            arm_aot_line(out, d, "r%u = y;", di->rd);
+        }
+
+    } else {
+
+        arm_aot_line(out, d, "if(!aot_store(cpu, 0x%08xu, %s, %u, %s)) {", di->pc, addr,
+                     arm_op_size(di->op), arm_aot_reg(x, di, di->rd));
+        arm_aot_line(out, d + 1, "goto fault;");
+        arm_aot_line(out, d, "}");
+
+        if(di->index != INDEX_OFFSET) {
+            arm_aot_line(out, d, "r%u = t;", di->rn);
+        }
+
+    }
+
+}
+
+/* LDM and STM. x is the lowest address and t what Rn becomes with writeback */
+static void arm_aot_emit_multiple(FILE *out, int d, struct arm_decoded *di) {
+
+    unsigned int size = 4 * di->shift_amount;
+    int r, i;
+    char x[16];
+
+    arm_aot_line(out, d, "a = r%u;", di->rn);
+
+    switch(di->shift_type) {
+    case MULTIPLE_DA:
+        arm_aot_line(out, d, "x = a - %u;", size - 4);
+        arm_aot_line(out, d, "t = a - %u;", size);
+        break;
+    case MULTIPLE_IA:
+        arm_aot_line(out, d, "x = a;");
+        arm_aot_line(out, d, "t = a + %u;", size);
+        break;
+    case MULTIPLE_DB:
+        arm_aot_line(out, d, "x = a - %u;", size);
+        arm_aot_line(out, d, "t = a - %u;", size);
+        break;
+    default:
+        arm_aot_line(out, d, "x = a + 4;");
+        arm_aot_line(out, d, "t = a + %u;", size);
+        break;
+    }
+
+    /* All the words are read before any register is written */
+    for(r = 0, i = 0; r < NREGS; r++) {
+
+        if(!(di->imm & (1 << r))) {
+            continue;
+        }
+
+        if(di->op == OP_LDM) {
+            arm_aot_line(out, d, "if(!aot_load(cpu, 0x%08xu, x + %d, 4, &m[%d])) {", di->pc, 4 * i, i);
+        } else {
+            arm_aot_line(out, d, "if(!aot_store(cpu, 0x%08xu, x + %d, 4, %s)) {", di->pc, 4 * i,
+                         arm_aot_reg(x, di, r));
+        }
+        arm_aot_line(out, d + 1, "goto fault;");
+        arm_aot_line(out, d, "}");
+        i++;
+
+    }
+
+    if(di->writeback) {
+        arm_aot_line(out, d, "r%u = t;", di->rn);
+    }
+
+    if(di->op == OP_STM) {
+        return;
+    }
+
+    for(r = 0, i = 0; r < NREGS; r++) {
+        if(di->imm & (1 << r)) {
+            if(r == PC) {
+                arm_aot_line(out, d, "pc = m[%d];", i);
+            } else {
+                arm_aot_line(out, d, "r%u = m[%d];", r, i);
+            }
+            i++;
+        }
+    }
+
+    if(di->imm & (1 << PC)) {
+        arm_aot_line(out, d, "goto jump;");
+    }
+
+}
+
+/* A BL. A translated callee is a C call, which carries on after the BL
+when it returns and leaves this function too when it does not */
+static void arm_aot_emit_call(FILE *out, int d, struct arm_aot_gen *g, struct arm_decoded *di) {
+
+    unsigned int target = di->pc + di->imm;
+
+    arm_aot_line(out, d, "r14 = 0x%08xu;", di->pc + 4);
+
+    if(arm_aot_function(g, target) == NULL) {
+        arm_aot_line(out, d, "pc = 0x%08xu;", target);
+        arm_aot_line(out, d, "goto exit;");
+        return;
+    }
+
+    arm_aot_line(out, d, "if(cpu->depth >= ARM_AOT_DEPTH) {");
+    arm_aot_line(out, d + 1, "pc = 0x%08xu;", target);
+    arm_aot_line(out, d + 1, "goto exit;");
+    arm_aot_line(out, d, "}");
+    arm_aot_line(out, d, "AOT_SPILL();");
+    arm_aot_line(out, d, "cpu->depth++;");
+    arm_aot_line(out, d, "rv = aot_%08x(cpu);", target);
+    arm_aot_line(out, d, "cpu->depth--;");
+    arm_aot_line(out, d, "if(rv != ARM_AOT_RETURN) {");
+    arm_aot_line(out, d + 1, "return rv;");
+    arm_aot_line(out, d, "}");
+    arm_aot_line(out, d, "AOT_FILL();");
+
+}
+
+/* The C for one instruction of f. It counts like the handler does, then
+runs under its condition */
+static void arm_aot_emit_insn(FILE *out, struct arm_aot_gen *g, struct arm_aot_function *f,
+                              struct arm_decoded *di) {
+
+    int d = di->cond == COND_AL ? 1 : 2;
+    char x[16];
+
+    arm_aot_line(out, 1, "/* %08x: %08x */", di->pc, di->iw);
+
+    if(!arm_aot_supported(di)) {
+        arm_aot_line(out, 1, "pc = 0x%08xu;", di->pc);
+        arm_aot_line(out, 1, "goto exit;");
+        return;
+    }
+
+    if(di->op == OP_B || di->op == OP_BL || di->op == OP_BX) {
+        arm_aot_line(out, 1, "ni++;");
+        arm_aot_line(out, 1, "nb++;");
+    } else if(arm_op_transfer(di->op) || di->op == OP_LDM || di->op == OP_STM) {
+        arm_aot_line(out, 1, "ni++;");
+        arm_aot_line(out, 1, "nm++;");
+    } else {
+        arm_aot_line(out, 1, "ni++;");
+        arm_aot_line(out, 1, "nd++;");
+    }
+
+    if(d == 2) {
+        arm_aot_line(out, 1, "if(%s) {", arm_aot_conds[di->cond]);
+    }
+
+    if(di->op == OP_B) {
+        arm_aot_emit_goto(out, d, f, di->pc + di->imm);
+    } else if(di->op == OP_BL) {
+        arm_aot_emit_call(out, d, g, di);
+    } else if(di->op == OP_BX) {
+        arm_aot_line(out, d, "pc = %s;", arm_aot_raw(x, di, di->rm));
+        arm_aot_line(out, d, "goto jump;");
+    } else if(arm_op_transfer(di->op)) {
+        arm_aot_emit_transfer(out, d, di);
+    } else if(di->op == OP_LDM || di->op == OP_STM) {
+        arm_aot_emit_multiple(out, d, di);
+    } else if(di->op >= OP_MUL) {
+        arm_aot_emit_multiply(out, d, di);
+    } else {
+        arm_aot_emit_data(out, d, di);
+    }
+
+    if(d == 2) {
+        arm_aot_line(out, 1, "}");
+    }
+
+}
+
+/* The C function for f, aot_ and its entry in hex. The locals are loaded
+from cpu on entry and written back on the way out */
+static void arm_aot_emit_function(FILE *out, struct arm_aot_gen *g, struct arm_aot_function *f) {
+
+    struct arm_decoded *di;
+    unsigned int next[2];
+    int i, j, n;
+
+    fprintf(out, "/* %s */\n", f->name != NULL ? f->name : "(no symbol)");
+    fprintf(out, "static int aot_%08x(struct arm_aot_cpu *cpu) {\n\n", f->entry);
+    arm_aot_line(out, 1, "unsigned int *regs = cpu->regs;");
+    arm_aot_line(out, 1, "unsigned int r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14;");
+    arm_aot_line(out, 1, "unsigned int n, z, c, v, lr, pc, a, b, t, x, y, sc, m[16];");
+    arm_aot_line(out, 1, "unsigned long long w;");
+    arm_aot_line(out, 1, "int ni = 0, nd = 0, nb = 0, nm = 0, rv;");
+    fprintf(out, "\n");
+    arm_aot_line(out, 1, "AOT_FILL();");
+    arm_aot_line(out, 1, "lr = r14;");
+    fprintf(out, "\n");
+
+    for(i = 0; i < f->ninsns; i++) {
+
+        di = &f->insns[i].di;
+
+        if(f->insns[i].label) {
+            fprintf(out, "L_%08x:\n", di->pc);
+        }
+        arm_aot_emit_insn(out, g, f, di);
+
+        /* Falling through to an instruction that was not translated leaves */
+        n = arm_aot_next(di, next);
+        for(j = 0; j < n; j++) {
+            if(next[j] == di->pc + 4 && (i + 1 == f->ninsns || f->insns[i + 1].di.pc != next[j])) {
+                arm_aot_emit_goto(out, 1, f, next[j]);
+            }
+        }
+
+        fprintf(out, "\n");
+
+    }
+
+    fprintf(out, "exit:\n");
+    arm_aot_line(out, 1, "AOT_SPILL();");
+    arm_aot_line(out, 1, "regs[15] = pc;");
+    arm_aot_line(out, 1, "return ARM_AOT_EXIT;");
+    fprintf(out, "\njump:\n");
+    arm_aot_line(out, 1, "if(pc != lr) {");
+    arm_aot_line(out, 2, "goto exit;");
+    arm_aot_line(out, 1, "}");
+    arm_aot_line(out, 1, "AOT_SPILL();");
+    arm_aot_line(out, 1, "regs[15] = pc;");
+    arm_aot_line(out, 1, "return ARM_AOT_RETURN;");
+    fprintf(out, "\nfault:\n");
+    arm_aot_line(out, 1, "AOT_SPILL();");
+    arm_aot_line(out, 1, "return ARM_AOT_EXIT;");
+    fprintf(out, "\n}\n\n");
+
+}
+
+static int arm_aot_function_compare(const void *a, const void *b) {
+
+    unsigned int x = (*(struct arm_aot_function * const *) a)->entry;
+    unsigned int y = (*(struct arm_aot_function * const *) b)->entry;
+
+    return x < y ? -1 : x > y;
+
+}
+
+/* The words f was made from, lo up to hi. Words that could not be fetched are left out */
+static void arm_aot_range(struct arm_aot_gen *g, struct arm_aot_function *f,
+                          unsigned int *lo, unsigned int *hi) {
+
+    unsigned int iw;
+    int i;
+
+    *lo = 0xFFFFFFFF;
+    *hi = 0;
+
+    for(i = 0; i < f->ninsns; i++) {
+        if(arm_mem_fetch(g->as, f->insns[i].di.pc, &iw)) {
+            if(f->insns[i].di.pc < *lo) {
+                *lo = f->insns[i].di.pc;
+            }
+            if(f->insns[i].di.pc + 4 > *hi) {
+                *hi = f->insns[i].di.pc + 4;
+            }
+        }
+    }
+
+    if(*lo > *hi) {
+        *lo = *hi = f->entry;
+    }
+
+}
+
+/* Writes the C for all the functions added to g, made from image, and
+the table arm_aot_execute looks them up in. Returns false if some of the
+code could not be read back for the hash */
+bool arm_aot_write(FILE *out, struct arm_aot_gen *g, const char *image) {
+
+    struct arm_aot_function *sorted[AOT_MAX_FUNCS];
+    unsigned int lo, hi, h = AOT_HASH_START;
+    bool ok = true;
+    int i;
+
+    for(i = 0; i < g->nfuncs; i++) {
+        sorted[i] = &g->funcs[i];
+    }
+    qsort(sorted, g->nfuncs, sizeof(sorted[0]), arm_aot_function_compare);
+
+    fprintf(out, "/* Generated by armemu-aot from %s, see arm_aot_execute in armemu.c */\n\n", image);
+    fputs(arm_aot_prelude, out);
+
+    for(i = 0; i < g->nfuncs; i++) {
+        fprintf(out, "static int aot_%08x(struct arm_aot_cpu *cpu);\n", sorted[i]->entry);
+    }
+    fprintf(out, "\n");
+
+    for(i = 0; i < g->nfuncs; i++) {
+        arm_aot_emit_function(out, g, sorted[i]);
+    }
+
+    fprintf(out, "const struct arm_aot_entry arm_aot_table[] = {\n");
+    for(i = 0; i < g->nfuncs; i++) {
+        arm_aot_range(g, sorted[i], &lo, &hi);
+        h = arm_aot_hash(g->as->mem, lo, hi, h, &ok);
+        fprintf(out, "    {0x%08xu, 0x%08xu, 0x%08xu, aot_%08x},\n", sorted[i]->entry, lo, hi, sorted[i]->entry);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const int arm_aot_count = %d;\n", g->nfuncs);
+    fprintf(out, "const unsigned int arm_aot_image_hash = 0x%08xu;\n", h);
+
+    return ok;
+
+}
+
+/* Frees what arm_aot_add allocated */
+void arm_aot_gen_free(struct arm_aot_gen *g) {
+
+    int i;
+
+    for(i = 0; i < g->nfuncs; i++) {
+        free(g->funcs[i].insns);
+    }
+    g->nfuncs = 0;
+
+}
+
+/* Execution trace, turned on with -r file. Traced states run through
+arm_trace_execute, the interp loop that records the PC of every
+instruction and the address and value of every load and store that
+passes its condition. The records go into chunks of a ring of
+TRACE_CHUNKS buffers, and a writer thread streams full chunks to the file
+while the guest keeps running (it only waits when the whole ring is full).
+
+A record is a varint whose low 2 bits are its kind:
+  TRACE_RUN     the next n instructions follow one another (n is v >> 2)
+  TRACE_JUMP    the next instruction is not at PC + 4, v >> 2 is the
+                difference (zigzag encoded)
+  TRACE_MEM     the access of the last instruction, the difference from
+                the last address and then a varint of the difference from
+                the last value
+  TRACE_CONTROL TRACE_CALL_START (with the 16 registers and cpsr) or
+                TRACE_CALL_END (the call returned or faulted)
+A loop body is a RUN and a JUMP plus a MEM for each access, which is a
+few bytes for many instructions. Every chunk starts with the registers,
+cpsr and index of its first instruction, and the deltas start from 0 in
+every chunk, so armtrace (see arm_trace_seek) can start replaying at the
+chunk an index is in without reading the ones before it. Chunks are
+written in host byte order. */
+
+#define TRACE_MAGIC "ARMTRC1"
+#define TRACE_CHUNK_SIZE (64 * 1024)
+#define TRACE_CHUNKS 16
+
+/* Room left in a chunk for the records of one instruction or call (an
+LDM or STM of all 16 registers is 16 MEM records of up to 10 bytes) */
+#define TRACE_MAX_RECORD 256
+
+enum arm_trace_kind {
+    TRACE_RUN,
+    TRACE_JUMP,
+    TRACE_MEM,
+    TRACE_CONTROL
+};
+
+enum arm_trace_control {
+    TRACE_CALL_START,
+    TRACE_CALL_END
+};
+
+/* The start of the file */
+struct arm_trace_header {
+
+    char magic[8];
+    char image[256];
+
+};
+
+/* The start of every chunk, followed by size bytes of records */
+struct arm_trace_chunk {
+
+    unsigned int size;
+    unsigned int count;
+    unsigned long long first;
+    unsigned int regs[NREGS];
+    unsigned int cpsr;
+
+};
+
+struct arm_trace {
+
+    FILE *f;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Chunks head - tail .. head - 1 are full and waiting for the writer,
+    chunk head is the one being filled */
+    struct arm_trace_chunk chunks[TRACE_CHUNKS];
+    unsigned char *bufs;
+    unsigned int head;
+    unsigned int tail;
+    bool closing;
+    bool error;
+
+    unsigned char *p;
+    unsigned char *end;
+    unsigned long long index;
+    unsigned long long run;
+    unsigned int next_pc;
+    unsigned int last_addr;
+    unsigned int last_value;
+
+};
+
+static inline unsigned long long trace_zigzag(int v) {
+
+    return ((unsigned int) v << 1) ^ (unsigned int) (v >> 31);
+
+}
+
+static inline int trace_unzigzag(unsigned long long v) {
+
+    return (int) ((v >> 1) ^ -(v & 1));
+
+}
+
+static inline void trace_put(struct arm_trace *t, unsigned long long v) {
+
+    while(v >= 0x80) {
+        *t->p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *t->p++ = v;
+
+}
+
+static inline void trace_flush_run(struct arm_trace *t) {
+
+    if(t->run > 0) {
+        trace_put(t, t->run << 2 | TRACE_RUN);
+        t->run = 0;
+    }
+
+}
+
+/* Opens the next chunk of the ring at the state of as (or all zeros) */
+static void arm_trace_start_chunk(struct arm_trace *t, struct arm_state *as) {
+
+    struct arm_trace_chunk *c = &t->chunks[t->head % TRACE_CHUNKS];
+
+    memset(c, 0, sizeof(struct arm_trace_chunk));
+    c->first = t->index;
+    if(as != NULL) {
+        arm_flags_nzcv(as);
+        memcpy(c->regs, as->regs, sizeof(c->regs));
+        c->cpsr = as->cpsr;
+    }
+
+    t->p = t->bufs + (t->head % TRACE_CHUNKS) * TRACE_CHUNK_SIZE;
+    t->end = t->p + TRACE_CHUNK_SIZE - TRACE_MAX_RECORD;
+    t->run = 0;
+    t->next_pc = c->regs[PC];
+    t->last_addr = 0;
+    t->last_value = 0;
+
+}
+
+/* Hands the chunk being filled to the writer thread, waiting for a free
+one if the ring is full */
+static void arm_trace_end_chunk(struct arm_trace *t) {
+
+    struct arm_trace_chunk *c = &t->chunks[t->head % TRACE_CHUNKS];
+
+    trace_flush_run(t);
+    c->size = t->p - (t->bufs + (t->head % TRACE_CHUNKS) * TRACE_CHUNK_SIZE);
+
+    pthread_mutex_lock(&t->lock);
+    t->head++;
+    pthread_cond_broadcast(&t->cond);
+    while(t->head - t->tail == TRACE_CHUNKS) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+}
+
+/* Writes a MEM record for the word value at addr */
+static inline void trace_put_mem(struct arm_trace *t, unsigned int addr, unsigned int value) {
+
+    trace_put(t, trace_zigzag(addr - t->last_addr) << 2 | TRACE_MEM);
+    trace_put(t, trace_zigzag(value - t->last_value));
+    t->last_addr = addr;
+    t->last_value = value;
+
+}
+
+/* Starts a new chunk if the one being filled has no room for another record */
+static inline void arm_trace_room(struct arm_trace *t, struct arm_state *as) {
+
+    if(t->p > t->end) {
+        arm_trace_end_chunk(t);
+        arm_trace_start_chunk(t, as);
+    }
+
+}
+
+/* Writes full chunks to the file until the trace is closed. After a
+failed write chunks are still taken off the ring (and dropped), so the
+guest is never stuck waiting */
+static void *arm_trace_writer(void *arg) {
+
+    struct arm_trace *t = (struct arm_trace *) arg;
+    struct arm_trace_chunk *c;
+    unsigned char *buf;
+
+    pthread_mutex_lock(&t->lock);
+
+    for(;;) {
+
+        while(t->tail == t->head && !t->closing) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if(t->tail == t->head) {
+            break;
+        }
+        pthread_mutex_unlock(&t->lock);
+
+        c = &t->chunks[t->tail % TRACE_CHUNKS];
+        buf = t->bufs + (t->tail % TRACE_CHUNKS) * TRACE_CHUNK_SIZE;
+        if(!t->error && (fwrite(c, sizeof(struct arm_trace_chunk), 1, t->f) != 1
+                         || fwrite(buf, 1, c->size, t->f) != c->size)) {
+            t->error = true;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        t->tail++;
+        pthread_cond_broadcast(&t->cond);
+
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+
+}
+
+/* Creates the trace file path for a run of image and starts the writer
+thread. Returns NULL if the file cannot be made or there is not enough memory */
+struct arm_trace *arm_trace_new(const char *path, const char *image) {
+
+    struct arm_trace *t;
+    struct arm_trace_header header;
+
+    t = (struct arm_trace *) calloc(1, sizeof(struct arm_trace));
+    if(t == NULL) {
+        return NULL;
+    }
+
+    t->bufs = (unsigned char *) malloc(TRACE_CHUNKS * TRACE_CHUNK_SIZE);
+    t->f = fopen(path, "wb");
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    snprintf(header.image, sizeof(header.image), "%s", image);
+
+    if(t->bufs == NULL || t->f == NULL || fwrite(&header, sizeof(header), 1, t->f) != 1) {
+        if(t->f != NULL) {
+            fclose(t->f);
+        }
+        free(t->bufs);
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if(pthread_create(&t->thread, NULL, arm_trace_writer, t) != 0) {
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        fclose(t->f);
+        free(t->bufs);
+        free(t);
+        return NULL;
+    }
+
+    arm_trace_start_chunk(t, NULL);
+
+    return t;
+
+}
+
+/* Writes what is left, stops the writer thread and closes the file.
+Returns -1 if any of the trace could not be written */
+int arm_trace_close(struct arm_trace *t) {
+
+    int rv;
+
+    if(t->p != t->bufs + (t->head % TRACE_CHUNKS) * TRACE_CHUNK_SIZE || t->run > 0) {
+        arm_trace_end_chunk(t);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    t->closing = true;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+
+    rv = t->error ? -1 : 0;
+    if(fclose(t->f) != 0) {
+        rv = -1;
+    }
+
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t->bufs);
+    free(t);
+
+    return rv;
+
+}
+
+/* Runs as like the interp engine, recording every instruction in as->trace */
+unsigned int arm_trace_execute(struct arm_state *as) {
+
+    struct arm_trace *t = as->trace;
+    struct arm_decoded *di;
+    unsigned int pc, addr = 0, value = 0, wb, values[NREGS];
+    bool mem, multiple;
+    int i, r;
+
+    arm_trace_room(t, as);
+    trace_flush_run(t);
+    arm_flags_nzcv(as);
+    trace_put(t, TRACE_CALL_START << 2 | TRACE_CONTROL);
+    for(i = 0; i < NREGS; i++) {
+        trace_put(t, as->regs[i]);
+    }
+    trace_put(t, as->cpsr);
+    t->next_pc = as->regs[PC];
+
+    while(as->regs[PC] != 0) {
+
+        pc = as->regs[PC];
+        di = arm_dcache_lookup(as, pc);
+
+        arm_trace_room(t, as);
+        if(pc != t->next_pc) {
+            trace_flush_run(t);
+            trace_put(t, trace_zigzag(pc - t->next_pc) << 2 | TRACE_JUMP);
+        }
+        t->run++;
+        t->next_pc = pc + 4;
+        t->chunks[t->head % TRACE_CHUNKS].count++;
+        t->index++;
+
+        mem = arm_op_transfer(di->op) && is_valid(as, di->cond);
+        multiple = (di->op == OP_LDM || di->op == OP_STM) && is_valid(as, di->cond);
+        if(mem) {
+            /* A store's record has the bytes it wrote, a load's the value of Rd */
+            addr = arm_transfer_addr(as, di, &wb);
+            value = arm_reg(as, di, di->rd);
+            if(arm_op_size(di->op) != 4) {
+                value &= (1 << (8 * arm_op_size(di->op))) - 1;
+            }
+        } else if(multiple) {
+            addr = arm_multiple_addr(as, di, &wb);
+            for(r = 0, i = 0; i < di->shift_amount; r++) {
+                if(di->imm & (1 << r)) {
+                    values[i++] = arm_reg(as, di, r);
+                }
+            }
+        }
+
+        di->handler(as, di);
+        if(as->fault != FAULT_NONE) {
+            break;
+        }
+
+        if(mem) {
+            if(arm_op_load(di->op)) {
+                value = as->regs[di->rd];
+            }
+            trace_flush_run(t);
+            trace_put_mem(t, addr, value);
+        } else if(multiple) {
+
+            /* One MEM record a word, the loaded values are the registers now */
+            trace_flush_run(t);
+            for(r = 0, i = 0; i < di->shift_amount; r++) {
+                if(di->imm & (1 << r)) {
+                    trace_put_mem(t, addr + 4 * i, di->op == OP_LDM ? as->regs[r] : values[i]);
+                    i++;
+                }
+            }
+
+        }
+
+    }
+
+    trace_flush_run(t);
+    trace_put(t, TRACE_CALL_END << 2 | TRACE_CONTROL);
+
+    return as->regs[0];
+
+}
+
+/* Reads a trace back one chunk at a time (see armtrace) */
+struct arm_trace_reader {
+
+    FILE *f;
+    struct arm_trace_header header;
+    struct arm_trace_chunk chunk;
+    unsigned char *buf;
+    unsigned char *p;
+    unsigned char *end;
+
+    /* Index of the next instruction and the state of the decoder */
+    unsigned long long index;
+    unsigned long long run;
+    unsigned int next_pc;
+    unsigned int last_addr;
+    unsigned int last_value;
+
+};
+
+/* Opens the trace file path. Returns NULL and sets *error if it cannot be read */
+struct arm_trace_reader *arm_trace_open(const char *path, const char **error) {
+
+    struct arm_trace_reader *r;
+
+    r = (struct arm_trace_reader *) calloc(1, sizeof(struct arm_trace_reader));
+    if(r == NULL) {
+        *error = "not enough memory";
+        return NULL;
+    }
+
+    r->buf = (unsigned char *) malloc(TRACE_CHUNK_SIZE);
+    r->f = fopen(path, "rb");
+    if(r->buf == NULL || r->f == NULL) {
+        *error = r->buf == NULL ? "not enough memory" : "cannot open the file";
+    } else if(fread(&r->header, sizeof(r->header), 1, r->f) != 1
+              || memcmp(r->header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        *error = "not a trace";
+    } else {
+        r->header.image[sizeof(r->header.image) - 1] = '\0';
+        return r;
+    }
+
+    if(r->f != NULL) {
+        fclose(r->f);
+    }
+    free(r->buf);
+    free(r);
+
+    return NULL;
+
+}
+
+void arm_trace_reader_free(struct arm_trace_reader *r) {
+
+    fclose(r->f);
+    free(r->buf);
+    free(r);
+
+}
+
+/* Reads the header of the next chunk. Returns false at the end of the file */
+static bool arm_trace_next_header(struct arm_trace_reader *r) {
+
+    return fread(&r->chunk, sizeof(struct arm_trace_chunk), 1, r->f) == 1
+           && r->chunk.size <= TRACE_CHUNK_SIZE;
+
+}
+
+/* Reads the records of the chunk whose header was just read and puts its
+first state in as */
+static bool arm_trace_load_chunk(struct arm_trace_reader *r, struct arm_state *as) {
+
+    if(fread(r->buf, 1, r->chunk.size, r->f) != r->chunk.size) {
+        return false;
+    }
+
+    r->p = r->buf;
+    r->end = r->buf + r->chunk.size;
+    r->index = r->chunk.first;
+    r->run = 0;
+    r->next_pc = r->chunk.regs[PC];
+    r->last_addr = 0;
+    r->last_value = 0;
+
+    memcpy(as->regs, r->chunk.regs, sizeof(as->regs));
+    as->cpsr = r->chunk.cpsr;
+    as->flag_op = FLAGS_NONE;
+
+    return true;
+
+}
+
+/* Goes to the chunk instruction index is in and puts its first state in
+as. Returns false if the trace has fewer instructions */
+bool arm_trace_seek(struct arm_trace_reader *r, struct arm_state *as, unsigned long long index) {
+
+    fseek(r->f, sizeof(struct arm_trace_header), SEEK_SET);
+
+    while(arm_trace_next_header(r)) {
+        if(index < r->chunk.first + r->chunk.count) {
+            return arm_trace_load_chunk(r, as);
+        }
+        if(fseek(r->f, r->chunk.size, SEEK_CUR) != 0) {
+            break;
+        }
+    }
+
+    return false;
+
+}
+
+static bool trace_get(struct arm_trace_reader *r, unsigned long long *v) {
+
+    int shift = 0;
+
+    *v = 0;
+    while(r->p < r->end && shift < 64) {
+        *v |= (unsigned long long) (*r->p & 0x7F) << shift;
+        if(!(*r->p++ & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+
+    return false;
+
+}
+
+/* Reads records up to the next instruction of the chunk and returns its
+PC in *pc, starting a call in as if the records say so. Returns false at
+the end of the chunk or if the records are bad */
+bool arm_trace_fetch(struct arm_trace_reader *r, struct arm_state *as, unsigned int *pc) {
+
+    unsigned long long v;
+    int i;
+
+    while(r->run == 0) {
+
+        if(!trace_get(r, &v)) {
+            return false;
+        }
+
+        switch(v & 3) {
+
+        case TRACE_RUN:
+            r->run = v >> 2;
+            break;
+
+        case TRACE_JUMP:
+            r->next_pc += trace_unzigzag(v >> 2);
+            break;
+
+        case TRACE_CONTROL:
+            if((v >> 2) == TRACE_CALL_START) {
+                for(i = 0; i < NREGS; i++) {
+                    if(!trace_get(r, &v)) {
+                        return false;
+                    }
+                    as->regs[i] = v;
+                }
+                if(!trace_get(r, &v)) {
+                    return false;
+                }
+                as->cpsr = v;
+                as->flag_op = FLAGS_NONE;
+                as->fault = FAULT_NONE;
+                r->next_pc = as->regs[PC];
+            }
+            break;
+
+        default:
+            return false;
+
+        }
+
+    }
+
+    *pc = r->next_pc;
+
+    return true;
+
+}
+
+/* Reads the next MEM record into r->last_addr and r->last_value. Sets
+*end and returns true if the call ended there instead, which is a fault */
+static bool arm_trace_get_mem(struct arm_trace_reader *r, bool *end) {
+
+    unsigned long long v;
+
+    *end = false;
+    if(!trace_get(r, &v)) {
+        return false;
+    }
+    if(v == (TRACE_CALL_END << 2 | TRACE_CONTROL)) {
+        *end = true;
+        return true;
+    }
+    if((v & 3) != TRACE_MEM) {
+        return false;
+    }
+    r->last_addr += trace_unzigzag(v >> 2);
+    if(!trace_get(r, &v)) {
+        return false;
+    }
+    r->last_value += trace_unzigzag(v);
+
+    return true;
+
+}
+
+/* Runs LDM or STM di (which passes its condition) with the words in the
+trace, one MEM record each. A fault can end the call at any word */
+static bool arm_trace_step_multiple(struct arm_trace_reader *r, struct arm_state *as,
+                                    struct arm_decoded *di) {
+
+    unsigned int values[NREGS], addr, wb;
+    int reg, n;
+    bool end;
+
+    addr = arm_multiple_addr(as, di, &wb);
+
+    for(n = 0; n < di->shift_amount; n++) {
+        if(!arm_trace_get_mem(r, &end)) {
+            return false;
+        }
+        if(end) {
+            arm_fault(as, di->op == OP_LDM ? FAULT_READ : FAULT_WRITE, addr + 4 * n);
+            return true;
+        }
+        if(r->last_addr != addr + 4 * n) {
+            return false;
+        }
+        values[n] = r->last_value;
+    }
+
+    as->num_instr++;
+    as->mem_instr++;
+    if(di->writeback) {
+        as->regs[di->rn] = wb;
+    }
+    as->regs[PC] += 4;
+    for(reg = 0, n = 0; n < di->shift_amount && di->op == OP_LDM; reg++) {
+        if(di->imm & (1 << reg)) {
+            as->regs[reg] = values[n++];
+        }
+    }
+
+    return true;
+
+}
+
+/* Runs the instruction at pc (from arm_trace_fetch) on as with the value
+of a load taken from the trace (already sign extended). Returns false if
+the trace does not match what the instruction does, ex. it was made with
+another image */
+bool arm_trace_step(struct arm_trace_reader *r, struct arm_state *as, unsigned int pc) {
+
+    struct arm_decoded *di;
+    unsigned int addr, wb;
+    bool end;
+
+    if(as->regs[PC] != pc) {
+        return false;
+    }
+
+    r->run--;
+    r->next_pc = pc + 4;
+    r->index++;
+
+    di = arm_dcache_lookup(as, pc);
+    if((di->op == OP_LDM || di->op == OP_STM) && is_valid(as, di->cond)) {
+        return arm_trace_step_multiple(r, as, di);
+    }
+    if(!arm_op_transfer(di->op) || !is_valid(as, di->cond)) {
+        di->handler(as, di);
+        return true;
+    }
+    addr = arm_transfer_addr(as, di, &wb);
+
+    if(!arm_trace_get_mem(r, &end)) {
+        return false;
+    }
+
+    /* The access faulted, which ended the call. An unaligned access that
+    crosses into a page it may not use faults at a later byte, the trace
+    does not say which */
+    if(end) {
+        arm_fault(as, arm_op_load(di->op) ? FAULT_READ : FAULT_WRITE, addr);
+        return true;
+    }
+
+    if(r->last_addr != addr) {
+        return false;
+    }
+
+    as->num_instr++;
+    as->mem_instr++;
+    if(di->writeback) {
+        as->regs[di->rn] = wb;
+    }
+    if(arm_op_load(di->op)) {
+        as->regs[di->rd] = r->last_value;
+    }
+    if(!arm_op_load(di->op) || di->rd != PC) {
+        as->regs[PC] += 4;
+    }
+
+    return true;
+
+}
+
+/* Runs the function with the engine selected in as->engine and returns r0.
+The lockstep engine needs many calls at once (see arm_batch_run), so a
+single call with it runs on interp */
+unsigned int arm_state_execute(struct arm_state *as) {
+
+    arm_code_sync(as);
+
+#ifdef ARM_PROFILE
+    if(as->prof != NULL) {
+        return arm_prof_execute(as);
+    }
+#endif
+
+    if(as->timing != NULL) {
+        return arm_timing_execute(as);
+    }
+
+    if(as->trace != NULL) {
+        return arm_trace_execute(as);
+    }
+
+    if(as->memo != NULL) {
+        return arm_memo_execute(as);
+    }
+
+#ifdef ARM_AOT
+    if(as->aot) {
+        return arm_aot_execute(as);
+    }
+#endif
+
+    if(as->engine == ENGINE_THREADED) {
+        return arm_state_execute_threaded(as);
+    }
+
+    if(as->engine == ENGINE_BLOCK || as->engine == ENGINE_JIT) {
+        return arm_state_execute_block(as);
+    }
+
+    return arm_state_execute_interp(as);
+}
+
+/* Applies the command line settings to a new arm_state */
+void arm_state_config(struct arm_state *as, struct arm_config *cfg) {
+
+    as->engine = cfg->engine;
+    as->jit_threshold = cfg->jit_threshold;
+    as->idioms = cfg->idioms;
+
+    /* Timed, traced and memoised states always run one instruction at a time */
+    as->timing = cfg->timing;
+    as->trace = cfg->trace;
+    as->memo = cfg->memo;
+    if(as->timing != NULL || as->trace != NULL || as->memo != NULL) {
+        as->engine = ENGINE_INTERP;
+    }
+
+#ifdef ARM_AOT
+    as->aot = cfg->aot;
+#endif
+
+#ifdef ARM_PROFILE
+    /* Profiled states always run one instruction at a time */
+    as->prof = cfg->prof;
+    if(as->prof != NULL) {
+        as->engine = ENGINE_INTERP;
+    }
+#endif
+
+}
+
+/* Runs as for at most max instructions and says why it stopped. A word
+that could not be decoded stops the guest with FAULT_UNDEFINED. After
+RUN_BUDGET it can be run again from where it is. The block and jit engines
+run blocks that fit in what is left of the budget and the rest one
+instruction at a time (the jit engine without its compiled code), the
+other engines run on interp. The profiler, timing model, trace, memo and
+translated code are not used, they only work on whole calls with
+arm_state_execute */
+enum arm_run_status arm_state_run(struct arm_state *as, long long max) {
+
+    struct arm_decoded *di;
+    long long left = max;
+
+    arm_code_sync(as);
+
+    if((as->engine == ENGINE_BLOCK || as->engine == ENGINE_JIT) && arm_block_setup(as)) {
+        arm_block_loop(as, true, &left);
+    }
+
+    while(as->regs[PC] != 0 && left > 0) {
+
+        di = arm_dcache_lookup(as, as->regs[PC]);
+        if(di->handler == execute_unknown_instruction) {
+            arm_fault(as, FAULT_UNDEFINED, as->regs[PC]);
+            break;
+        }
+
+        di->handler(as, di);
+        left--;
+
+    }
+
+    if(as->fault != FAULT_NONE) {
+        return RUN_FAULT;
+    }
+
+    return as->regs[PC] == 0 ? RUN_DONE : RUN_BUDGET;
+
+}
+
+/* Cooperative scheduler. Many guest calls (tasks) take turns on one host
+thread, each running for a quantum of instructions with arm_state_run
+before going to the back of the queue of its level. Level 0 runs first: a
+level only gets a turn when all the levels above it are empty. A task
+with a limit is stopped once it has run that many instructions in all, so
+a guest that loops forever only costs its limit */
+
+/* A call run by arm_sched. The caller owns it and fills in as, level,
+limit and data (arm_sched_add does the rest) */
+struct arm_sched_task {
+
+    struct arm_state *as;
+    int level;
+
+    /* Most instructions the task can run, 0 for no limit, and how many it has run */
+    long long limit;
+    long long used;
+
+    enum arm_run_status status;
+    void *data;
+
+    struct arm_sched_task *next;
+
+};
+
+struct arm_sched {
+
+    struct arm_sched_task *head[SCHED_LEVELS];
+    struct arm_sched_task *tail[SCHED_LEVELS];
+
+    /* Instructions a task of each level runs per turn */
+    long long quantum[SCHED_LEVELS];
+
+    int ntasks;
+    long long slices;
+
+};
+
+/* Empties s and gives every level the same quantum */
+void arm_sched_init(struct arm_sched *s, long long quantum) {
+
+    int i;
+
+    for(i = 0; i < SCHED_LEVELS; i++) {
+        s->head[i] = NULL;
+        s->tail[i] = NULL;
+        s->quantum[i] = quantum;
+    }
+
+    s->ntasks = 0;
+    s->slices = 0;
+
+}
+
+/* Puts t at the back of the queue of its level */
+static void arm_sched_queue(struct arm_sched *s, struct arm_sched_task *t) {
+
+    t->next = NULL;
+
+    if(s->tail[t->level] == NULL) {
+        s->head[t->level] = t;
+    } else {
+        s->tail[t->level]->next = t;
+    }
+    s->tail[t->level] = t;
+
+}
+
+/* Adds t (whose state is about to call the guest) to s. A level out of range is
+taken as the lowest */
+void arm_sched_add(struct arm_sched *s, struct arm_sched_task *t) {
+
+    if(t->level < 0 || t->level >= SCHED_LEVELS) {
+        t->level = SCHED_LEVELS - 1;
+    }
+
+    t->used = 0;
+    t->status = RUN_BUDGET;
+    s->ntasks++;
+
+    arm_sched_queue(s, t);
+
+}
+
+/* Runs turns until a task is over and returns it, with t->status RUN_DONE,
+RUN_FAULT or RUN_BUDGET (it reached its limit). Returns NULL when there
+are no tasks left */
+struct arm_sched_task *arm_sched_next(struct arm_sched *s) {
+
+    struct arm_sched_task *t;
+    long long slice;
+    int level;
+
+    while(s->ntasks > 0) {
+
+        for(level = 0; s->head[level] == NULL; level++) {
+        }
+
+        t = s->head[level];
+        s->head[level] = t->next;
+        if(s->head[level] == NULL) {
+            s->tail[level] = NULL;
+        }
+
+        slice = s->quantum[level];
+        if(t->limit > 0 && t->limit - t->used < slice) {
+            slice = t->limit - t->used;
+        }
+
+        t->status = arm_state_run(t->as, slice);
+        t->used += slice;
+        s->slices++;
+
+        if(t->status != RUN_BUDGET || (t->limit > 0 && t->used >= t->limit)) {
+            s->ntasks--;
+            return t;
+        }
+
+        arm_sched_queue(s, t);
+
+    }
+
+    return NULL;
+
+}
+
+/* A fixed number of states made up front. The states, their stacks and
+their decode caches are three allocations for the whole pool, and a state
+that is given back keeps its caches, so getting one does not allocate or
+touch new pages. A pool is not thread safe, each thread needs its own */
+struct arm_pool {
+
+    struct arm_state *states;
+    unsigned char *stacks;
+    struct arm_decoded *dcaches;
+
+    struct arm_state **free_states;
+    int nfree;
+    int size;
+    unsigned int stack_size;
+
+};
+
+/* Frees the pool and all its states, including ones not given back */
+void arm_pool_free(struct arm_pool *pool) {
+
+    int i;
+
+    for(i = 0; i < pool->size; i++) {
+        arm_mem_unmap(pool->states[i].mem, pool->states[i].stack_addr, pool->stack_size);
+        arm_state_free_bcache(&pool->states[i]);
+    }
+
+    free(pool->states);
+    free(pool->stacks);
+    free(pool->dcaches);
+    free(pool->free_states);
+    free(pool);
+
+}
+
+/* Makes a pool of size states running in mem, with stack_size byte stacks
+and the settings in cfg. Returns NULL if there is not enough memory */
+struct arm_pool *arm_pool_new(struct arm_mem *mem, int size, unsigned int stack_size,
+                              struct arm_config *cfg) {
+
+    struct arm_pool *pool;
+    int i;
+
+    pool = (struct arm_pool *) calloc(1, sizeof(struct arm_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->size = size;
+    pool->stack_size = stack_size;
+    pool->states = (struct arm_state *) calloc(size, sizeof(struct arm_state));
+    if(posix_memalign((void **) &pool->stacks, ARM_PAGE_SIZE,
+                      (size_t) size * ARM_PAGE_ROUND(stack_size)) != 0) {
+        pool->stacks = NULL;
+    }
+    pool->dcaches = (struct arm_decoded *) calloc((size_t) size * DCACHE_SIZE, sizeof(struct arm_decoded));
+    pool->free_states = (struct arm_state **) malloc(size * sizeof(struct arm_state *));
+
+    if (pool->states == NULL || pool->stacks == NULL || pool->dcaches == NULL
+        || pool->free_states == NULL) {
+        free(pool->states);
+        free(pool->stacks);
+        free(pool->dcaches);
+        free(pool->free_states);
+        free(pool);
+        return NULL;
+    }
+
+    for(i = 0; i < size; i++) {
+
+        if(arm_state_init(&pool->states[i], mem, pool->stacks + (size_t) i * ARM_PAGE_ROUND(stack_size),
+                          stack_size, &pool->dcaches[(size_t) i * DCACHE_SIZE]) != 0) {
+            pool->size = i;
+            arm_pool_free(pool);
+            return NULL;
+        }
+
+        arm_state_config(&pool->states[i], cfg);
+        pool->free_states[i] = &pool->states[size - 1 - i];
+
+    }
+
+    pool->nfree = size;
+
+    return pool;
+
+}
+
+/* Takes a state from the pool and sets it up to call func (see
+arm_state_reset). Returns NULL if every state is in use */
+struct arm_state *arm_pool_get(struct arm_pool *pool, unsigned int func,
+                               unsigned int arg0, unsigned int arg1,
+                               unsigned int arg2, unsigned int arg3) {
+
+    struct arm_state *as;
+
+    if(pool->nfree == 0) {
+        return NULL;
+    }
+
+    as = pool->free_states[--pool->nfree];
+    arm_state_reset(as, func, arg0, arg1, arg2, arg3);
+
+    return as;
+
+}
+
+/* Gives a state from arm_pool_get back to the pool. Its registers and
+counters can still be read until the pool hands it out again */
+void arm_pool_put(struct arm_pool *pool, struct arm_state *as) {
+
+    pool->free_states[pool->nfree++] = as;
+
+}
+
+/* One guest call in a batch. args are r0 - r3 on entry, the rest is filled
+in by arm_batch_run */
+struct arm_job {
+
+    unsigned int args[4];
+    unsigned int result;
+
+    /* FAULT_NONE, or why the call was stopped and the address it touched */
+    unsigned int fault;
+    unsigned int fault_addr;
+
+    /* Set if the call ran out of instructions (see arm_batch_sched) */
+    bool stopped;
+
+    int num_instr;
+    int data_instr;
+    int b_instr;
+    int mem_instr;
+
+};
+
+/* Number of jobs a worker takes from its own range at a time */
+#define BATCH_CHUNK 16
+
+/* A worker owns the jobs next to end - 1. It takes chunks from the front,
+and other workers that run out steal the back half */
+struct arm_batch_worker {
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int next;
+    int end;
+
+    struct arm_state *as;
+    unsigned int lane_stack_addr;
+    struct arm_batch *batch;
+    int id;
+
+};
+
+struct arm_batch {
+
+    unsigned int func;
+    struct arm_job *jobs;
+    struct arm_batch_worker *workers;
+    int nworkers;
+    unsigned int stack_size;
+
+};
+
+#ifdef __GNUC__
+
+/* Lockstep engine. LANES calls of the same function run together, with each
+register held for all of them in one vector (register r of lane l is
+regs[r][l]). Every step picks the lowest PC of the lanes still running,
+and the instruction there runs for all the lanes at that PC at once, so
+lanes that went different ways at a branch wait and meet again when the
+others catch up. Data processing and branch instructions are done on whole
+vectors, anything else (loads, stores, register shifts) runs through the
+normal handler one lane at a time. Flags are kept worked out (NZCV in bits
+3:0 of nzcv) rather than lazy. The vectors are GCC vector extensions, build
+with -mavx2 on x86-64 to get 8 lanes in AVX2 registers */
+
+/* One vector register of lanes, 256 bits with AVX2 and 128 bits (SSE,
+NEON) otherwise */
+#ifdef __AVX2__
+#define LANES 8
+#else
+#define LANES 4
+#endif
+
+typedef unsigned int lane_u32 __attribute__((vector_size(LANES * sizeof(unsigned int))));
+typedef int lane_s32 __attribute__((vector_size(LANES * sizeof(int))));
+
+struct arm_lanes {
+
+    lane_u32 regs[NREGS];
+    lane_u32 nzcv;
+
+    lane_u32 num_instr;
+    lane_u32 data_instr;
+    lane_u32 b_instr;
+    lane_u32 mem_instr;
+
+    unsigned int fault[LANES];
+    unsigned int fault_addr[LANES];
+
+};
+
+/* For each lane, a if the lane is set in mask, else b */
+static inline lane_u32 lane_select(lane_u32 mask, lane_u32 a, lane_u32 b) {
+
+    return (mask & a) | (~mask & b);
+
+}
+
+/* Mask of the lanes whose flags pass cond */
+static inline lane_u32 lane_cond(struct arm_lanes *L, unsigned int cond) {
+
+    lane_u32 table = {0};
+
+    if(cond == COND_AL) {
+        return table - 1;
+    }
+
+    return 0 - (((table + arm_cond_table[cond]) >> L->nzcv) & 1);
+
+}
+
+/* Register r of every lane. All lanes that run an instruction are at the same
+PC, so reading PC gives the same value in each */
+static inline lane_u32 lane_reg(struct arm_lanes *L, struct arm_decoded *di, unsigned int r) {
+
+    lane_u32 v = {0};
+
+    if(r == PC) {
+        return v + (di->pc + 8);
+    }
+
+    return L->regs[r];
+
+}
+
+/* N and Z of each lane's result */
+static inline lane_u32 lane_nz(lane_u32 r) {
+
+    return ((r >> 31) << 3) | ((lane_u32) (r == 0) & 4);
+
+}
+
+/* a + b + carry_in with the NZCV it gives. Subtractions are a + ~b + 1 */
+static inline lane_u32 lane_add(lane_u32 a, lane_u32 b, lane_u32 carry_in, lane_u32 *nzcv) {
+
+    lane_u32 t, r;
+
+    t = a + b;
+    r = t + carry_in;
+
+    *nzcv = lane_nz(r) | ((((lane_u32) (t < a) | (lane_u32) (r < t)) & 1) << 1)
+            | ((~(a ^ b) & (a ^ r)) >> 31);
+
+    return r;
+
+}
+
+/* Src2 for every lane, like arm_operand2 but without register shifts.
+*carry starts as the C flag and gets the shifter carry out */
+static inline lane_u32 lane_operand2(struct arm_lanes *L, struct arm_decoded *di, lane_u32 *carry) {
+
+    lane_u32 v = {0}, c;
+    unsigned int n = di->shift_amount;
+
+    if(di->form == OPND_IMM) {
+        if(n != 0) {
+            *carry = v + (di->imm >> 31);
+        }
+        return v + di->imm;
+    }
+
+    v = lane_reg(L, di, di->rm);
+
+    if(di->form == OPND_REG) {
+        return v;
+    }
+
+    switch(di->shift_type) {
+
+    case SHIFT_LSL:
+        *carry = (v >> (32 - n)) & 1;
+        return v << n;
+
+    case SHIFT_LSR:
+        *carry = (v >> (n - 1)) & 1;
+        return n == 32 ? v & 0 : v >> n;
+
+    case SHIFT_ASR:
+        *carry = (v >> (n - 1)) & 1;
+        return (lane_u32) ((lane_s32) v >> (n == 32 ? 31 : n));
+
+    case SHIFT_ROR:
+        *carry = (v >> (n - 1)) & 1;
+        return (v >> n) | (v << (32 - n));
+
+    default:
+        c = *carry;
+        *carry = v & 1;
+        return (c << 31) | (v >> 1);
+
+    }
+
+}
+
+/* True if the lockstep engine has a vector version of di */
+static bool lane_op_native(struct arm_decoded *di) {
+
+    switch(di->op) {
+
+    case OP_UNKNOWN:
+    case OP_MUL:
+    case OP_MLA:
+    case OP_UMULL:
+    case OP_UMLAL:
+    case OP_SMULL:
+    case OP_SMLAL:
+    case OP_SDIV:
+    case OP_UDIV:
+    case OP_LDR:
+    case OP_STR:
+    case OP_LDRB:
+    case OP_STRB:
+    case OP_LDRH:
+    case OP_STRH:
+    case OP_LDRSB:
+    case OP_LDRSH:
+    case OP_LDM:
+    case OP_STM:
+        return false;
+
+    case OP_B:
+    case OP_BL:
+    case OP_BX:
+        return true;
+
+    default:
+        return di->form != OPND_SHIFT_REG;
+
+    }
+
+}
+
+/* A data processing instruction for the lanes in mask */
+static void lane_execute_dp(struct arm_lanes *L, struct arm_decoded *di, lane_u32 mask) {
+
+    lane_u32 valid, a, b, carry, c, result, nzcv, next, zero = {0};
+    bool writes;
+
+    valid = mask & lane_cond(L, di->cond);
+    c = (L->nzcv >> 1) & 1;
+    carry = c;
+
+    a = lane_reg(L, di, di->rn);
+    b = lane_operand2(L, di, &carry);
+
+    switch(di->op) {
+
+    case OP_AND:
+    case OP_TST:
+        result = a & b;
+        break;
+
+    case OP_EOR:
+    case OP_TEQ:
+        result = a ^ b;
+        break;
+
+    case OP_ORR:
+        result = a | b;
+        break;
+
+    case OP_BIC:
+        result = a & ~b;
+        break;
+
+    case OP_MOV:
+        result = b;
+        break;
+
+    case OP_MVN:
+        result = ~b;
+        break;
+
+    case OP_ADD:
+    case OP_CMN:
+        result = lane_add(a, b, zero, &nzcv);
+        break;
+
+    case OP_ADC:
+        result = lane_add(a, b, c, &nzcv);
+        break;
+
+    case OP_SUB:
+    case OP_CMP:
+        result = lane_add(a, ~b, zero + 1, &nzcv);
+        break;
+
+    case OP_RSB:
+        result = lane_add(b, ~a, zero + 1, &nzcv);
+        break;
+
+    case OP_SBC:
+        result = lane_add(a, ~b, c, &nzcv);
+        break;
+
+    default:
+        result = lane_add(b, ~a, c, &nzcv);
+        break;
+
+    }
+
+    /* Logical ops set C from the shifter and keep V */
+    if(di->op == OP_AND || di->op == OP_TST || di->op == OP_EOR || di->op == OP_TEQ
+       || di->op == OP_ORR || di->op == OP_BIC || di->op == OP_MOV || di->op == OP_MVN) {
+        nzcv = lane_nz(result) | (carry << 1) | (L->nzcv & 1);
+    }
+
+    writes = di->op != OP_TST && di->op != OP_TEQ && di->op != OP_CMP && di->op != OP_CMN;
+
+    if(di->setflags) {
+        L->nzcv = lane_select(valid, nzcv, L->nzcv);
+    }
+
+    if(writes) {
+        L->regs[di->rd] = lane_select(valid, result, L->regs[di->rd]);
+    }
+
+    L->num_instr += mask & 1;
+    L->data_instr += mask & 1;
+
+    next = zero + (di->pc + 4);
+    if(writes && di->rd == PC) {
+        mask &= ~valid;
+    }
+    L->regs[PC] = lane_select(mask, next, L->regs[PC]);
+
+}
+
+/* B, BL and BX for the lanes in mask */
+static void lane_execute_branch(struct arm_lanes *L, struct arm_decoded *di, lane_u32 mask) {
+
+    lane_u32 valid, target, zero = {0};
+
+    valid = mask & lane_cond(L, di->cond);
+
+    L->num_instr += mask & 1;
+    L->b_instr += mask & 1;
+
+    if(di->op == OP_BX) {
+        target = L->regs[di->rm];
+    } else {
+        target = zero + (di->pc + di->imm);
+    }
+
+    if(di->op == OP_BL) {
+        L->regs[LR] = lane_select(valid, zero + (di->pc + 4), L->regs[LR]);
+    }
+
+    L->regs[PC] = lane_select(valid, target, lane_select(mask, zero + (di->pc + 4), L->regs[PC]));
+
+}
+
+/* Runs di with its handler on each lane in mask in turn, using as as the
+scratch state */
+static void lane_execute_scalar(struct arm_lanes *L, struct arm_state *as,
+                                struct arm_decoded *di, lane_u32 mask) {
+
+    int l, r;
+
+    for(l = 0; l < LANES; l++) {
+
+        if(mask[l] == 0) {
+            continue;
+        }
+
+        for(r = 0; r < NREGS; r++) {
+            as->regs[r] = L->regs[r][l];
+        }
+        as->cpsr = L->nzcv[l] << 28;
+        as->flag_op = FLAGS_NONE;
+        as->num_instr = 0;
+        as->data_instr = 0;
+        as->b_instr = 0;
+        as->mem_instr = 0;
+
+        di->handler(as, di);
+
+        /* A fault ends the lane, as arm_fault left its PC at 0 */
+        if(as->fault != FAULT_NONE) {
+            L->fault[l] = as->fault;
+            L->fault_addr[l] = as->fault_addr;
+            as->fault = FAULT_NONE;
+        }
+
+        for(r = 0; r < NREGS; r++) {
+            L->regs[r][l] = as->regs[r];
+        }
+        L->nzcv[l] = arm_flags_nzcv(as);
+        L->num_instr[l] += as->num_instr;
+        L->data_instr[l] += as->data_instr;
+        L->b_instr[l] += as->b_instr;
+        L->mem_instr[l] += as->mem_instr;
+
+    }
+
+}
+
+/* Runs up to LANES jobs of func together. as supplies the decode cache and
+is the scratch state for instructions run one lane at a time. The guest
+memory at stacks holds a stack of stack_size bytes for each lane */
+void arm_lanes_run(struct arm_state *as, unsigned int stacks, unsigned int stack_size,
+                   unsigned int func, struct arm_job *jobs, int njobs) {
+
+    struct arm_lanes L;
+    struct arm_decoded *di;
+    lane_u32 mask;
+    unsigned int pc;
+    int l, r;
+
+    memset(&L, 0, sizeof(L));
+
+    for(l = 0; l < njobs && l < LANES; l++) {
+        for(r = 0; r < 4; r++) {
+            L.regs[r][l] = jobs[l].args[r];
+        }
+        L.regs[SP][l] = stacks + (l + 1) * stack_size;
+        L.regs[PC][l] = func;
+    }
+
+    while(true) {
+
+        /* Lanes that are done have PC = 0 and are never picked */
+        pc = 0;
+        for(l = 0; l < LANES; l++) {
+            if(L.regs[PC][l] != 0 && (pc == 0 || L.regs[PC][l] < pc)) {
+                pc = L.regs[PC][l];
+            }
+        }
+
+        if(pc == 0) {
+            break;
+        }
+
+        mask = (lane_u32) (L.regs[PC] == pc);
+        di = arm_dcache_lookup(as, pc);
+
+        if(!lane_op_native(di)) {
+            lane_execute_scalar(&L, as, di, mask);
+        } else if(di->op == OP_B || di->op == OP_BL || di->op == OP_BX) {
+            lane_execute_branch(&L, di, mask);
+        } else {
+            lane_execute_dp(&L, di, mask);
+        }
+
+    }
+
+    for(l = 0; l < njobs && l < LANES; l++) {
+        jobs[l].result = L.regs[0][l];
+        jobs[l].fault = L.fault[l];
+        jobs[l].fault_addr = L.fault_addr[l];
+        jobs[l].num_instr = L.num_instr[l];
+        jobs[l].data_instr = L.data_instr[l];
+        jobs[l].b_instr = L.b_instr[l];
+        jobs[l].mem_instr = L.mem_instr[l];
+    }
+
+}
+
+#else
+
+#define LANES 1
+
+/* Without vector extensions each job runs on its own */
+void arm_lanes_run(struct arm_state *as, unsigned int stacks, unsigned int stack_size,
+                   unsigned int func, struct arm_job *jobs, int njobs) {
+
+    arm_state_reset(as, func, jobs->args[0], jobs->args[1], jobs->args[2], jobs->args[3]);
+    jobs->result = arm_state_execute_interp(as);
+    jobs->fault = as->fault;
+    jobs->fault_addr = as->fault_addr;
+
+    jobs->num_instr = as->num_instr;
+    jobs->data_instr = as->data_instr;
+    jobs->b_instr = as->b_instr;
+    jobs->mem_instr = as->mem_instr;
+
+}
+
+#endif
+
+/* Runs jobs first to last - 1 on the worker's own arm_state, or LANES at a
+time with the lockstep engine */
+void arm_batch_run_jobs(struct arm_batch_worker *w, int first, int last) {
+
+    struct arm_job *job;
+    int i;
+
+    if(w->as->engine == ENGINE_LOCKSTEP) {
+        for(i = first; i < last; i += LANES) {
+            arm_lanes_run(w->as, w->lane_stack_addr, w->batch->stack_size, w->batch->func,
+                          &w->batch->jobs[i], last - i);
+        }
+        return;
+    }
+
+    for(i = first; i < last; i++) {
+
+        job = &w->batch->jobs[i];
+
+        arm_state_reset(w->as, w->batch->func, job->args[0], job->args[1], job->args[2], job->args[3]);
+        job->result = arm_state_execute(w->as);
+        job->fault = w->as->fault;
+        job->fault_addr = w->as->fault_addr;
+
+        job->num_instr = w->as->num_instr;
+        job->data_instr = w->as->data_instr;
+        job->b_instr = w->as->b_instr;
+        job->mem_instr = w->as->mem_instr;
+
+    }
+
+}
+
+/* Moves the back half of another worker's jobs to w. Returns false when
+every other worker is out of jobs too */
+bool arm_batch_steal(struct arm_batch_worker *w) {
+
+    struct arm_batch_worker *victim;
+    int i, mid, end;
+
+    for(i = 1; i < w->batch->nworkers; i++) {
+
+        victim = &w->batch->workers[(w->id + i) % w->batch->nworkers];
+
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        mid = victim->next + (end - victim->next) / 2;
+        victim->end = mid;
+        pthread_mutex_unlock(&victim->lock);
+
+        if(mid < end) {
+            pthread_mutex_lock(&w->lock);
+            w->next = mid;
+            w->end = end;
+            pthread_mutex_unlock(&w->lock);
+            return true;
+        }
+
+    }
+
+    return false;
+
+}
+
+void *arm_batch_worker_main(void *arg) {
+
+    struct arm_batch_worker *w = arg;
+    int first, last;
+
+    while(true) {
+
+        pthread_mutex_lock(&w->lock);
+        first = w->next;
+        last = first + BATCH_CHUNK < w->end ? first + BATCH_CHUNK : w->end;
+        w->next = last;
+        pthread_mutex_unlock(&w->lock);
+
+        if(first < last) {
+            arm_batch_run_jobs(w, first, last);
+        } else if(!arm_batch_steal(w)) {
+            break;
+        }
+
+    }
+
+    return NULL;
+
+}
+
+/* Calls the guest function at func in mem once for every job, spread over
+nthreads threads that each have their own arm_state (so nothing is shared
+between threads but the jobs and the guest memory, which the guest should
+only read). Results and counters are stored in the jobs, in the same order
+as the input. Returns the number of threads that ran, which is less than
+nthreads if a thread could not be started (the jobs are all run either way),
+or -1 if there is not enough memory (and no job was run) */
+int arm_batch_run(struct arm_mem *mem, unsigned int func, struct arm_job *jobs, int njobs,
+                  int nthreads, unsigned int stack_size, struct arm_config *cfg) {
+
+    struct arm_batch batch;
+    struct arm_batch_worker *w;
+    struct arm_pool *pool;
+    unsigned char *lane_stacks = NULL;
+    unsigned int lane_stack_addr = 0, lane_stack_size = LANES * stack_size;
+    int i, started;
+
+    if(nthreads < 1) {
+        nthreads = 1;
+    }
+    if(nthreads > njobs) {
+        nthreads = njobs > 0 ? njobs : 1;
+    }
+
+    batch.func = func;
+    batch.jobs = jobs;
+    batch.nworkers = nthreads;
+    batch.stack_size = stack_size;
+    batch.workers = (struct arm_batch_worker *) calloc(nthreads, sizeof(struct arm_batch_worker));
+
+    /* The states are made here rather than in the threads so their stacks
+    come from the main heap */
+    pool = arm_pool_new(mem, nthreads, stack_size, cfg);
+
+    if(cfg->engine == ENGINE_LOCKSTEP) {
+        if(posix_memalign((void **) &lane_stacks, ARM_PAGE_SIZE,
+                          ARM_PAGE_ROUND(nthreads * lane_stack_size)) != 0) {
+            lane_stacks = NULL;
+        }
+        if(lane_stacks != NULL) {
+            lane_stack_addr = arm_mem_map_host(mem, lane_stacks, ARM_PAGE_ROUND(nthreads * lane_stack_size),
+                                               ARM_PROT_READ | ARM_PROT_WRITE | ARM_PAGE_STACK);
+        }
+    }
+
+    if (batch.workers == NULL || pool == NULL
+        || (cfg->engine == ENGINE_LOCKSTEP && lane_stack_addr == 0)) {
+        free(batch.workers);
+        free(lane_stacks);
+        if(pool != NULL) {
+            arm_pool_free(pool);
+        }
+        return -1;
+    }
+
+    for(i = 0; i < nthreads; i++) {
+
+        w = &batch.workers[i];
+        w->batch = &batch;
+        w->id = i;
+        w->next = (long long) njobs * i / nthreads;
+        w->end = (long long) njobs * (i + 1) / nthreads;
+        w->as = arm_pool_get(pool, func, 0, 0, 0, 0);
+        w->lane_stack_addr = lane_stack_addr + i * lane_stack_size;
+        pthread_mutex_init(&w->lock, NULL);
+
+    }
+
+    for(started = 1; started < nthreads; started++) {
+        if(pthread_create(&batch.workers[started].thread, NULL, arm_batch_worker_main,
+                          &batch.workers[started]) != 0) {
+            break;
+        }
+    }
+
+    /* The calling thread is worker 0. If a thread failed to start the
+    others steal its jobs */
+    arm_batch_worker_main(&batch.workers[0]);
+
+    for(i = 1; i < started; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+
+    for(i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+    }
+
+    if(lane_stack_addr != 0) {
+        arm_mem_unmap(mem, lane_stack_addr, nthreads * lane_stack_size);
+    }
+
+    arm_pool_free(pool);
+    free(lane_stacks);
+    free(batch.workers);
+
+    return started;
+
+}
+
+/* Most calls arm_batch_sched has running at once */
+#define SCHED_CONTEXTS 256
+
+/* Calls the guest function at func once for every job like arm_batch_run,
+but all on the calling thread: up to SCHED_CONTEXTS calls at a time take
+turns of quantum instructions (see arm_sched), and a call that has run
+limit instructions (if limit is not 0) is stopped with job->stopped set.
+Returns -1 if there is not enough memory (and no job was run), else 0 */
+int arm_batch_sched(struct arm_mem *mem, unsigned int func, struct arm_job *jobs, int njobs,
+                    unsigned int stack_size, struct arm_config *cfg, long long quantum,
+                    long long limit) {
+
+    struct arm_sched sched;
+    struct arm_sched_task *tasks, *t;
+    struct arm_pool *pool;
+    struct arm_job *job;
+    int i, ncontexts, next = 0;
+
+    ncontexts = njobs < SCHED_CONTEXTS ? njobs : SCHED_CONTEXTS;
+    if(ncontexts < 1) {
+        ncontexts = 1;
+    }
+
+    tasks = (struct arm_sched_task *) calloc(ncontexts, sizeof(struct arm_sched_task));
+    pool = arm_pool_new(mem, ncontexts, stack_size, cfg);
+    if(tasks == NULL || pool == NULL) {
+        free(tasks);
+        if(pool != NULL) {
+            arm_pool_free(pool);
+        }
+        return -1;
+    }
+
+    arm_sched_init(&sched, quantum);
+
+    for(i = 0; i < ncontexts && next < njobs; i++, next++) {
+        job = &jobs[next];
+        tasks[i].as = arm_pool_get(pool, func, job->args[0], job->args[1], job->args[2], job->args[3]);
+        tasks[i].limit = limit;
+        tasks[i].data = job;
+        arm_sched_add(&sched, &tasks[i]);
+    }
+
+    /* Each call that is over makes room for the next one */
+    while((t = arm_sched_next(&sched)) != NULL) {
+
+        job = (struct arm_job *) t->data;
+        job->result = t->as->regs[0];
+        job->fault = t->as->fault;
+        job->fault_addr = t->as->fault_addr;
+        job->stopped = t->status == RUN_BUDGET;
+
+        job->num_instr = t->as->num_instr;
+        job->data_instr = t->as->data_instr;
+        job->b_instr = t->as->b_instr;
+        job->mem_instr = t->as->mem_instr;
+
+        arm_pool_put(pool, t->as);
+
+        if(next < njobs) {
+            job = &jobs[next++];
+            t->as = arm_pool_get(pool, func, job->args[0], job->args[1], job->args[2], job->args[3]);
+            t->data = job;
+            arm_sched_add(&sched, t);
+        }
+
+    }
+
+    arm_pool_free(pool);
+    free(tasks);
+
+    return 0;
+
+}
+
+/* Fuzzing (arm_fuzz, -f). One state calls a guest function over and over
+with mutated inputs: each argument register is a value the fuzzer picks,
+the address of an input buffer or its length. An input that reaches branch
+edges no earlier one did (see arm_cov_edge) is kept in the corpus and
+mutated further. Between runs the state and its address space go back to
+a snapshot taken before the first one (see arm_state_snapshot), so a run
+costs its own instructions and the pages it wrote, and nothing is
+allocated. The state runs one instruction at a time like interp, which is
+where the branch handlers count edges, and a run that faults, reaches a
+word that is not decoded, overflows its stack or runs more than its limit
+is reported rather than stopping the fuzzer.
+
+The stack starts a page and the input ends one, with free pages before and
+after them (see arm_mem_map_host), so running off either is a fault */
+
+#define FUZZ_MAX_INPUT 1024
+#define FUZZ_MAX_CORPUS 1024
+#define FUZZ_MAX_CRASHES 256
+#define FUZZ_STACK_SIZE 1024
+
+/* Default number of instructions a run can take before it counts as a hang */
+#define FUZZ_LIMIT 100000
+
+/* What an argument register holds: a fuzzed value, the address of the
+input or its length in bytes, halfwords or words */
+enum arm_fuzz_arg {
+    FUZZ_ARG_VALUE,
+    FUZZ_ARG_BUF,
+    FUZZ_ARG_LEN,
+    FUZZ_ARG_LEN2,
+    FUZZ_ARG_LEN4,
+    FUZZ_ARG_COUNT
+};
+
+const char * const arm_fuzz_arg_names[] = {"val", "buf", "len", "len2", "len4"};
+
+enum arm_fuzz_result {
+    FUZZ_OK,
+    FUZZ_HANG,
+    FUZZ_FAULT,
+    FUZZ_STACK,
+    FUZZ_UNDEFINED,
+    FUZZ_RESULTS
+};
+
+const char * const arm_fuzz_result_names[] = {"ok", "hang", "fault", "stack overflow",
+                                              "undefined instruction"};
+
+/* The values of the FUZZ_ARG_VALUE registers and the input buffer */
+struct arm_fuzz_input {
+
+    unsigned int regs[4];
+    unsigned int len;
+    unsigned char data[FUZZ_MAX_INPUT];
+
+};
+
+struct arm_fuzz {
+
+    struct arm_state *as;
+    struct arm_snapshot *snap;
+    enum arm_fuzz_arg args[4];
+    long long limit;
+
+    /* The input page, in the host and the guest */
+    unsigned char *buf;
+    unsigned int buf_addr;
+
+    /* Edge hit counts of the last run (as->cov) and the hit count classes
+    (see arm_fuzz_class) seen for each edge so far */
+    unsigned char *trace;
+    unsigned char *seen;
+    int edges;
+
+    struct arm_fuzz_input *corpus;
+    int ncorpus;
+
+    /* The last input run, the registers it started with and where it
+    stopped unless it returned */
+    struct arm_fuzz_input cur;
+    unsigned int regs[4];
+    unsigned int pc;
+    unsigned int addr;
+
+    /* Failures reported already, a result and a pc each */
+    unsigned int crash_pc[FUZZ_MAX_CRASHES];
+    enum arm_fuzz_result crash_kind[FUZZ_MAX_CRASHES];
+    int ncrashes;
+
+    unsigned long long rng;
+    long long runs;
+    long long results[FUZZ_RESULTS];
+
+};
+
+/* A random number (xorshift64) */
+static unsigned int arm_fuzz_rand(struct arm_fuzz *f) {
+
+    f->rng ^= f->rng << 13;
+    f->rng ^= f->rng >> 7;
+    f->rng ^= f->rng << 17;
+
+    return f->rng >> 32;
+
+}
+
+void arm_fuzz_free(struct arm_fuzz *f) {
+
+    if(f->snap != NULL) {
+        arm_snapshot_free(f->as->mem, f->snap);
+    }
+    if(f->buf_addr != 0) {
+        arm_mem_unmap(f->as->mem, f->buf_addr, ARM_PAGE_SIZE);
+    }
+    arm_state_free(f->as);
+    free(f->buf);
+    free(f->trace);
+    free(f->seen);
+    free(f->corpus);
+    free(f);
+
+}
+
+/* Makes a fuzzer for the guest function at func in mem, whose argument
+registers hold args (see enum arm_fuzz_arg) and which is stopped after limit
+instructions. The corpus starts with an empty input. Returns NULL if there
+is not enough memory */
+struct arm_fuzz *arm_fuzz_new(struct arm_mem *mem, unsigned int func, const enum arm_fuzz_arg *args,
+                              long long limit, unsigned long long seed) {
+
+    struct arm_fuzz *f;
+    struct arm_decoded *dcache;
+    void *stack = NULL, *buf = NULL;
+
+    f = (struct arm_fuzz *) calloc(1, sizeof(struct arm_fuzz));
+    dcache = (struct arm_decoded *) calloc(DCACHE_SIZE, sizeof(struct arm_decoded));
+    if(f != NULL) {
+        f->as = (struct arm_state *) malloc(sizeof(struct arm_state));
+    }
+    if(posix_memalign(&stack, ARM_PAGE_SIZE, ARM_PAGE_SIZE) != 0) {
+        stack = NULL;
+    }
+
+    if(f == NULL || f->as == NULL || dcache == NULL || stack == NULL
+       || arm_state_init(f->as, mem, (unsigned char *) stack, FUZZ_STACK_SIZE, dcache) != 0) {
+        if(f != NULL) {
+            free(f->as);
+        }
+        free(f);
+        free(dcache);
+        free(stack);
+        return NULL;
+    }
+
+    if(posix_memalign(&buf, ARM_PAGE_SIZE, ARM_PAGE_SIZE) != 0) {
+        buf = NULL;
+    }
+    f->buf = (unsigned char *) buf;
+    f->trace = (unsigned char *) calloc(FUZZ_MAP_SIZE, 1);
+    f->seen = (unsigned char *) calloc(FUZZ_MAP_SIZE, 1);
+    f->corpus = (struct arm_fuzz_input *) calloc(FUZZ_MAX_CORPUS, sizeof(struct arm_fuzz_input));
+    if(f->buf != NULL) {
+        f->buf_addr = arm_mem_map_host(mem, f->buf, ARM_PAGE_SIZE, ARM_PROT_READ | ARM_PROT_WRITE);
+    }
+
+    if(f->buf_addr == 0 || f->trace == NULL || f->seen == NULL || f->corpus == NULL) {
+        arm_fuzz_free(f);
+        return NULL;
+    }
+
+    memcpy(f->args, args, sizeof(f->args));
+    f->limit = limit;
+    f->rng = seed * 0x9E3779B97F4A7C15ULL | 1;
+    f->ncorpus = 1;
+
+    f->as->engine = ENGINE_INTERP;
+    f->as->cov = f->trace;
+    arm_state_reset(f->as, func, 0, 0, 0, 0);
+
+    f->snap = arm_state_snapshot(f->as);
+    if(f->snap == NULL) {
+        arm_fuzz_free(f);
+        return NULL;
+    }
+
+    return f;
+
+}
+
+/* Runs the guest on interp for at most f->limit instructions, stopping
+before a word that was not decoded */
+static enum arm_fuzz_result arm_fuzz_execute(struct arm_fuzz *f) {
+
+    struct arm_state *as = f->as;
+    struct arm_decoded *di;
+    long long left = f->limit;
+
+    while(as->regs[PC] != 0) {
+
+        if(left-- == 0) {
+            f->pc = as->regs[PC];
+            return FUZZ_HANG;
+        }
+
+        di = arm_dcache_lookup(as, as->regs[PC]);
+        if(di->handler == execute_unknown_instruction) {
+            f->pc = as->regs[PC];
+            return FUZZ_UNDEFINED;
+        }
+
+        di->handler(as, di);
+
+    }
+
+    if(as->fault == FAULT_NONE) {
+        return FUZZ_OK;
+    }
+
+    f->pc = as->fault_pc;
+    f->addr = as->fault_addr;
+
+    /* With SP below the stack, or a push (at most 16 words under SP) into
+    the free page under it */
+    if(as->fault != FAULT_FETCH
+       && (as->regs[SP] < as->stack_addr
+           || (as->fault_addr - (as->stack_addr - ARM_PAGE_SIZE) < ARM_PAGE_SIZE
+               && as->regs[SP] - as->fault_addr <= 64))) {
+        return FUZZ_STACK;
+    }
+
+    return FUZZ_FAULT;
+
+}
+
+/* Runs the guest on in (from the snapshot) and leaves its edges in f->trace */
+enum arm_fuzz_result arm_fuzz_run(struct arm_fuzz *f, const struct arm_fuzz_input *in) {
+
+    struct arm_state *as = f->as;
+    enum arm_fuzz_result result;
+    unsigned int start;
+    int i;
+
+    arm_state_restore(as, f->snap);
+
+    /* Whatever the last run left in the page is cleared */
+    start = (ARM_PAGE_SIZE - in->len) & ~3;
+    memset(f->buf, 0, start);
+    memcpy(f->buf + start, in->data, in->len);
+    memset(f->buf + start + in->len, 0, ARM_PAGE_SIZE - start - in->len);
+
+    for(i = 0; i < 4; i++) {
+        switch(f->args[i]) {
+        case FUZZ_ARG_BUF:
+            as->regs[i] = f->buf_addr + start;
+            break;
+        case FUZZ_ARG_LEN:
+            as->regs[i] = in->len;
+            break;
+        case FUZZ_ARG_LEN2:
+            as->regs[i] = in->len / 2;
+            break;
+        case FUZZ_ARG_LEN4:
+            as->regs[i] = in->len / 4;
+            break;
+        default:
+            as->regs[i] = in->regs[i];
+            break;
+        }
+    }
+
+    memcpy(f->regs, as->regs, sizeof(f->regs));
+    memset(f->trace, 0, FUZZ_MAP_SIZE);
+
+    result = arm_fuzz_execute(f);
+
+    f->runs++;
+    f->results[result]++;
+
+    return result;
+
+}
+
+/* Hit counts are put in classes (1, 2, 3, 4-7, 8-15, 16-31, 32-127,
+128-255) so a loop running one more time is not a new edge but running
+twice as often is. The class is one bit */
+static inline unsigned char arm_fuzz_class(unsigned char count) {
+
+    if(count <= 3) {
+        return count == 3 ? 4 : count;
+    }
+
+    return count >= 128 ? 128 : count >= 32 ? 64 : 1 << (32 - __builtin_clz(count));
+
+}
+
+/* Adds the edges of the last run to f->seen. Returns true if any of them
+(or its class) had not been seen before */
+static bool arm_fuzz_coverage(struct arm_fuzz *f) {
+
+    unsigned long long *words = (unsigned long long *) f->trace;
+    unsigned char c;
+    bool found = false;
+    int i, j;
+
+    for(i = 0; i < FUZZ_MAP_SIZE / 8; i++) {
+
+        if(words[i] == 0) {
+            continue;
+        }
+
+        for(j = i * 8; j < i * 8 + 8; j++) {
+            if(f->trace[j] != 0) {
+                c = arm_fuzz_class(f->trace[j]);
+                if(!(f->seen[j] & c)) {
+                    if(f->seen[j] == 0) {
+                        f->edges++;
+                    }
+                    f->seen[j] |= c;
+                    found = true;
+                }
+            }
+        }
+
+    }
+
+    return found;
+
+}
+
+/* Changes one thing about in: a bit, a byte, a word (set to a value that
+often matters or moved by a little), the length, or the data spliced with
+another input from the corpus */
+static void arm_fuzz_mutate(struct arm_fuzz *f, struct arm_fuzz_input *in) {
+
+    static const unsigned int interesting[] = {
+        0, 1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 63, 64, 100, 127, 128, 255, 256, 1000, 1024, 4096,
+        0x7FFF, 0x8000, 0xFFFF, 0x10000, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0xFFFFFFFE, 0xFFFFFF80
+    };
+
+    struct arm_fuzz_input *other;
+    unsigned char *bytes;
+    unsigned int n, i, k;
+
+    /* The value registers are the first 16 bytes, the data the rest */
+    unsigned char all[16 + FUZZ_MAX_INPUT];
+
+    memcpy(all, in->regs, 16);
+    memcpy(all + 16, in->data, in->len);
+    n = 16 + in->len;
+    bytes = all;
+
+    switch(arm_fuzz_rand(f) % 7) {
+
+    case 0:
+        i = arm_fuzz_rand(f) % (8 * n);
+        bytes[i / 8] ^= 1 << (i % 8);
+        break;
+
+    case 1:
+        bytes[arm_fuzz_rand(f) % n] = arm_fuzz_rand(f);
+        break;
+
+    case 2:
+        i = arm_fuzz_rand(f) % (n / 4) * 4;
+        k = interesting[arm_fuzz_rand(f) % (sizeof(interesting) / sizeof(interesting[0]))];
+        memcpy(bytes + i, &k, 4);
+        break;
+
+    case 3:
+        i = arm_fuzz_rand(f) % (n / 4) * 4;
+        memcpy(&k, bytes + i, 4);
+        k += arm_fuzz_rand(f) % 2 ? 1 + arm_fuzz_rand(f) % 35 : -(1 + arm_fuzz_rand(f) % 35);
+        memcpy(bytes + i, &k, 4);
+        break;
+
+    case 4:
+        /* Grows the data by up to 16 random bytes */
+        k = 1 + arm_fuzz_rand(f) % 16;
+        for(i = 0; i < k && n < sizeof(all); i++) {
+            bytes[n++] = arm_fuzz_rand(f);
+        }
+        break;
+
+    case 5:
+        if(n > 16) {
+            n -= 1 + arm_fuzz_rand(f) % (n - 16);
+        }
+        break;
+
+    default:
+        other = &f->corpus[arm_fuzz_rand(f) % f->ncorpus];
+        if(other->len > 0) {
+            i = 16 + (n > 16 ? arm_fuzz_rand(f) % (n - 16) : 0);
+            k = arm_fuzz_rand(f) % other->len;
+            for(; k < other->len && i < sizeof(all); k++) {
+                bytes[i++] = other->data[k];
+            }
+            n = i;
+        }
+        break;
+
+    }
+
+    memcpy(in->regs, all, 16);
+    in->len = n - 16;
+    memcpy(in->data, all + 16, in->len);
+
+}
+
+/* Mutates an input from the corpus (1 to 4 times) into f->cur, runs it and
+sets *result. Returns true if it was new: it returned and reached new edges
+(so it is in the corpus now), hung on new edges, or failed at a pc where
+that failure was not seen before */
+bool arm_fuzz_step(struct arm_fuzz *f, enum arm_fuzz_result *result) {
+
+    bool covered;
+    int i, n;
+
+    f->cur = f->corpus[arm_fuzz_rand(f) % f->ncorpus];
+
+    n = 1 + arm_fuzz_rand(f) % 4;
+    for(i = 0; i < n; i++) {
+        arm_fuzz_mutate(f, &f->cur);
+    }
+
+    *result = arm_fuzz_run(f, &f->cur);
+    covered = arm_fuzz_coverage(f);
+
+    if(*result == FUZZ_OK) {
+        if(covered && f->ncorpus < FUZZ_MAX_CORPUS) {
+            f->corpus[f->ncorpus++] = f->cur;
+        }
+        return covered;
+    }
+
+    if(*result == FUZZ_HANG) {
+        return covered;
+    }
+
+    for(i = 0; i < f->ncrashes; i++) {
+        if(f->crash_kind[i] == *result && f->crash_pc[i] == f->pc) {
+            return false;
+        }
+    }
+
+    if(f->ncrashes == FUZZ_MAX_CRASHES) {
+        return false;
+    }
+
+    f->crash_kind[f->ncrashes] = *result;
+    f->crash_pc[f->ncrashes] = f->pc;
+    f->ncrashes++;
+
+    return true;
+
+}
+
+/* Seconds on a monotonic clock, used to time the tests */
+double now_seconds() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* The guest address of the function name, which is a symbol of img or a
+number (ex. 0x10000). Returns 0 if there is no such function */
+unsigned int find_function(struct arm_image *img, const char *name) {
+
+    unsigned long addr;
+    char *end;
+
+    addr = strtoul(name, &end, 0);
+    if(*name != '\0' && *end == '\0') {
+        return addr;
+    }
+
+    return arm_image_symbol(img, name);
+
+}
+
+/* Finds the function name in img and makes a pool with one state to run it.
+Returns the guest address of the function, or 0 (and prints why) */
+unsigned int test_setup(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img,
+                        const char *name, struct arm_pool **pool) {
+
+    unsigned int func;
+
+    func = find_function(img, name);
+    if(func == 0) {
+        printf("%s not found\n", name);
+        return 0;
+    }
+
+    *pool = arm_pool_new(mem, 1, 1024, cfg);
+    if(*pool == NULL) {
+        printf("arm_pool_new() failed\n");
+        return 0;
+    }
+
+    return func;
+
+}
+
+/* Prints emulated instructions per second (in millions) for one test */
+void print_mips(char *name, enum arm_engine engine, long long instrs, double secs) {
+
+    printf("%s MIPS (%s) %.2f\n", name, arm_engine_names[engine], instrs / secs / 1e6);
+
+}
+
+/* Prints the estimates of the timing model (if -m is on) for one test,
+and empties it so the next test starts with cold caches */
+void print_timing(char *name, struct arm_config *cfg) {
+
+    if(cfg->timing != NULL) {
+        arm_timing_report(stdout, cfg->timing, name);
+        arm_timing_reset(cfg->timing);
+    }
+
+    if(cfg->memo != NULL) {
+        arm_memo_report(stdout, cfg->memo, name);
+        arm_memo_reset(cfg->memo);
+    }
+
+}
+
+void test_sum(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img) {
+
+    struct arm_pool *pool;
+    struct arm_state *as;
+    unsigned int rv, func, guest_arr, guest_arr2, guest_arr_zero, guest_arr_thousand;
+    long long total_instr = 0;
+    double start_time = now_seconds();
+
+    int arr[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    int arr2[] = {-1,-2,-3,-4,-5,-6,-7,-8,-9, -10};
+    int arr_zero[] = {0, 1, 0, 3, 0, 5, 0, 7, 0, 9};
+
+    int arr_thousand[1000];
+    int i = 0, start = 1000;
+
+    for(i = 0; i < 1000; i++) {
+        if(i%3 == 0) {
+            arr_thousand[i] = 0;
+        } else {
+            arr_thousand[i] = start;
+            start += 2;
+        }
+    }
+
+    func = test_setup(cfg, mem, img, "sum_array_a", &pool);
+    if(func == 0) {
+        return;
+    }
+
+    guest_arr = arm_mem_map_host(mem, arr, sizeof(arr), ARM_PROT_READ);
+    guest_arr2 = arm_mem_map_host(mem, arr2, sizeof(arr2), ARM_PROT_READ);
+    guest_arr_zero = arm_mem_map_host(mem, arr_zero, sizeof(arr_zero), ARM_PROT_READ);
+    guest_arr_thousand = arm_mem_map_host(mem, arr_thousand, sizeof(arr_thousand), ARM_PROT_READ);
+
+    as = arm_pool_get(pool, func, guest_arr, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("\n\nSUM from 1 to 10 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr2, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("SUM from -1 to -10 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr_zero, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("SUM of numbers. Positive numbers are zeros = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr_thousand, 1000, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("SUM of 1000. If i%3 == 0, make a 0, else += 2 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    printf("Sum Number of instructions %d\n",as->num_instr);
+    printf("Sum Data Instructions %d\n",as->data_instr);
+    printf("Sum Memory Instructions %d\n",as->mem_instr);
+    printf("Sum Branch Instructions %d\n",as->b_instr);
+    print_mips("Sum", cfg->engine, total_instr, now_seconds() - start_time);
+    print_timing("Sum", cfg);
+
+    arm_pool_free(pool);
+
+    arm_mem_unmap(mem, guest_arr, sizeof(arr));
+    arm_mem_unmap(mem, guest_arr2, sizeof(arr2));
+    arm_mem_unmap(mem, guest_arr_zero, sizeof(arr_zero));
+    arm_mem_unmap(mem, guest_arr_thousand, sizeof(arr_thousand));
+
+}
+
+void test_max(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img) {
+
+    struct arm_pool *pool;
+    struct arm_state *as;
+    unsigned int rv, func, guest_arr, guest_arr2, guest_arr_zero, guest_arr_thousand;
+    long long total_instr = 0;
+    double start_time = now_seconds();
+
+    int arr[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    int arr2[] = {-1,-2,-3,-4,-5,-6,-7,-8,-9, -10};
     int arr_zero[] = {0, 1, 0, 3, 0, 5, 0, 7, 0, 9};
 
-    int arr_thousand[1000];
-    int i = 0, start = 1000;
+    int arr_thousand[1000];
+    int i = 0, start = 1000;
+
+    for(i = 0; i < 1000; i++) {
+    	if(i%3 == 0) {
+            arr_thousand[i] = 0;
+        } else {
+            arr_thousand[i] = start;
+            start += 2;
+        }
+    }
+
+    func = test_setup(cfg, mem, img, "find_max_a", &pool);
+    if(func == 0) {
+        return;
+    }
+
+    guest_arr = arm_mem_map_host(mem, arr, sizeof(arr), ARM_PROT_READ);
+    guest_arr2 = arm_mem_map_host(mem, arr2, sizeof(arr2), ARM_PROT_READ);
+    guest_arr_zero = arm_mem_map_host(mem, arr_zero, sizeof(arr_zero), ARM_PROT_READ);
+    guest_arr_thousand = arm_mem_map_host(mem, arr_thousand, sizeof(arr_thousand), ARM_PROT_READ);
+
+    as = arm_pool_get(pool, func, guest_arr, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("\n\nMAX from 1 to 10 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr2, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("MAX from -1 to -10 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr_zero, 10, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("MAX from 0 through 9 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    as = arm_pool_get(pool, func, guest_arr_thousand, 1000, 0, 0);
+    rv = arm_state_execute(as);
+    total_instr += as->num_instr;
+    printf("MAX from 1000. If i%3 == 0, make a 0, else += 2 = %d\n\n", rv);
+    arm_pool_put(pool, as);
+
+    printf("Max Number of instructions %d\n",as->num_instr);
+    printf("Max Data Instructions %d\n",as->data_instr);
+    printf("Max Memory Instructions %d\n",as->mem_instr);
+    printf("Max Branch Instructions %d\n",as->b_instr);
+    print_mips("Max", cfg->engine, total_instr, now_seconds() - start_time);
+    print_timing("Max", cfg);
+
+    arm_pool_free(pool);
+
+    arm_mem_unmap(mem, guest_arr, sizeof(arr));
+    arm_mem_unmap(mem, guest_arr2, sizeof(arr2));
+    arm_mem_unmap(mem, guest_arr_zero, sizeof(arr_zero));
+    arm_mem_unmap(mem, guest_arr_thousand, sizeof(arr_thousand));
+
+}
+
+void test_fib_iter(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img) {
+
+    int j = 0;
+    struct arm_pool *pool;
+    struct arm_state *as;
+    unsigned int rv, func;
+    long long total_instr = 0;
+    double start_time = now_seconds();
+
+    printf("\n\nFib iter\n\n");
+
+    func = test_setup(cfg, mem, img, "fib_iter_a", &pool);
+    if(func == 0) {
+        return;
+    }
+
+    for(j = 0; j < 20; j++) {
+
+        as = arm_pool_get(pool, func, j, 0, 0, 0);
+        rv = arm_state_execute(as);
+        total_instr += as->num_instr;
+        printf("%d, ", rv);
+        arm_pool_put(pool, as);
+
+    }
+
+    printf("\n\n");
+
+    printf("Fib Iteration Number of instructions %d\n",as->num_instr);
+    printf("Fib Iteration Data Instructions %d\n",as->data_instr);
+    printf("Fib Iteration Memory Instructions %d\n",as->mem_instr);
+    printf("Fib Iteration Branch Instructions %d\n",as->b_instr);
+    print_mips("Fib Iteration", cfg->engine, total_instr, now_seconds() - start_time);
+    print_timing("Fib Iteration", cfg);
+
+    arm_pool_free(pool);
+
+}
+
+void test_fib_rec(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img) {
+
+    int j = 0, fd;
+    struct arm_pool *pool;
+    struct arm_state *as;
+    struct arm_snapshot *snap;
+    char snap_path[] = "/tmp/armemu-snap-XXXXXX";
+    const char *error;
+    unsigned int rv, func, n;
+    long long total_instr = 0;
+    double start_time = now_seconds();
+
+    printf("\n\nFib Rec\n\n", rv);
+
+    func = test_setup(cfg, mem, img, "fib_rec_a", &pool);
+    if(func == 0) {
+        return;
+    }
+
+    for(j = 0; j < 20; j++) {
+
+        as = arm_pool_get(pool, func, j, 0, 0, 0);
+        rv = arm_state_execute(as);
+        total_instr += as->num_instr;
+        printf("%d, ",rv);
+        arm_pool_put(pool, as);
+
+    }
+
+    printf("\n\n");
+
+    /* Far deeper than the stack, which must fault rather than run into
+    the host memory under it */
+    as = arm_pool_get(pool, func, 200, 0, 0, 0);
+    arm_state_execute(as);
+    if(as->fault != FAULT_WRITE || as->fault_addr >= as->stack_addr) {
+        printf("Fib Recursion stack overflow did not fault\n");
+    }
+    arm_pool_put(pool, as);
+
+    /* Part way through a call, written out and mapped back in */
+    as = arm_pool_get(pool, func, 19, 0, 0, 0);
+    arm_state_run(as, 1000);
+    snap = arm_state_snapshot(as);
+    fd = mkstemp(snap_path);
+    if(snap == NULL || fd < 0 || arm_snapshot_save(mem, snap, snap_path) != 0) {
+        printf("Fib Recursion cannot write a snapshot\n");
+    } else {
+        rv = arm_state_execute(as);
+        n = as->num_instr;
+        arm_snapshot_free(mem, snap);
+        snap = arm_snapshot_load(snap_path, &error);
+        arm_state_reset(as, func, 0, 0, 0, 0);
+        if(snap == NULL || arm_state_restore(as, snap) != 0 || arm_state_execute(as) != rv
+           || as->num_instr != n) {
+            printf("Fib Recursion snapshot did not come back the same\n");
+        }
+    }
+    if(snap != NULL) {
+        arm_snapshot_free(mem, snap);
+    }
+    if(fd >= 0) {
+        close(fd);
+        unlink(snap_path);
+    }
+    arm_pool_put(pool, as);
+
+    printf("Fib Recursion Number of instructions %d\n",as->num_instr);
+    printf("Fib Recursion Data Instructions %d\n",as->data_instr);
+    printf("Fib Recursion Memory Instructions %d\n",as->mem_instr);
+    printf("Fib Recursion Branch Instructions %d\n",as->b_instr);
+    print_mips("Fib Recursion", cfg->engine, total_instr, now_seconds() - start_time);
+    print_timing("Fib Recursion", cfg);
+
+    arm_pool_free(pool);
+
+}
+
+void test_find_str(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img) {
+
+    struct arm_pool *pool;
+    struct arm_state *as;
+    unsigned int rv, func, guest_str, guest_sub;
+    long long total_instr = 0;
+    double start_time = now_seconds();
+    int i, j;
+
+    char str[] = "hello world";
+    char sub[] = "world";
+    char sub2[] = "xyz";
+    char str3[] = "aaaab";
+    char sub3[] = "aab";
+    char str_thousand[1001];
+    char sub_thousand[] = "zyx";
+
+    /* The alphabet over and over, with "zyx" (which it never has) at the end */
+    for(i = 0; i < 997; i++) {
+        str_thousand[i] = 'a' + i % 26;
+    }
+    strcpy(&str_thousand[997], sub_thousand);
+
+    /* The strings, each with the substring to look for in it */
+    char *strs[] = {str, str, str3, str_thousand};
+    char *subs[] = {sub, sub2, sub3, sub_thousand};
+    size_t str_sizes[] = {sizeof(str), sizeof(str), sizeof(str3), sizeof(str_thousand)};
+    size_t sub_sizes[] = {sizeof(sub), sizeof(sub2), sizeof(sub3), sizeof(sub_thousand)};
+    const char *names[] = {"hello world", "hello world", "aaaab", "the alphabet x 1000"};
+
+    func = test_setup(cfg, mem, img, "find_str_a", &pool);
+    if(func == 0) {
+        return;
+    }
+
+    printf("\n\n");
+
+    for(j = 0; j < 4; j++) {
+
+        guest_str = arm_mem_map_host(mem, strs[j], str_sizes[j], ARM_PROT_READ);
+        guest_sub = arm_mem_map_host(mem, subs[j], sub_sizes[j], ARM_PROT_READ);
+
+        as = arm_pool_get(pool, func, guest_str, guest_sub, 0, 0);
+        rv = arm_state_execute(as);
+        total_instr += as->num_instr;
+        printf("FIND \"%s\" in %s = %d\n\n", subs[j], names[j], (int) rv);
+        arm_pool_put(pool, as);
+
+        arm_mem_unmap(mem, guest_str, str_sizes[j]);
+        arm_mem_unmap(mem, guest_sub, sub_sizes[j]);
+
+    }
+
+    printf("Find Str Number of instructions %d\n",as->num_instr);
+    printf("Find Str Data Instructions %d\n",as->data_instr);
+    printf("Find Str Memory Instructions %d\n",as->mem_instr);
+    printf("Find Str Branch Instructions %d\n",as->b_instr);
+    print_mips("Find Str", cfg->engine, total_instr, now_seconds() - start_time);
+    print_timing("Find Str", cfg);
+
+    arm_pool_free(pool);
+
+}
+
+/* Batch mode (-b). Reads one call per line from stdin (up to four
+arguments, ex. "25"), runs them all on nthreads threads (or with
+arm_batch_sched if quantum is not 0) and prints the result and instruction
+count of each call in input order (or the fault or limit that stopped it) */
+int run_batch(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img,
+              char *name, int nthreads, long long quantum, long long limit) {
+
+    struct arm_job *jobs = NULL, *grown;
+    unsigned int func;
+    char line[256], *p, *end;
+    int i, k, njobs = 0, size = 0, used;
+    long long total_instr = 0;
+    double start_time;
+
+    func = find_function(img, name);
+    if(func == 0) {
+        printf("unknown function %s\n", name);
+        return 1;
+    }
+
+    while(fgets(line, sizeof(line), stdin) != NULL) {
+
+        if(njobs == size) {
+            size = size == 0 ? 1024 : size * 2;
+            grown = (struct arm_job *) realloc(jobs, size * sizeof(struct arm_job));
+            if (grown == NULL) {
+                printf("realloc() failed\n");
+                free(jobs);
+                return 1;
+            }
+            jobs = grown;
+        }
+
+        memset(&jobs[njobs], 0, sizeof(struct arm_job));
+
+        p = line;
+        for(k = 0; k < 4; k++) {
+            jobs[njobs].args[k] = strtoul(p, &end, 0);
+            if(end == p) {
+                break;
+            }
+            p = end;
+        }
+
+        /* Blank lines are skipped */
+        if(k > 0) {
+            njobs++;
+        }
+
+    }
+
+    start_time = now_seconds();
+    if(quantum > 0) {
+        used = 1;
+        if(arm_batch_sched(mem, func, jobs, njobs, 1024, cfg, quantum, limit) < 0) {
+            printf("arm_batch_sched() failed\n");
+            free(jobs);
+            return 1;
+        }
+    } else {
+        used = arm_batch_run(mem, func, jobs, njobs, nthreads, 1024, cfg);
+        if(used < 0) {
+            printf("arm_batch_run() failed\n");
+            free(jobs);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < njobs; i++) {
+        if(jobs[i].fault != FAULT_NONE) {
+            printf("fault %s 0x%08x\n", arm_fault_names[jobs[i].fault], jobs[i].fault_addr);
+        } else if(jobs[i].stopped) {
+            printf("stopped %d\n", jobs[i].num_instr);
+        } else {
+            printf("%d %d\n", (int) jobs[i].result, jobs[i].num_instr);
+        }
+        total_instr += jobs[i].num_instr;
+    }
+
+    fprintf(stderr, "Batch %d calls on %d threads MIPS (%s) %.2f\n", njobs, used,
+            arm_engine_names[cfg->engine], total_instr / (now_seconds() - start_time) / 1e6);
+
+    free(jobs);
+
+    return 0;
+
+}
+
+/* Fuzz mode (-f). Fuzzes the function name of img for runs runs (see
+arm_fuzz), its argument registers given by spec (ex. "buf,len4", see
+arm_fuzz_arg_names, the rest are fuzzed values). Every new failure is
+printed with the input that caused it, then how the runs ended */
+int run_fuzz(struct arm_mem *mem, struct arm_image *img, char *name, char *spec,
+             long long runs, long long limit, unsigned long long seed) {
+
+    enum arm_fuzz_arg args[4] = {FUZZ_ARG_VALUE, FUZZ_ARG_VALUE, FUZZ_ARG_VALUE, FUZZ_ARG_VALUE};
+    enum arm_fuzz_result result;
+    struct arm_fuzz *f;
+    unsigned int func, i;
+    int k, n = 0;
+    char *p, *end;
+    size_t size;
+    double start_time;
+
+    func = find_function(img, name);
+    if(func == 0) {
+        printf("unknown function %s\n", name);
+        return 1;
+    }
+
+    for(p = spec; p != NULL && *p != '\0'; p = *end == ',' ? end + 1 : NULL) {
+
+        end = strchr(p, ',');
+        if(end == NULL) {
+            end = p + strlen(p);
+        }
+        size = end - p;
+
+        for(k = 0; k < FUZZ_ARG_COUNT; k++) {
+            if(strlen(arm_fuzz_arg_names[k]) == size && strncmp(p, arm_fuzz_arg_names[k], size) == 0) {
+                break;
+            }
+        }
+
+        if(k == FUZZ_ARG_COUNT || n == 4) {
+            printf("bad fuzz arguments %s\n", spec);
+            return 1;
+        }
+
+        args[n++] = (enum arm_fuzz_arg) k;
+
+    }
+
+    f = arm_fuzz_new(mem, func, args, limit, seed);
+    if(f == NULL) {
+        printf("arm_fuzz_new() failed\n");
+        return 1;
+    }
+
+    start_time = now_seconds();
+
+    while(f->runs < runs) {
+
+        if(!arm_fuzz_step(f, &result) || result == FUZZ_OK) {
+            continue;
+        }
+
+        printf("%s at 0x%08x", arm_fuzz_result_names[result], f->pc);
+        if(result == FUZZ_FAULT || result == FUZZ_STACK) {
+            printf(" (%s 0x%08x)", arm_fault_names[f->as->fault], f->addr);
+        }
+        printf(" run %lld: r0-r3 0x%08x 0x%08x 0x%08x 0x%08x input", f->runs,
+               f->regs[0], f->regs[1], f->regs[2], f->regs[3]);
+        for(i = 0; i < f->cur.len; i++) {
+            printf(" %02x", f->cur.data[i]);
+        }
+        printf("\n");
+
+    }
+
+    printf("%lld runs: %lld ok, %lld hang, %lld fault, %lld stack overflow, %lld undefined, "
+           "%d edges, %d in corpus\n", f->runs, f->results[FUZZ_OK], f->results[FUZZ_HANG],
+           f->results[FUZZ_FAULT], f->results[FUZZ_STACK], f->results[FUZZ_UNDEFINED],
+           f->edges, f->ncorpus);
+
+    fprintf(stderr, "Fuzz runs/s %.0f\n", f->runs / (now_seconds() - start_time));
+
+    arm_fuzz_free(f);
+
+    return 0;
+
+}
+
+/* Calls the function name of img once with up to four arguments (strings
+from the command line) and prints what it returns. With restore_path the
+call carries on from the snapshot in that file instead of its start, and
+with save_path a snapshot of it is written to that file after save_at
+instructions (before it starts with 0) */
+int run_call(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img,
+             char *name, char **args, int nargs, const char *restore_path,
+             const char *save_path, long long save_at) {
+
+    struct arm_state *as;
+    struct arm_snapshot *s;
+    unsigned int func, arg[4] = {0, 0, 0, 0}, rv;
+    const char *error;
+    int i;
+
+    func = find_function(img, name);
+    if(func == 0) {
+        printf("unknown function %s\n", name);
+        return 1;
+    }
+
+    for(i = 0; i < nargs && i < 4; i++) {
+        arg[i] = strtoul(args[i], NULL, 0);
+    }
+
+    as = arm_state_new(mem, 1024, func, arg[0], arg[1], arg[2], arg[3]);
+    if(as == NULL) {
+        printf("arm_state_new() failed\n");
+        return 1;
+    }
+
+    arm_state_config(as, cfg);
+
+    /* The snapshot is only used to set up as, the pages it copied in stay */
+    if(restore_path != NULL) {
+
+        s = arm_snapshot_load(restore_path, &error);
+        if(s == NULL) {
+            printf("%s: %s\n", restore_path, error);
+            arm_state_free(as);
+            return 1;
+        }
+
+        i = arm_state_restore(as, s);
+        arm_snapshot_free(mem, s);
+        if(i != 0) {
+            printf("%s: not a snapshot of this call\n", restore_path);
+            arm_state_free(as);
+            return 1;
+        }
+
+    }
+
+    if(save_path != NULL) {
+
+        if(save_at > 0) {
+            arm_state_run(as, save_at);
+        }
+
+        s = arm_state_snapshot(as);
+        if(s == NULL) {
+            printf("arm_state_snapshot() failed\n");
+            arm_state_free(as);
+            return 1;
+        }
+
+        i = arm_snapshot_save(mem, s, save_path);
+        arm_snapshot_free(mem, s);
+        if(i != 0) {
+            printf("cannot write the snapshot %s\n", save_path);
+            arm_state_free(as);
+            return 1;
+        }
+
+    }
+
+    rv = arm_state_execute(as);
+
+    if(as->fault != FAULT_NONE) {
+        printf("fault %s 0x%08x at 0x%08x\n", arm_fault_names[as->fault], as->fault_addr, as->fault_pc);
+        arm_state_free(as);
+        return 1;
+    }
+
+    printf("%d\n", (int) rv);
+    arm_state_free(as);
+
+    return 0;
+
+}
+
+/* Benchmark (-B trials, make bench). Every kernel runs at a size that
+takes a while, on every engine (only the batch kernels on lockstep), once
+to warm up (the decode cache, blocks and compiled code are kept between
+runs) and then trials times. The results are printed as JSON: guest MIPS
+(median, min and max of the trials), ns per guest instruction, host IPC
+(when perf events can be used, else null) and the peak RSS of the process
+so far */
+
+#define BENCH_ARRAY_SIZE 1000000
+#define BENCH_FIB_ITER_N 1000000
+#define BENCH_FIB_REC_N 30
+#define BENCH_BATCH_CALLS 256
+#define BENCH_MAX_TRIALS 100
+
+/* A kernel of the benchmark. An array kernel gets the benchmark array
+and its size, the others n. A batch kernel makes calls calls (with n from
+12 to 19) through arm_batch_run, which is the only way the lockstep
+engine runs */
+struct bench_case {
+
+    const char *name;
+    const char *func;
+    unsigned int n;
+    bool array;
+    int calls;
+
+};
+
+const struct bench_case bench_cases[] = {
+    {"sum_array_a", "sum_array_a", BENCH_ARRAY_SIZE, true, 0},
+    {"find_max_a", "find_max_a", BENCH_ARRAY_SIZE, true, 0},
+    {"fib_iter_a", "fib_iter_a", BENCH_FIB_ITER_N, false, 0},
+    {"fib_rec_a", "fib_rec_a", BENCH_FIB_REC_N, false, 0},
+    {"fib_rec_a_batch", "fib_rec_a", 0, false, BENCH_BATCH_CALLS}
+};
+
+#define BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/* Host cycle and instruction counters, -1 where perf events are not allowed */
+struct bench_counters {
+
+    int cycles;
+    int instrs;
+
+};
+
+static int bench_counter_open(unsigned long long config) {
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+}
+
+static void bench_counter_start(int fd) {
+
+    if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+}
+
+/* Stops fd and returns what it counted (0 if it is not open) */
+static long long bench_counter_stop(int fd) {
+
+    long long count = 0;
+
+    if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+
+    return count;
 
-    for(i = 0; i < 1000; i++) {
-        if(i%3 == 0) {
-            arr_thousand[i] = 0;
+}
+
+/* Runs c once to warm up and then trials times, putting the time of each
+trial in secs and adding the host counts of the trials to *cycles and
+*instrs. Returns the guest instructions of one run, or -1 if it could not
+run or faulted */
+long long bench_case_run(struct arm_config *cfg, struct arm_mem *mem, unsigned int func,
+                         const struct bench_case *c, unsigned int guest_arr, int trials,
+                         double *secs, struct bench_counters *counters,
+                         long long *cycles, long long *instrs) {
+
+    struct arm_state *as = NULL;
+    struct arm_job *jobs = NULL;
+    long long guest_instrs = 0;
+    double start;
+    int t, i;
+
+    if(c->calls > 0) {
+        jobs = (struct arm_job *) calloc(c->calls, sizeof(struct arm_job));
+        if(jobs == NULL) {
+            return -1;
+        }
+    } else {
+        as = arm_state_new(mem, 4096, func, 0, 0, 0, 0);
+        if(as == NULL) {
+            return -1;
+        }
+        arm_state_config(as, cfg);
+    }
+
+    for(t = -1; t < trials && guest_instrs >= 0; t++) {
+
+        if(jobs != NULL) {
+            for(i = 0; i < c->calls; i++) {
+                memset(&jobs[i], 0, sizeof(struct arm_job));
+                jobs[i].args[0] = 12 + i % 8;
+            }
+        } else if(c->array) {
+            arm_state_reset(as, func, guest_arr, c->n, 0, 0);
         } else {
-            arr_thousand[i] = start;
-            start += 2;
+            arm_state_reset(as, func, c->n, 0, 0, 0);
+        }
+
+        bench_counter_start(counters->cycles);
+        bench_counter_start(counters->instrs);
+        start = now_seconds();
+
+        guest_instrs = 0;
+        if(jobs == NULL) {
+            arm_state_execute(as);
+            guest_instrs = as->fault == FAULT_NONE ? as->num_instr : -1;
+        } else if(arm_batch_run(mem, func, jobs, c->calls, 1, 1024, cfg) < 0) {
+            guest_instrs = -1;
+        } else {
+            for(i = 0; i < c->calls && guest_instrs >= 0; i++) {
+                guest_instrs = jobs[i].fault == FAULT_NONE ? guest_instrs + jobs[i].num_instr : -1;
+            }
+        }
+
+        if(t >= 0) {
+            secs[t] = now_seconds() - start;
+            *cycles += bench_counter_stop(counters->cycles);
+            *instrs += bench_counter_stop(counters->instrs);
         }
+
     }
 
-    as = arm_state_new(1024, (unsigned int *)sum_array_a, (unsigned int)arr, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("\n\nSUM from 1 to 10 = %d\n\n", rv);
+    if(as != NULL) {
+        arm_state_free(as);
+    }
+    free(jobs);
 
-    as = arm_state_new(1024, (unsigned int *)sum_array_a, (unsigned int)arr2, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("SUM from -1 to -10 = %d\n\n", rv);
+    return guest_instrs;
 
-    as = arm_state_new(1024, (unsigned int *)sum_array_a, (unsigned int)arr_zero, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("SUM of numbers. Positive numbers are zeros = %d\n\n", rv);
+}
 
-    as = arm_state_new(1024, (unsigned int *)sum_array_a, (unsigned int)arr_thousand, 1000, 0, 0);
-    rv = arm_state_execute(as);
-    printf("SUM of 1000. If i%3 == 0, make a 0, else += 2 = %d\n\n", rv);
+int bench_compare(const void *a, const void *b) {
+
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return da < db ? -1 : da > db ? 1 : 0;
 
-    printf("Sum Number of instructions %d\n",as->num_instr);
-    printf("Sum Data Instructions %d\n",as->data_instr);
-    printf("Sum Memory Instructions %d\n",as->mem_instr);
-    printf("Sum Branch Instructions %d\n",as->b_instr);
 }
 
-void test_max() {
+/* Runs every kernel on every engine and prints the JSON report */
+int run_bench(struct arm_config *cfg, struct arm_mem *mem, struct arm_image *img, int trials) {
+
+    struct bench_counters counters;
+    struct rusage usage;
+    const struct bench_case *c;
+    unsigned int func, guest_arr;
+    long long guest_instrs, cycles, instrs;
+    double secs[BENCH_MAX_TRIALS], median;
+    int *arr, i, e, rv = 0;
+    bool first = true;
+
+    arr = (int *) malloc(BENCH_ARRAY_SIZE * sizeof(int));
+    if(arr == NULL) {
+        printf("malloc() failed\n");
+        return 1;
+    }
 
-    struct arm_state *as;
-    unsigned int rv;
+    /* Numbers from -5000 to 5003 in no order, so find_max_a updates its
+    maximum now and then */
+    for(i = 0; i < BENCH_ARRAY_SIZE; i++) {
+        arr[i] = (int) (i * 7919u % 10007) - 5000;
+    }
 
-    int arr[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
-    int arr2[] = {-1,-2,-3,-4,-5,-6,-7,-8,-9, -10};
-    int arr_zero[] = {0, 1, 0, 3, 0, 5, 0, 7, 0, 9};
+    guest_arr = arm_mem_map_host(mem, arr, BENCH_ARRAY_SIZE * sizeof(int), ARM_PROT_READ);
+    if(guest_arr == 0) {
+        printf("arm_mem_map_host() failed\n");
+        free(arr);
+        return 1;
+    }
 
-    int arr_thousand[1000];
-    int i = 0, start = 1000;
+    counters.cycles = bench_counter_open(PERF_COUNT_HW_CPU_CYCLES);
+    counters.instrs = bench_counter_open(PERF_COUNT_HW_INSTRUCTIONS);
+
+    printf("{\n  \"trials\": %d,\n  \"results\": [", trials);
+
+    for(e = 0; e < ENGINE_COUNT; e++) {
+
+        cfg->engine = e;
+
+        for(c = bench_cases; c < bench_cases + BENCH_CASES; c++) {
+
+            /* A single call on the lockstep engine runs on interp */
+            if(e == ENGINE_LOCKSTEP && c->calls == 0) {
+                continue;
+            }
+
+            func = find_function(img, c->func);
+            cycles = 0;
+            instrs = 0;
+            guest_instrs = func == 0 ? -1 : bench_case_run(cfg, mem, func, c, guest_arr, trials,
+                                                           secs, &counters, &cycles, &instrs);
+            if(guest_instrs <= 0) {
+                fprintf(stderr, "%s did not run on %s\n", c->name, arm_engine_names[e]);
+                rv = 1;
+                continue;
+            }
+
+            qsort(secs, trials, sizeof(double), bench_compare);
+            median = trials % 2 ? secs[trials / 2] : (secs[trials / 2 - 1] + secs[trials / 2]) / 2;
+            getrusage(RUSAGE_SELF, &usage);
+
+            printf("%s\n    {\"engine\": \"%s\", \"case\": \"%s\", \"instructions\": %lld, "
+                   "\"mips\": %.2f, \"mips_min\": %.2f, \"mips_max\": %.2f, "
+                   "\"ns_per_instruction\": %.3f, \"host_ipc\": ",
+                   first ? "" : ",", arm_engine_names[e], c->name, guest_instrs,
+                   guest_instrs / median / 1e6, guest_instrs / secs[trials - 1] / 1e6,
+                   guest_instrs / secs[0] / 1e6, median * 1e9 / guest_instrs);
+            if(cycles > 0 && instrs > 0) {
+                printf("%.2f", (double) instrs / cycles);
+            } else {
+                printf("null");
+            }
+            printf(", \"peak_rss_kb\": %ld}", usage.ru_maxrss);
+            fflush(stdout);
+
+            first = false;
 
-    for(i = 0; i < 1000; i++) {
-    	if(i%3 == 0) {
-            arr_thousand[i] = 0;
-        } else {
-            arr_thousand[i] = start;
-            start += 2;
         }
+
     }
 
-    as = arm_state_new(1024, (unsigned int *)find_max_a, (unsigned int)arr, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("\n\nMAX from 1 to 10 = %d\n\n", rv);
+    printf("\n  ]\n}\n");
 
-    as = arm_state_new(1024, (unsigned int *)find_max_a, (unsigned int)arr2, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("MAX from -1 to -10 = %d\n\n", rv);
+    if(counters.cycles >= 0) {
+        close(counters.cycles);
+    }
+    if(counters.instrs >= 0) {
+        close(counters.instrs);
+    }
 
-    as = arm_state_new(1024, (unsigned int *)find_max_a, (unsigned int)arr_zero, 10, 0, 0);
-    rv = arm_state_execute(as);
-    printf("MAX from 0 through 9 = %d\n\n", rv);
+    arm_mem_unmap(mem, guest_arr, BENCH_ARRAY_SIZE * sizeof(int));
+    free(arr);
 
-    as = arm_state_new(1024, (unsigned int *)find_max_a, (unsigned int)arr_thousand, 1000, 0, 0);
-    rv = arm_state_execute(as);
-    printf("MAX from 1000. If i%3 == 0, make a 0, else += 2 = %d\n\n", rv);
+    return rv;
 
-    printf("Max Number of instructions %d\n",as->num_instr);
-    printf("Max Data Instructions %d\n",as->data_instr);
-    printf("Max Memory Instructions %d\n",as->mem_instr);
-    printf("Max Branch Instructions %d\n",as->b_instr);
+}
+
+#if defined(ARM_AOT_TOOL)
+
+/* armemu-aot (make armemu-aot), which writes the C translation of the
+functions named on its command line, and of the functions they call, to
+stdout (see arm_aot_write) */
+
+void usage(char *name) {
+
+    printf("usage: %s image function...\n", name);
 
 }
 
-void test_fib_iter() {
+int main(int argc, char **argv) {
 
-    int j = 0;
-    struct arm_state *as;
-    unsigned int rv;
+    struct arm_aot_gen g;
+    struct arm_mem *mem;
+    const char *error;
+    unsigned int func;
+    int i, rv = 0;
 
-    printf("\n\nFib iter\n\n");
+    if(argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    for(j = 0; j < 20; j++) {
+    mem = arm_mem_new();
+    if(mem == NULL) {
+        fprintf(stderr, "arm_mem_new() failed\n");
+        return 1;
+    }
 
-        as = arm_state_new(1024, (unsigned int *)fib_iter_a, (unsigned int)j, 0, 0, 0);
-        rv = arm_state_execute(as);
-        printf("%d, ", rv);
+    g.img = arm_image_load(mem, argv[1], &error);
+    if(g.img == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], error);
+        arm_mem_free(mem);
+        return 1;
+    }
 
+    g.nfuncs = 0;
+    g.as = arm_state_new(mem, ARM_PAGE_SIZE, 0, 0, 0, 0, 0);
+    if(g.as == NULL) {
+        fprintf(stderr, "arm_state_new() failed\n");
+        arm_image_free(mem, g.img);
+        arm_mem_free(mem);
+        return 1;
     }
 
-    printf("\n\n");
+    for(i = 2; i < argc && rv == 0; i++) {
 
-    printf("Fib Iteration Number of instructions %d\n",as->num_instr);
-    printf("Fib Iteration Data Instructions %d\n",as->data_instr);
-    printf("Fib Iteration Memory Instructions %d\n",as->mem_instr);
-    printf("Fib Iteration Branch Instructions %d\n",as->b_instr);
+        func = find_function(g.img, argv[i]);
+        if(func == 0) {
+            fprintf(stderr, "%s: no function %s\n", argv[1], argv[i]);
+            rv = 1;
+        } else if(!arm_aot_add(&g, func, argv[i])) {
+            fprintf(stderr, "%s: more than %d functions or out of memory\n", argv[i], AOT_MAX_FUNCS);
+            rv = 1;
+        }
+
+    }
+
+    if(rv == 0 && !arm_aot_write(stdout, &g, argv[1])) {
+        fprintf(stderr, "%s: translated code is not all mapped\n", argv[1]);
+        rv = 1;
+    }
+
+    arm_aot_gen_free(&g);
+    arm_state_free(g.as);
+    arm_image_free(mem, g.img);
+    arm_mem_free(mem);
+
+    return rv;
 
 }
 
-void test_fib_rec() {
+#elif !defined(ARM_REPLAY)
 
-    int j = 0;
-    struct arm_state *as;
-    unsigned int rv;
+void usage(char *name) {
 
-    printf("\n\nFib Rec\n\n", rv);
+    printf("usage: %s [-e interp|threaded|block|jit|lockstep] [-t jit_threshold] [-l on|off]\n"
+           "       [-p name] [-m arm1176,i=size/ways/line,d=size/ways/line,mem=cycles] [-r trace]\n"
+           "       [-M on|off] [-a on|off] [-b function [-j threads | -q quantum] [-L limit] | -B trials]\n"
+           "       [-f function [-A val|buf|len|len2|len4,...] [-n runs] [-S seed] [-L limit]]\n"
+           "       [-R snapshot] [-s snapshot [-L instructions]] [image [function [args]]]\n", name);
 
-    for(j = 0; j < 20; j++) {
+}
 
-        as = arm_state_new(1024, (unsigned int *)fib_rec_a, (unsigned int)j, 0, 0, 0);
-        rv = arm_state_execute(as);
-        printf("%d, ",rv);
+int main(int argc, char **argv) {
+
+    struct arm_config cfg;
+    struct arm_timing_config timing_config;
+    struct arm_mem *mem;
+    struct arm_image *img;
+    const char *error;
+    char *batch_func = NULL, *image = DEFAULT_IMAGE, *trace_path = NULL;
+    char *fuzz_func = NULL, *fuzz_args = "", *save_path = NULL, *restore_path = NULL;
+    int i, arg, nthreads, bench_trials = 0, rv = 0;
+    long long quantum = 0, limit = 0, fuzz_runs = 100000;
+    unsigned long long fuzz_seed = 1;
+    bool timed = false, memo = false;
+
+#ifdef ARM_PROFILE
+    char *prof_name = NULL;
+
+    cfg.prof = NULL;
+#endif
+
+    cfg.engine = DEFAULT_ENGINE;
+    cfg.jit_threshold = JIT_THRESHOLD;
+    cfg.idioms = LOOP_IDIOMS;
+    cfg.timing = NULL;
+    cfg.trace = NULL;
+    cfg.memo = NULL;
+#ifdef ARM_AOT
+    cfg.aot = true;
+#endif
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Options come in pairs and end at the image name */
+    for(arg = 1; arg < argc && argv[arg][0] == '-'; arg += 2) {
+
+        if(arg + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if(strcmp(argv[arg], "-e") == 0) {
+
+            for(i = 0; i < ENGINE_COUNT; i++) {
+                if(strcmp(argv[arg + 1], arm_engine_names[i]) == 0) {
+                    break;
+                }
+            }
+
+            if(i == ENGINE_COUNT) {
+                printf("unknown engine %s\n", argv[arg + 1]);
+                return 1;
+            }
+
+            cfg.engine = i;
+
+        } else if(strcmp(argv[arg], "-t") == 0) {
+            cfg.jit_threshold = atoi(argv[arg + 1]);
+
+        } else if(strcmp(argv[arg], "-l") == 0) {
+
+            if(strcmp(argv[arg + 1], "on") != 0 && strcmp(argv[arg + 1], "off") != 0) {
+                printf("-l takes on or off\n");
+                return 1;
+            }
+
+            cfg.idioms = strcmp(argv[arg + 1], "on") == 0;
+
+        } else if(strcmp(argv[arg], "-b") == 0) {
+            batch_func = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-j") == 0) {
+            nthreads = atoi(argv[arg + 1]);
+
+        } else if(strcmp(argv[arg], "-f") == 0) {
+            fuzz_func = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-A") == 0) {
+            fuzz_args = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-n") == 0) {
+            fuzz_runs = atoll(argv[arg + 1]);
+
+        } else if(strcmp(argv[arg], "-S") == 0) {
+            fuzz_seed = strtoull(argv[arg + 1], NULL, 0);
+
+        } else if(strcmp(argv[arg], "-s") == 0) {
+            save_path = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-R") == 0) {
+            restore_path = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-q") == 0) {
+
+            quantum = atoll(argv[arg + 1]);
+            if(quantum < 1) {
+                printf("-q takes at least 1 instruction\n");
+                return 1;
+            }
+
+        } else if(strcmp(argv[arg], "-L") == 0) {
+
+            limit = atoll(argv[arg + 1]);
+            if(limit < 1) {
+                printf("-L takes at least 1 instruction\n");
+                return 1;
+            }
+
+        } else if(strcmp(argv[arg], "-p") == 0) {
+#ifdef ARM_PROFILE
+            prof_name = argv[arg + 1];
+#else
+            printf("-p needs armemu built with -DARM_PROFILE (make armemu_prof)\n");
+            return 1;
+#endif
+
+        } else if(strcmp(argv[arg], "-m") == 0) {
+
+            if(!arm_timing_parse(&timing_config, argv[arg + 1])) {
+                printf("bad timing model %s\n", argv[arg + 1]);
+                return 1;
+            }
+            timed = true;
+
+        } else if(strcmp(argv[arg], "-r") == 0) {
+            trace_path = argv[arg + 1];
+
+        } else if(strcmp(argv[arg], "-M") == 0) {
+
+            if(strcmp(argv[arg + 1], "on") != 0 && strcmp(argv[arg + 1], "off") != 0) {
+                printf("-M takes on or off\n");
+                return 1;
+            }
+
+            memo = strcmp(argv[arg + 1], "on") == 0;
+
+        } else if(strcmp(argv[arg], "-a") == 0) {
+
+            if(strcmp(argv[arg + 1], "on") != 0 && strcmp(argv[arg + 1], "off") != 0) {
+                printf("-a takes on or off\n");
+                return 1;
+            }
+
+#ifdef ARM_AOT
+            cfg.aot = strcmp(argv[arg + 1], "on") == 0;
+#else
+            if(strcmp(argv[arg + 1], "on") == 0) {
+                printf("-a on needs armemu built with the translated guest (make armemu_aot)\n");
+                return 1;
+            }
+#endif
+
+        } else if(strcmp(argv[arg], "-B") == 0) {
+
+            bench_trials = atoi(argv[arg + 1]);
+            if(bench_trials < 1 || bench_trials > BENCH_MAX_TRIALS) {
+                printf("-B takes 1 to %d trials\n", BENCH_MAX_TRIALS);
+                return 1;
+            }
+
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
 
     }
 
-    printf("\n\n");
+    if(arg < argc) {
+        image = argv[arg++];
+    }
 
-    printf("Fib Recursion Number of instructions %d\n",as->num_instr);
-    printf("Fib Recursion Data Instructions %d\n",as->data_instr);
-    printf("Fib Recursion Memory Instructions %d\n",as->mem_instr);
-    printf("Fib Recursion Branch Instructions %d\n",as->b_instr);
+    if(timed && trace_path != NULL) {
+        printf("-m and -r cannot be used together\n");
+        return 1;
+    }
+
+    /* With -B the memo table would answer every trial after the warm up */
+    if(memo && (timed || trace_path != NULL || bench_trials > 0)) {
+        printf("-M cannot be used with -m, -r or -B\n");
+        return 1;
+    }
+
+    /* These run every state on interp, which the benchmark would report
+    under the name of each engine */
+    if(bench_trials > 0 && (timed || trace_path != NULL)) {
+        printf("-B cannot be used with -m or -r\n");
+        return 1;
+    }
+
+#ifdef ARM_AOT
+    /* The translated functions would run in place of every engine */
+    if(bench_trials > 0 && cfg.aot) {
+        printf("-B needs -a off\n");
+        return 1;
+    }
+#endif
+
+    /* The fuzzer has its own state and its own limit */
+    if(fuzz_func != NULL && (batch_func != NULL || bench_trials > 0 || quantum > 0
+                             || timed || trace_path != NULL || memo)) {
+        printf("-f cannot be used with -b, -B, -q, -m, -r or -M\n");
+        return 1;
+    }
+
+    /* Snapshots are of a single call, which the profiler, timing model,
+    trace and memo table would only see part of */
+    if((save_path != NULL || restore_path != NULL)
+       && (batch_func != NULL || bench_trials > 0 || fuzz_func != NULL || quantum > 0
+           || timed || trace_path != NULL || memo)) {
+        printf("-s and -R cannot be used with -b, -B, -f, -q, -m, -r or -M\n");
+        return 1;
+    }
+    if(limit > 0 && restore_path != NULL && save_path == NULL) {
+        printf("-L with -R needs -s\n");
+        return 1;
+    }
+#ifdef ARM_PROFILE
+    if((save_path != NULL || restore_path != NULL) && prof_name != NULL) {
+        printf("-s and -R cannot be used with -p\n");
+        return 1;
+    }
+#endif
+
+    /* The scheduler runs states on their engine alone (see arm_state_run) */
+    if(limit > 0 && quantum == 0 && fuzz_func == NULL && save_path == NULL) {
+        quantum = SCHED_QUANTUM;
+    }
+    if(quantum > 0 && (timed || trace_path != NULL || memo)) {
+        printf("-q and -L cannot be used with -m, -r or -M\n");
+        return 1;
+    }
+#ifdef ARM_PROFILE
+    if(quantum > 0 && prof_name != NULL) {
+        printf("-q and -L cannot be used with -p\n");
+        return 1;
+    }
+    if(fuzz_func != NULL && prof_name != NULL) {
+        printf("-f cannot be used with -p\n");
+        return 1;
+    }
+    if(bench_trials > 0 && prof_name != NULL) {
+        printf("-B cannot be used with -p\n");
+        return 1;
+    }
+    /* arm_state_execute runs a profiled state before looking at memo */
+    if(memo && prof_name != NULL) {
+        printf("-M cannot be used with -p\n");
+        return 1;
+    }
+#endif
+
+    mem = arm_mem_new();
+    if(mem == NULL) {
+        printf("arm_mem_new() failed\n");
+        return 1;
+    }
+
+    img = arm_image_load(mem, image, &error);
+    if(img == NULL) {
+        printf("%s: %s\n", image, error);
+        arm_mem_free(mem);
+        return 1;
+    }
+
+#ifdef ARM_PROFILE
+    /* The profile is not shared between threads, so batch mode uses one,
+    and profiled states run on the interp engine (see arm_state_config) */
+    if(prof_name != NULL) {
+        cfg.prof = arm_prof_new();
+        if(cfg.prof == NULL) {
+            printf("arm_prof_new() failed\n");
+            arm_image_free(mem, img);
+            arm_mem_free(mem);
+            return 1;
+        }
+        nthreads = 1;
+        cfg.engine = ENGINE_INTERP;
+    }
+#endif
+
+    /* The model is not shared between threads either */
+    if(timed) {
+        cfg.timing = arm_timing_new(&timing_config);
+        if(cfg.timing == NULL) {
+            printf("arm_timing_new() failed\n");
+            arm_image_free(mem, img);
+            arm_mem_free(mem);
+            return 1;
+        }
+        nthreads = 1;
+        cfg.engine = ENGINE_INTERP;
+    }
+
+    /* Nor is the trace */
+    if(trace_path != NULL) {
+        cfg.trace = arm_trace_new(trace_path, image);
+        if(cfg.trace == NULL) {
+            printf("cannot write the trace %s\n", trace_path);
+            if(cfg.timing != NULL) {
+                arm_timing_free(cfg.timing);
+            }
+            arm_image_free(mem, img);
+            arm_mem_free(mem);
+            return 1;
+        }
+        nthreads = 1;
+        cfg.engine = ENGINE_INTERP;
+    }
+
+    /* Nor is the memo table */
+    if(memo) {
+        cfg.memo = arm_memo_new();
+        if(cfg.memo == NULL) {
+            printf("arm_memo_new() failed\n");
+#ifdef ARM_PROFILE
+            if(cfg.prof != NULL) {
+                arm_prof_free(cfg.prof);
+            }
+#endif
+            arm_image_free(mem, img);
+            arm_mem_free(mem);
+            return 1;
+        }
+        nthreads = 1;
+        cfg.engine = ENGINE_INTERP;
+    }
+
+    if(bench_trials > 0) {
+        rv = run_bench(&cfg, mem, img, bench_trials);
+
+    } else if(fuzz_func != NULL) {
+        rv = run_fuzz(mem, img, fuzz_func, fuzz_args, fuzz_runs, limit > 0 ? limit : FUZZ_LIMIT, fuzz_seed);
+
+    } else if(batch_func != NULL) {
+        rv = run_batch(&cfg, mem, img, batch_func, nthreads, quantum, limit);
+        if(cfg.timing != NULL) {
+            arm_timing_report(stderr, cfg.timing, "Batch");
+        }
+        if(cfg.memo != NULL) {
+            arm_memo_report(stderr, cfg.memo, "Batch");
+        }
+
+    } else if(arg < argc) {
+        rv = run_call(&cfg, mem, img, argv[arg], &argv[arg + 1], argc - arg - 1,
+                      restore_path, save_path, limit);
+        if(cfg.timing != NULL) {
+            arm_timing_report(stderr, cfg.timing, argv[arg]);
+        }
+        if(cfg.memo != NULL) {
+            arm_memo_report(stderr, cfg.memo, argv[arg]);
+        }
+
+    } else {
+
+        test_sum(&cfg, mem, img);
+
+        test_max(&cfg, mem, img);
+
+        test_fib_iter(&cfg, mem, img);
+
+        test_fib_rec(&cfg, mem, img);
+
+        test_find_str(&cfg, mem, img);
+
+    }
+
+#ifdef ARM_PROFILE
+    if(cfg.prof != NULL) {
+        if(arm_prof_write(cfg.prof, img, prof_name) != 0) {
+            printf("cannot write the profile %s\n", prof_name);
+            rv = 1;
+        }
+        arm_prof_free(cfg.prof);
+    }
+#endif
+
+    if(cfg.timing != NULL) {
+        arm_timing_free(cfg.timing);
+    }
+
+    if(cfg.memo != NULL) {
+        arm_memo_free(cfg.memo);
+    }
+
+    if(cfg.trace != NULL && arm_trace_close(cfg.trace) != 0) {
+        printf("cannot write the trace %s\n", trace_path);
+        rv = 1;
+    }
+
+    arm_image_free(mem, img);
+    arm_mem_free(mem);
+
+    return rv;
+
+}
+
+#else
+
+/* armtrace (make armtrace), which reads the traces of -r. With only the
+trace it says how big it is. With an index it replays the trace from the
+start of the chunk the index is in up to that instruction, running the
+code of the image on the values the trace has for every load, and prints
+the registers just before the instruction runs */
+
+void usage(char *name) {
+
+    printf("usage: %s [-i image] trace [index]\n", name);
 
 }
 
 int main(int argc, char **argv) {
 
-    test_sum();
+    struct arm_trace_reader *r;
+    struct arm_mem *mem;
+    struct arm_image *img;
+    struct arm_state *as;
+    const char *error, *image = NULL, *name;
+    unsigned long long index, instrs = 0, bytes = 0, chunks = 0;
+    unsigned int pc, iw, offset;
+    int arg = 1, rv = 0;
+
+    if(argc > 2 && strcmp(argv[1], "-i") == 0) {
+        image = argv[2];
+        arg = 3;
+    }
+
+    if(arg >= argc || arg + 2 < argc) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    test_max();
+    r = arm_trace_open(argv[arg], &error);
+    if(r == NULL) {
+        printf("%s: %s\n", argv[arg], error);
+        return 1;
+    }
 
-    test_fib_iter();
+    if(arg + 1 == argc) {
 
-    test_fib_rec();
+        while(arm_trace_next_header(r) && fseek(r->f, r->chunk.size, SEEK_CUR) == 0) {
+            instrs += r->chunk.count;
+            bytes += sizeof(struct arm_trace_chunk) + r->chunk.size;
+            chunks++;
+        }
 
-    return 0;
+        printf("%llu instructions of %s in %llu chunks, %llu bytes (%.2f per instruction)\n",
+               instrs, r->header.image, chunks, bytes, instrs == 0 ? 0.0 : (double) bytes / instrs);
+
+        arm_trace_reader_free(r);
+        return 0;
+
+    }
+
+    index = strtoull(argv[arg + 1], NULL, 0);
+    if(image == NULL) {
+        image = r->header.image;
+    }
+
+    mem = arm_mem_new();
+    if(mem == NULL) {
+        printf("arm_mem_new() failed\n");
+        arm_trace_reader_free(r);
+        return 1;
+    }
+
+    img = arm_image_load(mem, image, &error);
+    if(img == NULL) {
+        printf("%s: %s\n", image, error);
+        arm_mem_free(mem);
+        arm_trace_reader_free(r);
+        return 1;
+    }
+
+    as = arm_state_new(mem, 1024, 0, 0, 0, 0, 0);
+    if(as == NULL) {
+        printf("arm_state_new() failed\n");
+        rv = 1;
+
+    } else if(!arm_trace_seek(r, as, index)) {
+        printf("the trace has no instruction %llu\n", index);
+        rv = 1;
+
+    } else {
+
+        for(;;) {
+
+            if(!arm_trace_fetch(r, as, &pc)) {
+                printf("bad trace at instruction %llu\n", r->index);
+                rv = 1;
+                break;
+            }
+
+            if(r->index == index) {
+                break;
+            }
+
+            if(!arm_trace_step(r, as, pc)) {
+                printf("the trace does not match %s at instruction %llu\n", image, r->index - 1);
+                rv = 1;
+                break;
+            }
+
+        }
+
+    }
+
+    if(rv == 0) {
+
+        printf("instruction %llu at 0x%08x", index, pc);
+        name = arm_image_symbol_name(img, pc, &offset);
+        if(name != NULL) {
+            printf(" (%s+0x%x)", name, offset);
+        }
+        if(arm_mem_fetch(as, pc, &iw)) {
+            printf(" 0x%08x", iw);
+        }
+        printf("\n");
+
+        arm_state_print(as);
+
+    }
+
+    if(as != NULL) {
+        arm_state_free(as);
+    }
+    arm_image_free(mem, img);
+    arm_mem_free(mem);
+    arm_trace_reader_free(r);
+
+    return rv;
 
 }
+
+#endif
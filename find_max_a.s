@@ -14,8 +14,7 @@ find_max_a:
         sub sp, sp, #4
 
         mov r2, #0 /* index */
-        ldr r5, [r0]
-        add r0, r0, #4
+        ldr r5, [r0], #4
         add r2, r2, #1
 
 loop:
@@ -23,8 +22,7 @@ loop:
         cmp r2, r1
         beq done
 
-        ldr r4, [r0]
-        add r0, r0, #4
+        ldr r4, [r0], #4
 
         cmp r4, r5
         movgt r5, r4
@@ -0,0 +1,45 @@
+.global find_str_a
+.func find_str_a
+
+/* r0 = string, r1 = substring. Returns the index of the first place the
+substring is found in the string, or -1 */
+
+find_str_a:
+
+        push {r4, r5, r6}
+
+        mov r2, r0 /* start of the match being tried */
+
+outer:
+
+        mov r3, r2 /* string pointer */
+        mov r4, r1 /* substring pointer */
+
+inner:
+
+        ldrb r6, [r4], #1
+        cmp r6, #0
+        beq found
+
+        ldrb r5, [r3], #1
+        cmp r5, r6
+        beq inner
+
+        /* The string ran out before the substring did */
+        cmp r5, #0
+        beq not_found
+
+        add r2, r2, #1
+        b outer
+
+found:
+
+        sub r0, r2, r0
+        pop {r4, r5, r6}
+        bx lr
+
+not_found:
+
+        mvn r0, #0
+        pop {r4, r5, r6}
+        bx lr
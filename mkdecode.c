@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+/* Builds the decode table for armemu from arm_insns.def. The table has one
+entry for every value of bits 27:20 and 7:4 of an instruction word (index =
+bits 27:20 << 4 | bits 7:4) holding the op of the first encoding in
+arm_insns.def that matches. The output is C and is included by armemu.c:
+
+./mkdecode > arm_decode_table.h */
+
+#define TABLE_SIZE 4096
+
+struct insn {
+
+    char *op;
+    char pattern[13];
+
+};
+
+/* Each ARM_DP line becomes three patterns, one per form of operand 2 */
+#define ARM_INSN(op, pattern) {#op, pattern},
+#define ARM_DP(op, opcode, s) \
+    {#op, "001" opcode s "xxxx"}, \
+    {#op, "000" opcode s "xxx0"}, \
+    {#op, "000" opcode s "0xx1"},
+
+struct insn insns[] = {
+#include "arm_insns.def"
+};
+
+#define NINSNS (sizeof(insns) / sizeof(insns[0]))
+
+/* True if index (bits 27:20 and 7:4) matches pattern */
+int matches(char *pattern, unsigned int index) {
+
+    int i;
+    unsigned int bit;
+
+    for(i = 0; i < 12; i++) {
+
+        bit = (index >> (11 - i)) & 1;
+
+        if((pattern[i] == '0' && bit != 0) || (pattern[i] == '1' && bit != 1)) {
+            return 0;
+        }
+
+    }
+
+    return 1;
+
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int index, i;
+    char *op;
+
+    for(i = 0; i < NINSNS; i++) {
+
+        if(strlen(insns[i].pattern) != 12 || strspn(insns[i].pattern, "01x") != 12) {
+            fprintf(stderr, "mkdecode: bad pattern \"%s\" for %s\n", insns[i].pattern, insns[i].op);
+            return 1;
+        }
+
+    }
+
+    printf("/* Generated by mkdecode from arm_insns.def, do not edit */\n\n");
+    printf("const unsigned char arm_decode_table[%d] = {\n", TABLE_SIZE);
+
+    for(index = 0; index < TABLE_SIZE; index++) {
+
+        op = "OP_UNKNOWN";
+        for(i = 0; i < NINSNS; i++) {
+            if(matches(insns[i].pattern, index)) {
+                op = insns[i].op;
+                break;
+            }
+        }
+
+        printf("%s%s,%s", index % 8 == 0 ? "    " : "", op, index % 8 == 7 ? "\n" : " ");
+
+    }
+
+    printf("};\n");
+
+    return 0;
+
+}
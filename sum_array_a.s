@@ -13,8 +13,7 @@ loop:
         cmp r2, r1
         beq done
 
-        ldr r4, [r0]
-	add r0, r0, #4
+        ldr r4, [r0], #4
 
         add r3, r3, r4
         add r2, r2, #1